@@ -0,0 +1,117 @@
+#include "RUDP.h"
+
+// Checks every checksum and CRC32C kernel the CPU can run against the scalar RFC 1071 checksum
+// and the CRC32C table, over buffers of random length, alignment and contents, then measures
+// the throughput of each kernel on packet sized and long buffers. Exits with 1 on a mismatch.
+//
+// ./checksum_test [-rounds <buffers per kernel>] [-seed <seed>]
+
+#define TEST_MAX_KERNELS 8
+#define TEST_MAX_LENGTH 9000                // longest random buffer, a jumbo frame
+#define TEST_ALIGNMENTS 64                  // start offsets tried, a cache line
+#define TEST_LONG_LENGTH (4 * 1024 * 1024)  // past the 128 KB where the scalar 32 bit sum wraps
+#define BENCH_TIME_US 200000                // time each kernel runs on each buffer size
+
+// Function to compare a kernel with its reference on one buffer, returns 1 if they agree
+int sameResult(const RUDPIntegrityKernel* kernel, const RUDPIntegrityKernel* reference, unsigned char* data, unsigned int length);
+
+// Function to measure a kernel on a buffer of length bytes, returns GB/s
+double benchmark(const RUDPIntegrityKernel* kernel, unsigned char* data, unsigned int length);
+
+int main(int argc, char** argv) {
+
+    // Parse command line arguments
+    int rounds = 100000;
+    unsigned int seed = 1;
+    for (int i = 1; i < argc; i += 2) {
+        if (i + 1 < argc && strcmp(argv[i], "-rounds") == 0) {
+            rounds = atoi(argv[i + 1]);
+        } else if (i + 1 < argc && strcmp(argv[i], "-seed") == 0) {
+            seed = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Usage: %s [-rounds <buffers per kernel>] [-seed <seed>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    RUDPIntegrityKernel kernels[TEST_MAX_KERNELS];
+    int count = rudp_integrityKernels(kernels, TEST_MAX_KERNELS);
+    unsigned char* buffer = malloc(TEST_LONG_LENGTH + TEST_ALIGNMENTS);
+    if (buffer == NULL) {
+        printf("malloc() failed\n");
+        return 1;
+    }
+
+    // the known CRC32C of "123456789" pins the table reference down
+    if (calculate_crc32c("123456789", 9) != 0xE3069283) {
+        printf("crc32c: wrong result for \"123456789\"\n");
+        return 1;
+    }
+
+    int failures = 0;
+    for (int k = 0; k < count; k++) {
+        // the first kernel of each kind is the reference of the others
+        const RUDPIntegrityKernel* reference = &kernels[0];
+        for (int r = 0; r < count; r++) {
+            if ((kernels[r].checksum != NULL) == (kernels[k].checksum != NULL)) {
+                reference = &kernels[r];
+                break;
+            }
+        }
+
+        srandom(seed);
+        int mismatches = 0;
+        for (int round = 0; round < rounds; round++) {
+            unsigned int length = random() % (TEST_MAX_LENGTH + 1);
+            unsigned int alignment = random() % TEST_ALIGNMENTS;
+            // every fourth buffer is all ones, the largest words push the sums hardest
+            int ones = round % 4 == 0;
+            for (unsigned int i = 0; i < length; i++) {
+                buffer[alignment + i] = ones ? 0xFF : random();
+            }
+            mismatches += !sameResult(&kernels[k], reference, buffer + alignment, length);
+        }
+        for (unsigned int alignment = 0; alignment < 4; alignment++) {
+            memset(buffer + alignment, 0xFF, TEST_LONG_LENGTH);
+            mismatches += !sameResult(&kernels[k], reference, buffer + alignment, TEST_LONG_LENGTH);
+            mismatches += !sameResult(&kernels[k], reference, buffer + alignment, TEST_LONG_LENGTH - 1);
+        }
+
+        for (unsigned int i = 0; i < TEST_LONG_LENGTH; i++) {
+            buffer[i] = random();
+        }
+        printf("%-16s %s (%d buffers), %6.2f GB/s on %d bytes, %6.2f GB/s on %d MB\n", kernels[k].name,
+               mismatches == 0 ? "matches" : "MISMATCH", rounds + 8, benchmark(&kernels[k], buffer, MESSAGE_SIZE),
+               MESSAGE_SIZE, benchmark(&kernels[k], buffer, TEST_LONG_LENGTH), TEST_LONG_LENGTH / (1024 * 1024));
+        if (mismatches > 0) {
+            printf("%-16s %d buffers differ from %s\n", kernels[k].name, mismatches, reference->name);
+            failures++;
+        }
+    }
+
+    free(buffer);
+    return failures > 0 ? 1 : 0;
+}
+
+int sameResult(const RUDPIntegrityKernel* kernel, const RUDPIntegrityKernel* reference, unsigned char* data, unsigned int length) {
+    if (kernel->checksum != NULL) {
+        return kernel->checksum(data, length) == reference->checksum(data, length);
+    }
+    return kernel->crc32c(data, length) == reference->crc32c(data, length);
+}
+
+double benchmark(const RUDPIntegrityKernel* kernel, unsigned char* data, unsigned int length) {
+    volatile unsigned int sink = 0;
+    long long bytes = 0;
+    long long start = rudp_now();
+    long long elapsed = 0;
+    while (elapsed < BENCH_TIME_US) {
+        for (int i = 0; i < 64; i++) {
+            sink += kernel->checksum != NULL ? kernel->checksum(data, length) : kernel->crc32c(data, length);
+            bytes += length;
+        }
+        elapsed = rudp_now() - start;
+    }
+    (void) sink;
+    return bytes / (elapsed / 1e6) / 1e9;
+}
@@ -0,0 +1,247 @@
+#include "Compression.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// room for the frames of a whole chunk, in the worst case every block is stored
+#define COMPRESS_SLOT_SIZE(chunkSize) ((chunkSize) + ((chunkSize) / COMPRESS_BLOCK_SIZE + 1) * sizeof(CompressFrame))
+
+int compress_parse(const char* name){
+    if (strcmp(name, "deflate") == 0) {
+        return COMPRESS_DEFLATE;
+    }
+    if (strcmp(name, "off") == 0) {
+        return COMPRESS_NONE;
+    }
+    return -1;
+}
+
+const char* compress_name(int codec){
+    return codec == COMPRESS_DEFLATE ? "deflate" : "off";
+}
+
+int compress_init(CompressPipeline* pipeline, FileStream* source, int codec){
+    memset(pipeline, 0, sizeof(*pipeline));
+    pipeline->source = source;
+    pipeline->codec = codec;
+    pipeline->backoff = 1;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
+    for (int i = 0; i < COMPRESS_SLOTS; i++) {
+        pipeline->slots[i] = malloc(COMPRESS_SLOT_SIZE(source->chunkSize));
+        if (pipeline->slots[i] == NULL) {
+            perror("malloc");
+            compress_free(pipeline);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Puts one block into out as a frame, compressed if that saves enough and stored otherwise.
+ * @return the length of the frame
+ */
+static size_t compress_block(CompressPipeline* pipeline, z_stream* deflater, const char* block, size_t length, char* out){
+    CompressFrame frame;
+    char* payload = out + sizeof(frame);
+    size_t wire = length;
+
+    if (pipeline->skip > 0) {
+        pipeline->skip--;
+    } else if (pipeline->codec == COMPRESS_DEFLATE) {
+        // deflate stops once the output buffer is full, so a block that doesn't shrink costs one try only
+        deflateReset(deflater);
+        deflater->next_in = (Bytef *) block;
+        deflater->avail_in = length;
+        deflater->next_out = (Bytef *) payload;
+        deflater->avail_out = length - length * COMPRESS_MIN_SAVING / 16;
+        if (deflate(deflater, Z_FINISH) == Z_STREAM_END) {
+            wire = deflater->total_out;
+            pipeline->backoff = 1;
+        } else {
+            pipeline->skip = pipeline->backoff;
+            pipeline->backoff = pipeline->backoff * 2 < COMPRESS_MAX_SKIP ? pipeline->backoff * 2 : COMPRESS_MAX_SKIP;
+        }
+    }
+    if (wire == length) {
+        memcpy(payload, block, length);
+        pipeline->storedBlocks++;
+    }
+
+    frame.rawLength = htonl(length);
+    frame.wireLength = htonl(wire);
+    memcpy(out, &frame, sizeof(frame));
+    pipeline->blocks++;
+    pipeline->rawBytes += length;
+    pipeline->wireBytes += sizeof(frame) + wire;
+    return sizeof(frame) + wire;
+}
+
+/**
+ * The compressing thread, it runs one chunk ahead of the socket and more while there are free slots.
+ */
+static void* compress_run(void* arg){
+    CompressPipeline* pipeline = arg;
+    z_stream deflater;
+    memset(&deflater, 0, sizeof(deflater));
+    // raw deflate, TCP and RUDP check the data already
+    if (deflateInit2(&deflater, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->finished = -1;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+        return NULL;
+    }
+
+    const char* chunk;
+    ssize_t length;
+    int finished = 1;
+    while ((length = stream_next(pipeline->source, &chunk)) > 0) {
+        pthread_mutex_lock(&pipeline->lock);
+        while (pipeline->produced - pipeline->consumed == COMPRESS_SLOTS && !pipeline->stop) {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        int stop = pipeline->stop;
+        pthread_mutex_unlock(&pipeline->lock);
+        if (stop) {
+            break;
+        }
+
+        // the slot is free, only this thread writes it until it is handed out
+        int slot = pipeline->produced % COMPRESS_SLOTS;
+        size_t used = 0;
+        for (ssize_t offset = 0; offset < length; offset += COMPRESS_BLOCK_SIZE) {
+            size_t block = length - offset < COMPRESS_BLOCK_SIZE ? length - offset : COMPRESS_BLOCK_SIZE;
+            used += compress_block(pipeline, &deflater, chunk + offset, block, pipeline->slots[slot] + used);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->lengths[slot] = used;
+        pipeline->produced++;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+    }
+    if (length < 0) {
+        finished = -1;
+    }
+    deflateEnd(&deflater);
+
+    struct timespec cpu;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->cpu = cpu.tv_sec * 1000.0 + cpu.tv_nsec / 1e6;
+    pipeline->finished = finished;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+int compress_start(CompressPipeline* pipeline){
+    stream_rewind(pipeline->source);
+    pipeline->produced = 0;
+    pipeline->consumed = 0;
+    pipeline->holding = 0;
+    pipeline->finished = 0;
+    pipeline->stop = 0;
+    if (pthread_create(&pipeline->thread, NULL, compress_run, pipeline) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t compress_next(CompressPipeline* pipeline, const char** frames){
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->holding) {
+        pipeline->consumed++;
+        pipeline->holding = 0;
+        pthread_cond_broadcast(&pipeline->changed);
+    }
+    while (pipeline->produced == pipeline->consumed && pipeline->finished == 0) {
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+
+    ssize_t length = pipeline->finished < 0 ? -1 : 0;
+    if (pipeline->produced != pipeline->consumed) {
+        int slot = pipeline->consumed % COMPRESS_SLOTS;
+        *frames = pipeline->slots[slot];
+        length = pipeline->lengths[slot];
+        pipeline->holding = 1;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return length;
+}
+
+void compress_finish(CompressPipeline* pipeline){
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->stop = 1;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    pthread_join(pipeline->thread, NULL);
+}
+
+void compress_print(const CompressPipeline* pipeline){
+    printf("Compression (%s): %llu bytes sent as %llu (%.2fx), %llu of %llu blocks sent as they were\n",
+           compress_name(pipeline->codec), (unsigned long long) pipeline->rawBytes, (unsigned long long) pipeline->wireBytes,
+           pipeline->wireBytes ? (double) pipeline->rawBytes / pipeline->wireBytes : 0.0,
+           (unsigned long long) pipeline->storedBlocks, (unsigned long long) pipeline->blocks);
+}
+
+void compress_free(CompressPipeline* pipeline){
+    for (int i = 0; i < COMPRESS_SLOTS; i++) {
+        free(pipeline->slots[i]);
+        pipeline->slots[i] = NULL;
+    }
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->changed);
+}
+
+int compress_decoderInit(CompressDecoder* decoder, int codec){
+    memset(decoder, 0, sizeof(*decoder));
+    if (codec == COMPRESS_DEFLATE && inflateInit2(&decoder->inflater, -15) != Z_OK) {
+        printf("inflateInit2() failed\n");
+        return -1;
+    }
+    decoder->ready = codec == COMPRESS_DEFLATE;
+    return 0;
+}
+
+int compress_checkFrame(const CompressFrame* frame, uint64_t room){
+    if (frame->rawLength == 0 || frame->rawLength > COMPRESS_BLOCK_SIZE || frame->rawLength > room || frame->wireLength == 0 ||
+        frame->wireLength > frame->rawLength) {
+        return -1;
+    }
+    return 0;
+}
+
+int compress_decode(CompressDecoder* decoder, const CompressFrame* frame, const char* wire, char* raw){
+    if (frame->wireLength == frame->rawLength) {
+        if (wire != raw) {
+            memcpy(raw, wire, frame->rawLength);
+        }
+        return 0;
+    }
+    if (!decoder->ready) {
+        return -1;
+    }
+
+    inflateReset(&decoder->inflater);
+    decoder->inflater.next_in = (Bytef *) wire;
+    decoder->inflater.avail_in = frame->wireLength;
+    decoder->inflater.next_out = (Bytef *) raw;
+    decoder->inflater.avail_out = frame->rawLength;
+    if (inflate(&decoder->inflater, Z_FINISH) != Z_STREAM_END || decoder->inflater.total_out != frame->rawLength) {
+        return -1;
+    }
+    return 0;
+}
+
+void compress_decoderFree(CompressDecoder* decoder){
+    if (decoder->ready) {
+        inflateEnd(&decoder->inflater);
+        decoder->ready = 0;
+    }
+}
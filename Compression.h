@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "FileStream.h"
+
+// codecs, the sender asks for one while setting up, the receiver answers with the one it takes
+#define COMPRESS_NONE 0
+#define COMPRESS_DEFLATE 1  // zlib's raw deflate at level 1, the fastest it has
+
+#define COMPRESS_BLOCK_SIZE (128 * 1024)    // bytes of the file in a frame
+#define COMPRESS_SLOTS 3                    // compressed chunks, one on the socket and the ones made ahead of it
+#define COMPRESS_MAX_SKIP 64                // most blocks sent as they are after an incompressible one
+// a block has to get at least this much smaller (in 1/16) or it is sent as it is
+#define COMPRESS_MIN_SAVING 1
+
+/**
+ * In front of every block on the wire, in network byte order. A block that didn't get smaller is
+ * stored: its wire length is its raw length and its bytes are the file's.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t rawLength;
+    uint32_t wireLength;
+} CompressFrame;
+
+/**
+ * A thread that compresses the chunks of a FileStream into frames ahead of the socket, so the
+ * socket never waits for the compressor while there is a chunk ready. Every chunk of the file
+ * becomes one buffer of frames. After an incompressible block the next ones are sent as they
+ * are without trying, 1, 2, 4 ... up to COMPRESS_MAX_SKIP blocks, until one compresses again.
+ */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    FileStream* source;
+    int codec;
+    char* slots[COMPRESS_SLOTS];        // frames of one chunk each
+    size_t lengths[COMPRESS_SLOTS];
+    uint64_t produced;                  // chunks compressed so far in this run
+    uint64_t consumed;                  // chunks the socket is done with
+    int holding;                        // 1 while the caller has the chunk of slot consumed
+    int finished;                       // 1 once the source is done, -1 if it failed
+    int stop;                           // the caller gives up on the run
+    int skip;                           // blocks left to send without trying
+    int backoff;                        // blocks to skip after the next incompressible one
+    uint64_t rawBytes;                  // file bytes and their bytes on the wire, over all runs
+    uint64_t wireBytes;
+    uint64_t blocks;                    // blocks, and the ones that went as they are
+    uint64_t storedBlocks;
+    double cpu;                         // CPU time the compressing thread took in the last run, in milliseconds
+} CompressPipeline;
+
+/**
+ * Undoes the frames on the receiving side.
+ */
+typedef struct {
+    z_stream inflater;
+    int ready;
+} CompressDecoder;
+
+/**
+ * Parses the name of a codec, "deflate" or "off".
+ * @return the codec, -1 for an unknown name
+ */
+int compress_parse(const char* name);
+
+/**
+ * Name of a codec for the output.
+ */
+const char* compress_name(int codec);
+
+/**
+ * Allocates the chunk buffers for the chunks of source, the codec is one of COMPRESS_*.
+ * @return -1: failure, 0: success
+ */
+int compress_init(CompressPipeline* pipeline, FileStream* source, int codec);
+
+/**
+ * Starts compressing a run of the source from its beginning.
+ * @return -1: failure, 0: success
+ */
+int compress_start(CompressPipeline* pipeline);
+
+/**
+ * Hands out the frames of the next chunk, valid until the next call. Waits while the
+ * compressor is behind.
+ * @return -1: failure, 0: the run is done, otherwise the length of the frames
+ */
+ssize_t compress_next(CompressPipeline* pipeline, const char** frames);
+
+/**
+ * Waits for the compressing thread of the run, it stops early if the run wasn't done.
+ */
+void compress_finish(CompressPipeline* pipeline);
+
+/**
+ * Prints how much smaller the file got on the wire.
+ */
+void compress_print(const CompressPipeline* pipeline);
+
+/**
+ * Releases the chunk buffers.
+ */
+void compress_free(CompressPipeline* pipeline);
+
+/**
+ * Prepares a decoder for frames of the codec.
+ * @return -1: failure, 0: success
+ */
+int compress_decoderInit(CompressDecoder* decoder, int codec);
+
+/**
+ * Checks a frame header in host byte order, the frame may hold at most room file bytes.
+ * @return -1: not a frame, 0: a frame
+ */
+int compress_checkFrame(const CompressFrame* frame, uint64_t room);
+
+/**
+ * Restores the file bytes of one frame, frame in host byte order. A stored frame is copied.
+ * @param raw buffer of frame->rawLength bytes
+ * @return -1: the frame is damaged, 0: success
+ */
+int compress_decode(CompressDecoder* decoder, const CompressFrame* frame, const char* wire, char* raw);
+
+/**
+ * Releases the decoder.
+ */
+void compress_decoderFree(CompressDecoder* decoder);
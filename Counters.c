@@ -0,0 +1,180 @@
+#include "Counters.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* counterNames[COUNTER_COUNT] = {
+    "packets_sent", "packets_received", "retransmits", "timeouts", "checksum_failures",
+    "duplicates", "goodput_bytes", "send_calls", "receive_calls", "fec_recovered",
+    "pacing_wait_us"
+};
+
+__thread CounterBlock* counters_local = NULL;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static CounterBlock* blocks = NULL;             // live threads
+static uint64_t retired[COUNTER_COUNT];         // threads that ended
+static pthread_key_t blockKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+static int statsfd = -1;
+static int interval;
+static struct timespec started;
+
+// a thread ends, its counts move to the retired totals
+static void counters_retire(void* arg){
+    CounterBlock* block = arg;
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        retired[i] += block->values[i];
+    }
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        blocks = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    pthread_mutex_unlock(&lock);
+    counters_local = NULL;
+    free(block);
+}
+
+static void counters_createKey(void){
+    pthread_key_create(&blockKey, counters_retire);
+}
+
+CounterBlock* counters_attach(void){
+    CounterBlock* block = calloc(1, sizeof(CounterBlock));
+    if (block == NULL) {
+        return NULL;
+    }
+    pthread_once(&keyOnce, counters_createKey);
+    pthread_mutex_lock(&lock);
+    block->next = blocks;
+    if (blocks != NULL) {
+        blocks->prev = block;
+    }
+    blocks = block;
+    pthread_mutex_unlock(&lock);
+    pthread_setspecific(blockKey, block);
+    counters_local = block;
+    return block;
+}
+
+void counters_snapshot(uint64_t values[COUNTER_COUNT]){
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        values[i] = retired[i];
+    }
+    for (CounterBlock* block = blocks; block != NULL; block = block->next) {
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            values[i] += __atomic_load_n(&block->values[i], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// milliseconds since counters_start()
+static long long counters_elapsed(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started.tv_sec) * 1000LL + (now.tv_nsec - started.tv_nsec) / 1000000;
+}
+
+// one CSV line in the stats file, a single write so it never tears
+static void counters_writeLine(void){
+    uint64_t values[COUNTER_COUNT];
+    char line[512];
+    counters_snapshot(values);
+    int length = snprintf(line, sizeof(line), "%lld", counters_elapsed());
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        length += snprintf(line + length, sizeof(line) - length, ",%llu", (unsigned long long) values[i]);
+    }
+    length += snprintf(line + length, sizeof(line) - length, "\n");
+    if (write(statsfd, line, length) != length) {
+        perror("write");
+    }
+}
+
+// the same on stderr, so it doesn't mix with what the program prints on stdout
+static void counters_printLine(void){
+    uint64_t values[COUNTER_COUNT];
+    counters_snapshot(values);
+    flockfile(stderr);
+    fprintf(stderr, "counters: time_ms=%lld", counters_elapsed());
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        fprintf(stderr, " %s=%llu", counterNames[i], (unsigned long long) values[i]);
+    }
+    fprintf(stderr, "\n");
+    funlockfile(stderr);
+}
+
+static void counters_atExit(void){
+    counters_writeLine();
+}
+
+// waits for SIGUSR1 and the next line of the stats file
+static void* counters_dump(void* arg){
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    struct timespec wait = {interval / 1000, (interval % 1000) * 1000000L};
+
+    while (1) {
+        int signal = statsfd != -1 ? sigtimedwait(&signals, NULL, &wait) : sigwaitinfo(&signals, NULL);
+        if (signal == SIGUSR1) {
+            counters_printLine();
+        } else if (signal == -1 && errno == EAGAIN) {
+            counters_writeLine();
+        }
+    }
+    return NULL;
+}
+
+int counters_start(const char* path, int intervalMs){
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    interval = intervalMs > 0 ? intervalMs : COUNTERS_DEFAULT_INTERVAL;
+
+    if (path != NULL) {
+        struct stat fileStat;
+        statsfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (statsfd == -1) {
+            perror("open");
+            return -1;
+        }
+        if (fstat(statsfd, &fileStat) == 0 && fileStat.st_size == 0) {
+            char header[256];
+            int length = snprintf(header, sizeof(header), "time_ms");
+            for (int i = 0; i < COUNTER_COUNT; i++) {
+                length += snprintf(header + length, sizeof(header) - length, ",%s", counterNames[i]);
+            }
+            length += snprintf(header + length, sizeof(header) - length, "\n");
+            if (write(statsfd, header, length) != length) {
+                perror("write");
+            }
+        }
+        atexit(counters_atExit);
+    }
+
+    // only the dump thread takes SIGUSR1, the threads created later inherit the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, counters_dump, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#define COUNTERS_DEFAULT_INTERVAL 1000 // milliseconds between the lines of the stats file
+
+// What the protocol paths count, TCP only sees its own system calls and bytes, the packets are the kernel's
+typedef enum {
+    COUNTER_PACKETS_SENT,
+    COUNTER_PACKETS_RECEIVED,
+    COUNTER_RETRANSMITS,
+    COUNTER_TIMEOUTS,           // retransmission timer expirations
+    COUNTER_CHECKSUM_FAILURES,
+    COUNTER_DUPLICATES,         // packets that arrived a second time
+    COUNTER_GOODPUT_BYTES,      // payload delivered to (or accepted from) the application
+    COUNTER_SEND_CALLS,         // system calls that sent
+    COUNTER_RECEIVE_CALLS,      // system calls that received
+    COUNTER_FEC_RECOVERED,      // lost packets rebuilt from parity, without a retransmission
+    COUNTER_PACING_WAIT_US,     // time the RUDP token bucket held datagrams back
+    COUNTER_COUNT
+} CounterId;
+
+/**
+ * The counters of one thread. Only the owning thread writes them, with relaxed atomic
+ * loads and stores that compile to plain instructions, so counting costs no locked
+ * instruction and no shared cache line. Readers add up the blocks of all threads.
+ */
+typedef struct CounterBlock {
+    uint64_t values[COUNTER_COUNT];
+    struct CounterBlock* next;  // list of the live blocks
+    struct CounterBlock* prev;
+} CounterBlock;
+
+extern __thread CounterBlock* counters_local;
+
+/**
+ * Gives the calling thread its block, the counts of a thread that ends are kept.
+ * @return the block, NULL when out of memory
+ */
+CounterBlock* counters_attach(void);
+
+/**
+ * Adds amount to a counter of the calling thread.
+ */
+static inline void counters_add(CounterId id, uint64_t amount){
+    CounterBlock* block = counters_local != NULL ? counters_local : counters_attach();
+    if (block != NULL) {
+        __atomic_store_n(&block->values[id], __atomic_load_n(&block->values[id], __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * The totals of all threads so far.
+ */
+void counters_snapshot(uint64_t values[COUNTER_COUNT]);
+
+/**
+ * Starts the thread that prints the counters to stderr on SIGUSR1 and, if path isn't NULL,
+ * appends them as a CSV line to path every intervalMs milliseconds and once more at exit.
+ * Call it before any other thread is created, SIGUSR1 is blocked in the threads it creates.
+ * @return -1: failure, 0: success
+ */
+int counters_start(const char* path, int intervalMs);
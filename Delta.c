@@ -0,0 +1,115 @@
+#include "Delta.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+
+// blocks read at a time while hashing the file
+#define DELTA_READ_BLOCKS 16
+
+int delta_init(DeltaTable* table, uint64_t offset, uint64_t length){
+    memset(table, 0, sizeof(*table));
+    table->offset = offset;
+    table->length = length;
+    table->blocks = (length + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+    table->hashes = calloc(table->blocks ? table->blocks : 1, DELTA_HASH_SIZE);
+    if (table->hashes == NULL) {
+        printf("calloc() failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+size_t delta_tableSize(const DeltaTable* table){
+    return table->blocks * DELTA_HASH_SIZE;
+}
+
+size_t delta_blockLength(const DeltaTable* table, uint64_t index){
+    uint64_t start = index * DELTA_BLOCK_SIZE;
+    return table->length - start < DELTA_BLOCK_SIZE ? table->length - start : DELTA_BLOCK_SIZE;
+}
+
+/**
+ * SHA-256 of one block, a changed block that keeps its hash is out of reach in practice.
+ */
+static void delta_hash(const char* data, size_t length, unsigned char* hash){
+    EVP_Digest(data, length, hash, NULL, EVP_sha256(), NULL);
+}
+
+int delta_hashFile(DeltaTable* table, int fd){
+    char* buffer = malloc(DELTA_READ_BLOCKS * DELTA_BLOCK_SIZE);
+    if (buffer == NULL) {
+        printf("malloc() failed\n");
+        return -1;
+    }
+
+    for (uint64_t index = 0; index < table->blocks; index += DELTA_READ_BLOCKS) {
+        uint64_t start = index * DELTA_BLOCK_SIZE;
+        size_t length = table->length - start < DELTA_READ_BLOCKS * DELTA_BLOCK_SIZE ? table->length - start : DELTA_READ_BLOCKS * DELTA_BLOCK_SIZE;
+        size_t got = 0;
+        while (got < length) {
+            ssize_t readBytes = pread(fd, buffer + got, length - got, table->offset + start + got);
+            if (readBytes <= 0) {
+                // a file shorter than the range reads as zeros, its blocks differ from the sender's
+                if (readBytes < 0) {
+                    perror("pread");
+                    free(buffer);
+                    return -1;
+                }
+                memset(buffer + got, 0, length - got);
+                break;
+            }
+            got += readBytes;
+        }
+
+        for (uint64_t block = index; block < table->blocks && block < index + DELTA_READ_BLOCKS; block++) {
+            delta_hash(buffer + (block - index) * DELTA_BLOCK_SIZE, delta_blockLength(table, block),
+                       table->hashes + block * DELTA_HASH_SIZE);
+        }
+    }
+
+    free(buffer);
+    return 0;
+}
+
+int delta_update(DeltaTable* table, uint64_t index, const char* data, size_t length){
+    unsigned char hash[DELTA_HASH_SIZE];
+    unsigned char* known = table->hashes + index * DELTA_HASH_SIZE;
+
+    delta_hash(data, length, hash);
+    table->checkedBlocks++;
+    table->coveredBytes += length;
+    if (memcmp(hash, known, DELTA_HASH_SIZE) == 0) {
+        return 0;
+    }
+    memcpy(known, hash, DELTA_HASH_SIZE);
+    table->changedBlocks++;
+    table->changedBytes += length;
+    return 1;
+}
+
+int delta_checkRecord(const DeltaRecord* record, uint64_t offset, uint64_t length){
+    if (record->offset == DELTA_END) {
+        return record->length <= length ? 1 : -1;
+    }
+    if (record->offset < offset || record->offset - offset >= length || (record->offset - offset) % DELTA_BLOCK_SIZE != 0) {
+        return -1;
+    }
+    uint64_t room = length - (record->offset - offset);
+    if (record->length == 0 || record->length > DELTA_BLOCK_SIZE || record->length > room) {
+        return -1;
+    }
+    return 0;
+}
+
+void delta_print(const DeltaTable* table){
+    printf("Delta (sha256, %d KB blocks): %llu of %llu blocks sent again, %.2fMB of %.2fMB\n", DELTA_BLOCK_SIZE / 1024,
+           (unsigned long long) table->changedBlocks, (unsigned long long) table->checkedBlocks,
+           table->changedBytes / (1024.0 * 1024), table->coveredBytes / (1024.0 * 1024));
+}
+
+void delta_free(DeltaTable* table){
+    free(table->hashes);
+    table->hashes = NULL;
+}
@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DELTA_BLOCK_SIZE (64 * 1024)   // bytes of the file a hash stands for, STREAM_CHUNK_SIZE is a multiple of it
+#define DELTA_HASH_SIZE 32             // SHA-256 of a block
+#define DELTA_END UINT64_MAX           // offset of the record that ends a run
+
+/**
+ * In front of every changed block on the wire, in network byte order. The last record of a run
+ * has offset DELTA_END, no bytes follow it and its length is the bytes of the file the run covered.
+ */
+typedef struct __attribute__((packed)) {
+    uint64_t offset;    // of the block in the file
+    uint64_t length;
+} DeltaRecord;
+
+/**
+ * Hashes of the blocks of a range of the file, block i starts DELTA_BLOCK_SIZE * i bytes into
+ * the range and the last one may be shorter. The receiver's copy of the file is what the hashes
+ * stand for, a run after the first sends only the blocks whose hash differs.
+ */
+typedef struct {
+    uint64_t offset;            // range of the file
+    uint64_t length;
+    uint64_t blocks;
+    unsigned char* hashes;      // DELTA_HASH_SIZE bytes per block
+    uint64_t checkedBlocks;     // blocks the delta runs looked at, and the ones that changed
+    uint64_t changedBlocks;
+    uint64_t coveredBytes;      // bytes of the file the delta runs kept up to date, and the changed ones
+    uint64_t changedBytes;
+} DeltaTable;
+
+/**
+ * Allocates the hashes of length bytes from offset on, all of them zero.
+ * @return -1: failure, 0: success
+ */
+int delta_init(DeltaTable* table, uint64_t offset, uint64_t length);
+
+/**
+ * Bytes of the hashes, as they go on the wire.
+ */
+size_t delta_tableSize(const DeltaTable* table);
+
+/**
+ * Length of block index of the range.
+ */
+size_t delta_blockLength(const DeltaTable* table, uint64_t index);
+
+/**
+ * Hashes every block of the range as it is in the file now.
+ * @return -1: failure, 0: success
+ */
+int delta_hashFile(DeltaTable* table, int fd);
+
+/**
+ * Hashes block index of the range, keeps the hash and counts the block.
+ * @return 1: the block differs from the one in the table, 0: it is the same
+ */
+int delta_update(DeltaTable* table, uint64_t index, const char* data, size_t length);
+
+/**
+ * Checks a record in host byte order against length bytes of the file from offset on.
+ * @return -1: not a record of the range, 0: a changed block, 1: the end of the run
+ */
+int delta_checkRecord(const DeltaRecord* record, uint64_t offset, uint64_t length);
+
+/**
+ * Prints how much of the file the delta runs sent again.
+ */
+void delta_print(const DeltaTable* table);
+
+/**
+ * Releases the hashes.
+ */
+void delta_free(DeltaTable* table);
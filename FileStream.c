@@ -0,0 +1,117 @@
+#include "FileStream.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Drops the mapping of the previous chunk, its pages stay in the page cache.
+ */
+static void stream_unmap(FileStream* stream){
+    if (stream->map != NULL) {
+        munmap(stream->map, stream->mapLength);
+        stream->map = NULL;
+        stream->mapLength = 0;
+    }
+}
+
+/**
+ * Asks the kernel to start reading the chunk after the one being sent.
+ */
+static void stream_prefetch(FileStream* stream, uint64_t offset){
+    if (offset < stream->end) {
+        posix_fadvise(stream->fd, offset, stream->chunkSize, POSIX_FADV_WILLNEED);
+    }
+}
+
+int stream_open(FileStream* stream, const char* path, size_t chunkSize){
+    struct stat fileStat;
+    long pageSize = sysconf(_SC_PAGESIZE);
+
+    stream->fd = open(path, O_RDONLY);
+    if (stream->fd == -1 || fstat(stream->fd, &fileStat) == -1) {
+        perror("open");
+        return -1;
+    }
+    stream->size = (uint64_t) fileStat.st_size;
+    stream->offset = 0;
+    stream->start = 0;
+    stream->end = stream->size;
+    // mapping offsets have to be page aligned
+    stream->chunkSize = (chunkSize + pageSize - 1) / pageSize * pageSize;
+    stream->map = NULL;
+    stream->mapLength = 0;
+    stream->buffer = NULL;
+
+    posix_fadvise(stream->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    stream_prefetch(stream, 0);
+    return 0;
+}
+
+ssize_t stream_next(FileStream* stream, const char** chunk){
+    stream_unmap(stream);
+    if (stream->offset >= stream->end) {
+        return 0;
+    }
+
+    size_t length = stream->end - stream->offset < stream->chunkSize ? stream->end - stream->offset : stream->chunkSize;
+    stream_prefetch(stream, stream->offset + length);
+
+    if (stream->buffer == NULL) {
+        void* map = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, stream->fd, stream->offset);
+        if (map != MAP_FAILED) {
+            stream->map = map;
+            stream->mapLength = length;
+            stream->offset += length;
+            *chunk = stream->map;
+            return length;
+        }
+        // not mappable (a pipe, some file systems), read into a buffer from here on
+        stream->buffer = malloc(stream->chunkSize);
+        if (stream->buffer == NULL) {
+            perror("malloc");
+            return -1;
+        }
+    }
+
+    size_t done = 0;
+    while (done < length) {
+        ssize_t got = pread(stream->fd, stream->buffer + done, length - done, stream->offset + done);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            perror("pread");
+            return -1;
+        }
+        done += got;
+    }
+    stream->offset += length;
+    *chunk = stream->buffer;
+    return length;
+}
+
+void stream_rewind(FileStream* stream){
+    stream_unmap(stream);
+    stream->offset = stream->start;
+    stream_prefetch(stream, stream->start);
+}
+
+void stream_range(FileStream* stream, uint64_t offset, uint64_t length){
+    stream->start = offset < stream->size ? offset : stream->size;
+    stream->end = length < stream->size - stream->start ? stream->start + length : stream->size;
+    stream_rewind(stream);
+}
+
+void stream_close(FileStream* stream){
+    stream_unmap(stream);
+    free(stream->buffer);
+    stream->buffer = NULL;
+    if (stream->fd != -1) {
+        close(stream->fd);
+        stream->fd = -1;
+    }
+}
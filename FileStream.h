@@ -0,0 +1,51 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // MAP_POPULATE
+#endif
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STREAM_CHUNK_SIZE (1 << 20) // bytes handed to the socket at a time, a multiple of the page size
+
+/**
+ * Reads a file front to back one chunk at a time, so memory stays at two chunks whatever the file size.
+ * The chunk being sent is mapped (or read when the file can't be mapped) while the kernel
+ * already loads the next one in the background.
+ */
+typedef struct {
+    int fd;
+    uint64_t size;      // total size of the file
+    uint64_t offset;    // file offset of the next chunk
+    uint64_t start;     // range of the file that is streamed, the whole file unless stream_range() narrowed it
+    uint64_t end;
+    size_t chunkSize;
+    char* map;          // mapping of the current chunk, NULL when reading into buffer
+    size_t mapLength;
+    char* buffer;       // chunk buffer for files that can't be mapped
+} FileStream;
+
+/**
+ * Opens the file for streaming.
+ * @return -1: failure, 0: success
+ */
+int stream_open(FileStream* stream, const char* path, size_t chunkSize);
+
+/**
+ * Hands out the next chunk of the file, valid until the next call.
+ * @return -1: failure, 0: end of the file, otherwise the length of the chunk
+ */
+ssize_t stream_next(FileStream* stream, const char** chunk);
+
+/**
+ * Starts over from the beginning of the range.
+ */
+void stream_rewind(FileStream* stream);
+
+/**
+ * Streams only length bytes from offset on, offset has to be a multiple of the page size.
+ */
+void stream_range(FileStream* stream, uint64_t offset, uint64_t length);
+
+/**
+ * Releases the mapping, the buffer and the file.
+ */
+void stream_close(FileStream* stream);
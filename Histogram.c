@@ -0,0 +1,96 @@
+#include "Histogram.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// bucket of a value: the top HIST_SUB_BITS bits of it and the power of two they start at
+static int hist_index(uint64_t value){
+    if (value < HIST_SUB_COUNT) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS + 1;
+    if (shift > HIST_MAX_BITS - HIST_SUB_BITS) {
+        return HIST_BUCKETS - 1;
+    }
+    return HIST_SUB_COUNT + (shift - 1) * (HIST_SUB_COUNT / 2) + (int) (value >> shift) - HIST_SUB_COUNT / 2;
+}
+
+// largest value that falls into the bucket
+static uint64_t hist_upper(int index){
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+    int shift = (index - HIST_SUB_COUNT) / (HIST_SUB_COUNT / 2) + 1;
+    uint64_t sub = (index - HIST_SUB_COUNT) % (HIST_SUB_COUNT / 2) + HIST_SUB_COUNT / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+void hist_init(Histogram* histogram){
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void hist_record(Histogram* histogram, uint64_t value){
+    histogram->counts[hist_index(value)]++;
+    histogram->total++;
+    histogram->sum += value;
+    if (value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+void hist_merge(Histogram* into, const Histogram* from){
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+uint64_t hist_percentile(const Histogram* histogram, double percentile){
+    if (histogram->total == 0) {
+        return 0;
+    }
+
+    // the rank of the value, counted from 1
+    uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            // the bucket may reach past the largest value that was recorded
+            uint64_t upper = hist_upper(i);
+            return upper < histogram->max ? upper : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void hist_print(const char* name, const Histogram* histogram){
+    if (histogram->total == 0) {
+        printf("- %s: no samples\n", name);
+        return;
+    }
+    printf("- %s: mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus (%llu samples)\n", name,
+           histogram->sum / histogram->total / 1000.0, hist_percentile(histogram, 50) / 1000.0,
+           hist_percentile(histogram, 90) / 1000.0, hist_percentile(histogram, 99) / 1000.0,
+           hist_percentile(histogram, 99.9) / 1000.0, histogram->max / 1000.0, (unsigned long long) histogram->total);
+}
+
+uint64_t hist_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
@@ -0,0 +1,51 @@
+#include <stdint.h>
+
+#define HIST_SUB_BITS 7                         // a value keeps its top 7 bits, it is off by less than 1.6%
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 48                        // values up to 2^48 ns (about 78 hours), larger ones count as the max
+#define HIST_BUCKETS (HIST_SUB_COUNT + (HIST_MAX_BITS - HIST_SUB_BITS) * (HIST_SUB_COUNT / 2))
+
+/**
+ * HDR-style histogram of durations in nanoseconds. Values below HIST_SUB_COUNT get a bucket each,
+ * above that every power of two is split into HIST_SUB_COUNT / 2 equal buckets, so the relative
+ * error stays the same from nanoseconds to hours. Recording is a few instructions and the size
+ * is fixed (about 22 KB), so one can be kept per connection and filled per packet.
+ */
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;     // values recorded
+    uint64_t min;
+    uint64_t max;
+    double sum;         // for the mean
+} Histogram;
+
+/**
+ * Empties the histogram.
+ */
+void hist_init(Histogram* histogram);
+
+/**
+ * Counts one value.
+ */
+void hist_record(Histogram* histogram, uint64_t value);
+
+/**
+ * Adds the values of from to into, e.g. of the connections of a striped transfer.
+ */
+void hist_merge(Histogram* into, const Histogram* from);
+
+/**
+ * The value at or below which percentile % of the values are, the upper end of its bucket.
+ * @return 0 for an empty histogram
+ */
+uint64_t hist_percentile(const Histogram* histogram, double percentile);
+
+/**
+ * Prints "- <name>: p50=... p90=... p99=... p99.9=... max=... (<count> samples)" in microseconds.
+ */
+void hist_print(const char* name, const Histogram* histogram);
+
+/**
+ * Time of the monotonic clock in nanoseconds.
+ */
+uint64_t hist_now();
@@ -0,0 +1,616 @@
+#define _GNU_SOURCE // ppoll()
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define MAX_DATAGRAM 65536
+#define TCP_CHUNK_SIZE 16384         // bytes read from a TCP connection at a time
+#define TCP_QUEUE_LIMIT (4 << 20)    // a TCP direction stops reading while this much waits in the proxy
+#define MAX_CLIENTS 64               // UDP senders or TCP connections at a time
+#define CLIENT_IDLE_US 60000000LL    // a UDP sender that was quiet this long is forgotten
+#define DEFAULT_QUEUE 1000           // packets a UDP direction holds before it drops (tail drop, like a router)
+
+// What the link does to the packets, the same in both directions
+struct Impairment {
+    double loss;        // probabilities between 0 and 1
+    double reorder;
+    double duplicate;
+    double corrupt;
+    long long delay;    // one way delay in microseconds
+    long long jitter;   // the delay varies by up to this much either way
+    double rate;        // bytes per microsecond, 0 for no limit
+    int queue;          // packets a UDP direction holds at most
+};
+
+// One direction between a sender and the receiver, with its own random numbers so runs repeat
+struct Link {
+    const char* name;
+    int fd;
+    struct sockaddr_in to;      // destination of a datagram link that isn't connected
+    bool connected;
+    bool datagram;
+    uint64_t random;
+    long long* nextFree;        // the rate limit keeps the wire busy until then, all senders share it
+    long long lastRelease;      // a TCP stream keeps its order
+    size_t queuedBytes;
+    int queuedPackets;
+    bool ended;                 // a TCP direction saw the end of its stream
+    long long forwarded, lost, dropped, duplicated, corrupted, reordered;
+};
+
+// A packet, or a chunk of a TCP stream, that waits for its time to leave
+struct Packet {
+    long long release;          // microseconds
+    unsigned long long order;   // arrival order, breaks ties between the same release times
+    struct Link* link;
+    size_t length;              // 0 marks the end of a TCP stream
+    char data[];
+};
+
+// A UDP sender with its own socket towards the receiver, so the answers find their way back
+// A TCP connection is the same pair of links over two sockets
+struct Client {
+    bool used;
+    struct sockaddr_in address;
+    int clientfd;               // TCP only, UDP answers go out of the listening socket
+    int targetfd;
+    long long lastActive;
+    struct Link up;             // sender to receiver
+    struct Link down;           // receiver to sender
+};
+
+// Packets ordered by release time
+struct Heap {
+    struct Packet** packets;
+    int count;
+    int capacity;
+};
+
+static volatile sig_atomic_t stopped = 0;
+
+// Function to get the time of a monotonic clock in microseconds
+long long now();
+
+// Function to get the next number of the link's random sequence, between 0 and 1
+double nextRandom(struct Link* link);
+
+// Function to pass a packet (or TCP chunk) through the impairments and queue its copies
+void impair(struct Heap* heap, struct Impairment* impairment, struct Link* link, const char* data, size_t length);
+
+// Function to send the packets whose time has come
+void releasePackets(struct Heap* heap);
+
+// Function to add a packet to the heap
+void heapPush(struct Heap* heap, struct Packet* packet);
+
+// Function to take the packet with the earliest release time from the heap
+struct Packet* heapPop(struct Heap* heap);
+
+// Function to set up a link's counters and random sequence
+void linkInit(struct Link* link, const char* name, int fd, uint64_t seed, long long* wire);
+
+// Function to print what a link did to its packets
+void printLink(struct Link* link);
+
+// Function to forget a client and print its statistics, queued packets of it are dropped
+void closeClient(struct Heap* heap, struct Client* client);
+
+static void stop(int signal) {
+    (void) signal;
+    stopped = 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char* usage = "Usage: %s -p <listen port> -ip <receiver ip> -to <receiver port> [-proto udp|tcp] [-loss <%%>] [-delay <ms>] "
+                        "[-jitter <ms>] [-reorder <%%>] [-duplicate <%%>] [-corrupt <%%>] [-rate <Mbit/s>] [-queue <packets>] [-seed <number>]\n";
+
+    // Check command line arguments
+    if (argc < 7 || argc % 2 == 0) {
+        fprintf(stderr, usage, argv[0]);
+        exit(1);
+    }
+
+    // Parse command line arguments
+    int port = 0, targetPort = 0;
+    char *targetIp = NULL;
+    bool tcp = false;
+    uint64_t seed = 1;
+    struct Impairment impairment;
+    memset(&impairment, 0, sizeof(impairment));
+    impairment.queue = DEFAULT_QUEUE;
+    for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "-p") == 0) {
+            port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-ip") == 0) {
+            targetIp = argv[i + 1];
+        } else if (strcmp(argv[i], "-to") == 0) {
+            targetPort = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-proto") == 0 && (strcmp(argv[i + 1], "udp") == 0 || strcmp(argv[i + 1], "tcp") == 0)) {
+            tcp = strcmp(argv[i + 1], "tcp") == 0;
+        } else if (strcmp(argv[i], "-loss") == 0) {
+            impairment.loss = atof(argv[i + 1]) / 100;
+        } else if (strcmp(argv[i], "-delay") == 0) {
+            impairment.delay = atof(argv[i + 1]) * 1000;
+        } else if (strcmp(argv[i], "-jitter") == 0) {
+            impairment.jitter = atof(argv[i + 1]) * 1000;
+        } else if (strcmp(argv[i], "-reorder") == 0) {
+            impairment.reorder = atof(argv[i + 1]) / 100;
+        } else if (strcmp(argv[i], "-duplicate") == 0) {
+            impairment.duplicate = atof(argv[i + 1]) / 100;
+        } else if (strcmp(argv[i], "-corrupt") == 0) {
+            impairment.corrupt = atof(argv[i + 1]) / 100;
+        } else if (strcmp(argv[i], "-rate") == 0) {
+            impairment.rate = atof(argv[i + 1]) * 1e6 / 8 / 1e6;
+        } else if (strcmp(argv[i], "-queue") == 0) {
+            impairment.queue = atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : 1;
+        } else if (strcmp(argv[i], "-seed") == 0) {
+            seed = strtoull(argv[i + 1], NULL, 10);
+        } else {
+            fprintf(stderr, usage, argv[0]);
+            exit(1);
+        }
+    }
+
+    struct sockaddr_in listenAddress, targetAddress;
+    memset(&listenAddress, 0, sizeof(listenAddress));
+    listenAddress.sin_family = AF_INET;
+    listenAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+    listenAddress.sin_port = htons(port);
+    memset(&targetAddress, 0, sizeof(targetAddress));
+    targetAddress.sin_family = AF_INET;
+    targetAddress.sin_port = htons(targetPort);
+    if (targetIp == NULL || inet_pton(AF_INET, targetIp, &targetAddress.sin_addr) != 1) {
+        fprintf(stderr, usage, argv[0]);
+        exit(1);
+    }
+
+    // A byte stream can only be slowed down, losing or changing bytes would break it
+    if (tcp && (impairment.loss > 0 || impairment.reorder > 0 || impairment.duplicate > 0 || impairment.corrupt > 0)) {
+        printf("TCP streams only get the delay, jitter and rate limit, the kernel's TCP hides the other impairments\n");
+    }
+
+    int listenfd = socket(AF_INET, tcp ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (listenfd == -1) {
+        perror("socket");
+        exit(1);
+    }
+    int enable = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    if (bind(listenfd, (struct sockaddr *) &listenAddress, sizeof(listenAddress)) == -1) {
+        perror("bind");
+        exit(1);
+    }
+    if (tcp && listen(listenfd, MAX_CLIENTS) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("Relaying %s port %d to %s:%d (loss %.2f%%, delay %.2fms, jitter %.2fms, reorder %.2f%%, duplicate %.2f%%, "
+           "corrupt %.2f%%, rate %.2fMbit/s, seed %llu)\n", tcp ? "TCP" : "UDP", port, targetIp, targetPort,
+           impairment.loss * 100, impairment.delay / 1000.0, impairment.jitter / 1000.0, impairment.reorder * 100,
+           impairment.duplicate * 100, impairment.corrupt * 100, impairment.rate * 8, (unsigned long long) seed);
+
+    struct Client clients[MAX_CLIENTS];
+    struct Heap heap = {NULL, 0, 0};
+    struct pollfd pfds[2 * MAX_CLIENTS + 1];
+    struct Client* pollClients[2 * MAX_CLIENTS + 1];
+    char* buffer = malloc(MAX_DATAGRAM);
+    int nextClient = 0;
+    long long upWire = 0, downWire = 0;
+    memset(clients, 0, sizeof(clients));
+    if (buffer == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    while (!stopped) {
+        // Wake up for the next packet that is due, or for new data
+        struct timespec timeout, *wait = NULL;
+        if (heap.count > 0) {
+            long long until = heap.packets[0]->release - now();
+            until = until > 0 ? until : 0;
+            timeout.tv_sec = until / 1000000;
+            timeout.tv_nsec = until % 1000000 * 1000;
+            wait = &timeout;
+        }
+
+        int numPfds = 0;
+        pfds[numPfds].fd = listenfd;
+        pfds[numPfds].events = POLLIN;
+        pollClients[numPfds++] = NULL;
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            struct Client* client = &clients[i];
+            if (!client->used) {
+                continue;
+            }
+            // a TCP direction that has a lot waiting stops reading, the sender feels the rate limit
+            if (client->targetfd != -1 && !client->down.ended && client->down.queuedBytes < TCP_QUEUE_LIMIT) {
+                pfds[numPfds].fd = client->targetfd;
+                pfds[numPfds].events = POLLIN;
+                pollClients[numPfds++] = client;
+            }
+            if (tcp && !client->up.ended && client->up.queuedBytes < TCP_QUEUE_LIMIT) {
+                pfds[numPfds].fd = client->clientfd;
+                pfds[numPfds].events = POLLIN;
+                pollClients[numPfds++] = client;
+            }
+        }
+
+        if (ppoll(pfds, numPfds, wait, NULL) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ppoll");
+            exit(1);
+        }
+
+        for (int i = 0; i < numPfds; i++) {
+            if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            struct Client* client = pollClients[i];
+
+            // A new TCP connection gets its own connection to the receiver
+            if (client == NULL && tcp) {
+                int clientfd = accept(listenfd, NULL, NULL);
+                if (clientfd == -1) {
+                    perror("accept");
+                    continue;
+                }
+                int slot = 0;
+                while (slot < MAX_CLIENTS && clients[slot].used) {
+                    slot++;
+                }
+                int targetfd = socket(AF_INET, SOCK_STREAM, 0);
+                if (slot == MAX_CLIENTS || targetfd == -1 ||
+                    connect(targetfd, (struct sockaddr *) &targetAddress, sizeof(targetAddress)) == -1) {
+                    perror("connect");
+                    close(clientfd);
+                    if (targetfd != -1) {
+                        close(targetfd);
+                    }
+                    continue;
+                }
+                client = &clients[slot];
+                memset(client, 0, sizeof(*client));
+                client->used = true;
+                client->clientfd = clientfd;
+                client->targetfd = targetfd;
+                linkInit(&client->up, "sender -> receiver", targetfd, seed + 2 * nextClient, &upWire);
+                linkInit(&client->down, "receiver -> sender", clientfd, seed + 2 * nextClient + 1, &downWire);
+                nextClient++;
+                printf("Connection #%d accepted\n", nextClient);
+                continue;
+            }
+
+            // A datagram of a sender, a new one gets its own socket towards the receiver
+            if (client == NULL) {
+                struct sockaddr_in from;
+                socklen_t fromLength = sizeof(from);
+                ssize_t length = recvfrom(listenfd, buffer, MAX_DATAGRAM, 0, (struct sockaddr *) &from, &fromLength);
+                if (length == -1) {
+                    continue;
+                }
+                int slot = -1, freeSlot = -1;
+                for (int j = 0; j < MAX_CLIENTS && slot == -1; j++) {
+                    if (clients[j].used && clients[j].address.sin_addr.s_addr == from.sin_addr.s_addr &&
+                        clients[j].address.sin_port == from.sin_port) {
+                        slot = j;
+                    } else if (!clients[j].used && freeSlot == -1) {
+                        freeSlot = j;
+                    }
+                }
+                if (slot == -1) {
+                    int targetfd = freeSlot == -1 ? -1 : socket(AF_INET, SOCK_DGRAM, 0);
+                    if (targetfd == -1 || connect(targetfd, (struct sockaddr *) &targetAddress, sizeof(targetAddress)) == -1) {
+                        if (targetfd != -1) {
+                            close(targetfd);
+                        }
+                        continue;
+                    }
+                    slot = freeSlot;
+                    client = &clients[slot];
+                    memset(client, 0, sizeof(*client));
+                    client->used = true;
+                    client->address = from;
+                    client->clientfd = -1;
+                    client->targetfd = targetfd;
+                    linkInit(&client->up, "sender -> receiver", targetfd, seed + 2 * nextClient, &upWire);
+                    linkInit(&client->down, "receiver -> sender", listenfd, seed + 2 * nextClient + 1, &downWire);
+                    client->up.connected = true;
+                    client->up.datagram = client->down.datagram = true;
+                    client->down.to = from;
+                    nextClient++;
+                    printf("Sender #%d is %s:%d\n", nextClient, inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+                }
+                clients[slot].lastActive = now();
+                impair(&heap, &impairment, &clients[slot].up, buffer, length);
+                continue;
+            }
+
+            // Data of an existing connection, from either side
+            bool fromTarget = pfds[i].fd == client->targetfd;
+            struct Link* link = fromTarget ? &client->down : &client->up;
+            ssize_t length = recv(pfds[i].fd, buffer, tcp ? TCP_CHUNK_SIZE : MAX_DATAGRAM, 0);
+            if (length == -1 && (errno == EINTR || errno == EAGAIN || (!tcp && errno == ECONNREFUSED))) {
+                continue;
+            }
+            if (length <= 0 && tcp) {
+                // the end of the stream goes through the queue too, behind the data before it
+                link->ended = true;
+                impair(&heap, &impairment, link, NULL, 0);
+                continue;
+            }
+            if (length <= 0) {
+                continue;
+            }
+            client->lastActive = now();
+            impair(&heap, &impairment, link, buffer, length);
+        }
+
+        releasePackets(&heap);
+
+        // A TCP connection is done once both directions ended and delivered everything,
+        // a UDP sender once it's quiet for long
+        long long current = now();
+        for (int i = 0; i < MAX_CLIENTS; i++) {
+            struct Client* client = &clients[i];
+            if (client->used && ((tcp && client->up.ended && client->down.ended && !client->up.queuedPackets && !client->down.queuedPackets) ||
+                                 (!tcp && current - client->lastActive > CLIENT_IDLE_US))) {
+                closeClient(&heap, client);
+            }
+        }
+    }
+
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].used) {
+            closeClient(&heap, &clients[i]);
+        }
+    }
+    free(heap.packets);
+    free(buffer);
+    close(listenfd);
+    return 0;
+}
+
+long long now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000LL + time.tv_nsec / 1000;
+}
+
+double nextRandom(struct Link* link) {
+    // splitmix64, small and the same everywhere for a seed
+    uint64_t z = (link->random += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (z >> 11) * 0x1.0p-53;
+}
+
+void impair(struct Heap* heap, struct Impairment* impairment, struct Link* link, const char* data, size_t length) {
+    static unsigned long long order = 0;
+    long long arrival = now();
+
+    // Datagrams can be lost, duplicated and damaged, a stream only delayed
+    int copies = 1;
+    bool reordered = false;
+    if (link->datagram) {
+        if (nextRandom(link) < impairment->loss) {
+            link->lost++;
+            return;
+        }
+        if (nextRandom(link) < impairment->duplicate) {
+            link->duplicated++;
+            copies = 2;
+        }
+        if (nextRandom(link) < impairment->reorder) {
+            link->reordered++;
+            reordered = true;
+        }
+    }
+
+    for (int copy = 0; copy < copies; copy++) {
+        // a full queue drops what arrives, like a router
+        if (link->datagram && link->queuedPackets >= impairment->queue) {
+            link->dropped++;
+            continue;
+        }
+
+        struct Packet* packet = malloc(sizeof(struct Packet) + length);
+        if (packet == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        packet->link = link;
+        packet->length = length;
+        packet->order = order++;
+        if (length > 0) {
+            memcpy(packet->data, data, length);
+        }
+        if (link->datagram && length > 0 && nextRandom(link) < impairment->corrupt) {
+            double where = nextRandom(link);
+            packet->data[(size_t) (where * length)] ^= 1 << (int) (nextRandom(link) * 8);
+            link->corrupted++;
+        }
+
+        // the rate limit puts the packet on the wire after the ones before it, then it travels for the delay
+        long long sent = arrival > *link->nextFree ? arrival : *link->nextFree;
+        if (impairment->rate > 0) {
+            sent += (long long) (length / impairment->rate);
+            *link->nextFree = sent;
+        }
+        long long delay = impairment->delay;
+        if (impairment->jitter > 0) {
+            delay += (long long) ((nextRandom(link) * 2 - 1) * impairment->jitter);
+        }
+        // a reordered packet is held back, so the next ones overtake it
+        if (reordered) {
+            delay += impairment->delay + impairment->jitter > 1000 ? impairment->delay + impairment->jitter : 1000;
+        }
+        packet->release = sent + (delay > 0 ? delay : 0);
+        if (!link->datagram) {
+            packet->release = packet->release > link->lastRelease ? packet->release : link->lastRelease;
+            link->lastRelease = packet->release;
+        }
+
+        link->queuedBytes += length;
+        link->queuedPackets++;
+        heapPush(heap, packet);
+    }
+}
+
+void releasePackets(struct Heap* heap) {
+    long long current = now();
+
+    while (heap->count > 0 && heap->packets[0]->release <= current) {
+        struct Packet* packet = heapPop(heap);
+        struct Link* link = packet->link;
+        link->queuedBytes -= packet->length;
+        link->queuedPackets--;
+
+        if (packet->length == 0) {
+            // the other side learns the stream ended
+            shutdown(link->fd, SHUT_WR);
+        } else if (link->datagram) {
+            // a receiver that isn't there yet loses the datagram, as on a real network
+            if (link->connected) {
+                send(link->fd, packet->data, packet->length, 0);
+            } else {
+                sendto(link->fd, packet->data, packet->length, 0, (struct sockaddr *) &link->to, sizeof(link->to));
+            }
+            link->forwarded++;
+        } else {
+            size_t written = 0;
+            while (written < packet->length) {
+                ssize_t result = send(link->fd, packet->data + written, packet->length - written, 0);
+                if (result == -1 && errno == EINTR) {
+                    continue;
+                }
+                if (result == -1) {
+                    break;
+                }
+                written += result;
+            }
+            link->forwarded++;
+        }
+        free(packet);
+    }
+}
+
+void heapPush(struct Heap* heap, struct Packet* packet) {
+    if (heap->count == heap->capacity) {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : 1024;
+        heap->packets = realloc(heap->packets, heap->capacity * sizeof(struct Packet*));
+        if (heap->packets == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+
+    // sift up, a packet goes before the ones that leave later or arrived after it with the same time
+    int index = heap->count++;
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        struct Packet* above = heap->packets[parent];
+        if (above->release < packet->release || (above->release == packet->release && above->order < packet->order)) {
+            break;
+        }
+        heap->packets[index] = above;
+        index = parent;
+    }
+    heap->packets[index] = packet;
+}
+
+struct Packet* heapPop(struct Heap* heap) {
+    struct Packet* top = heap->packets[0];
+    struct Packet* last = heap->packets[--heap->count];
+
+    // sift the last packet down from the root
+    int index = 0;
+    while (true) {
+        int child = 2 * index + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count && (heap->packets[child + 1]->release < heap->packets[child]->release ||
+            (heap->packets[child + 1]->release == heap->packets[child]->release && heap->packets[child + 1]->order < heap->packets[child]->order))) {
+            child++;
+        }
+        struct Packet* below = heap->packets[child];
+        if (last->release < below->release || (last->release == below->release && last->order < below->order)) {
+            break;
+        }
+        heap->packets[index] = below;
+        index = child;
+    }
+    if (heap->count > 0) {
+        heap->packets[index] = last;
+    }
+    return top;
+}
+
+void linkInit(struct Link* link, const char* name, int fd, uint64_t seed, long long* wire) {
+    memset(link, 0, sizeof(*link));
+    link->name = name;
+    link->fd = fd;
+    link->random = seed;
+    link->nextFree = wire;
+}
+
+void printLink(struct Link* link) {
+    printf("-   %s: %lld forwarded, %lld lost, %lld dropped (queue full), %lld duplicated, %lld corrupted, %lld reordered\n",
+           link->name, link->forwarded, link->lost, link->dropped, link->duplicated, link->corrupted, link->reordered);
+}
+
+void closeClient(struct Heap* heap, struct Client* client) {
+    // packets still waiting for this client go nowhere
+    for (int i = 0; i < heap->count; ) {
+        struct Packet* packet = heap->packets[i];
+        if (packet->link != &client->up && packet->link != &client->down) {
+            i++;
+            continue;
+        }
+        // move the last packet here and restore the order by rebuilding the heap below
+        heap->packets[i] = heap->packets[--heap->count];
+        free(packet);
+    }
+    struct Packet** packets = heap->packets;
+    int count = heap->count;
+    heap->count = 0;
+    for (int i = 0; i < count; i++) {
+        heapPush(heap, packets[i]);
+    }
+
+    printf("----------------------------------\n");
+    if (client->clientfd != -1) {
+        printf("- * Connection closed * -\n");
+    } else {
+        printf("- * Sender %s:%d * -\n", inet_ntoa(client->address.sin_addr), ntohs(client->address.sin_port));
+    }
+    printLink(&client->up);
+    printLink(&client->down);
+    printf("----------------------------------\n");
+
+    if (client->clientfd != -1) {
+        close(client->clientfd);
+    }
+    close(client->targetfd);
+    client->used = false;
+}
@@ -1,140 +1,1140 @@
 #include "RUDP.h"
+#include <sys/random.h>
+#include <linux/net_tstamp.h>
 
 
-////********************** SENDER METHODS***********************
+/**
+ * current time of the monotonic clock in microseconds
+ */
+long long rudp_now(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+////********************** CONNECTION METHODS***********************
 
 /**
- * receiveing ACK from the src
- * return -2: timeout, -1: error, 0: disconnected, 1: Received
+ * initialize the connection state and allocate the send and receive windows
+ * @param peer address of the other side, NULL on the receiver (taken from the SYN)
+ * @param windowSize max packets in flight, clamped to 1..RUDP_MAX_WINDOW
+ * @param batchSize max datagrams per system call, clamped to 1..RUDP_MAX_BATCH
+ * @param sides RUDP_SIDE_SEND and/or RUDP_SIDE_RECEIVE, the windows that are allocated
+ * @return -1: error, 1: successful
  */
-int rudp_receiveACK(int socket,struct sockaddr_in* srcAddress){
-    RUDPHeader buffer;
-    memset(&buffer, 0, sizeof(RUDPHeader));
+int rudp_init(RUDPConnection* conn, int socket, struct sockaddr_in* peer, int windowSize, int batchSize, int sides){
+    memset(conn, 0, sizeof(RUDPConnection));
+    conn->socket = socket;
+    if (peer != NULL) {
+        conn->peer = *peer;
+    }
+    if (windowSize < 1) {
+        windowSize = 1;
+    }
+    if (windowSize > RUDP_MAX_WINDOW) {
+        windowSize = RUDP_MAX_WINDOW;
+    }
+    conn->windowSize = windowSize;
+    conn->rto = RUDP_INITIAL_RTO_US;
+    conn->ackEvery = RUDP_ACK_EVERY;
+    conn->congestion = -1;
+    rudp_ccInit(&conn->cc, RUDP_CC_AIMD, conn->windowSize, rudp_now());
+    if (batchSize < 1) {
+        batchSize = 1;
+    }
+    if (batchSize > RUDP_MAX_BATCH) {
+        batchSize = RUDP_MAX_BATCH;
+    }
+    conn->batchSize = batchSize;
 
-    socklen_t srcAddressLen = sizeof(*srcAddress);
-    int receiveACK = recvfrom(socket, &buffer, sizeof(RUDPHeader), 0, (struct sockaddr *) &srcAddress,
-                              &srcAddressLen);
+    if (sides & RUDP_SIDE_SEND) {
+        conn->sendWindow = calloc(RUDP_MAX_WINDOW, sizeof(RUDPSendSlot));
+        conn->sendBatch = calloc(1, sizeof(RUDPSendBatch));
+    }
+    if (sides & RUDP_SIDE_RECEIVE) {
+        conn->recvWindow = calloc(RUDP_MAX_WINDOW, sizeof(RUDPRecvSlot));
+        conn->recvBatch = calloc(1, sizeof(RUDPRecvBatch));
+    }
+    if (((sides & RUDP_SIDE_SEND) && (conn->sendWindow == NULL || conn->sendBatch == NULL)) ||
+        ((sides & RUDP_SIDE_RECEIVE) && (conn->recvWindow == NULL || conn->recvBatch == NULL))) {
+        printf("calloc() failed\n");
+        rudp_free(conn);
+        return -1;
+    }
+    return 1;
+}
 
-    if (receiveACK == -1) {
-        if (errno == EWOULDBLOCK || errno == EAGAIN) {
-            return -2;
-        }
-        else{
-            printf("recvfrom() failed with error code : %d", errno);
-            close(socket);
+/**
+ * release the windows of the connection, the socket stays open
+ */
+void rudp_free(RUDPConnection* conn){
+    if (conn->recvBatch != NULL) {
+        free(conn->recvBatch->superBuffers);
+    }
+    free(conn->sendWindow);
+    free(conn->recvWindow);
+    free(conn->sendBatch);
+    free(conn->recvBatch);
+    free(conn->parityBuffers);
+    conn->sendWindow = NULL;
+    conn->recvWindow = NULL;
+    conn->sendBatch = NULL;
+    conn->recvBatch = NULL;
+    conn->parityBuffers = NULL;
+}
+
+/**
+ * let the sender hand runs of datagrams to the kernel as one buffer it splits again (UDP_SEGMENT)
+ * @return 0: the kernel can't, datagrams go one by one, 1: enabled
+ */
+int rudp_enableGSO(RUDPConnection* conn){
+    int segmentSize = 0;
+    socklen_t length = sizeof(segmentSize);
+    conn->gso = 0;
+    if (getsockopt(conn->socket, SOL_UDP, UDP_SEGMENT, &segmentSize, &length) == -1) {
+        printf("UDP GSO isn't supported (error code %d), sending datagram by datagram\n", errno);
+        return 0;
+    }
+    conn->gso = 1;
+    return 1;
+}
+
+/**
+ * let the socket hand over datagrams of one sender coalesced into one buffer (UDP_GRO)
+ * @return -1: error, 0: the kernel can't, datagrams come one by one, 1: enabled
+ */
+int rudp_enableGRO(RUDPConnection* conn){
+    int on = 1;
+    conn->gro = 0;
+    if (conn->recvBatch->superBuffers == NULL) {
+        conn->recvBatch->superBuffers = malloc((size_t) conn->batchSize * RUDP_GRO_BUFFER_SIZE);
+        if (conn->recvBatch->superBuffers == NULL) {
+            printf("malloc() failed\n");
             return -1;
         }
     }
-    if(receiveACK == 0){
+    if (setsockopt(conn->socket, SOL_UDP, UDP_GRO, &on, sizeof(on)) == -1) {
+        printf("UDP GRO isn't supported (error code %d), receiving datagram by datagram\n", errno);
+        return 0;
+    }
+    conn->gro = 1;
+    return 1;
+}
+
+/**
+ * integrity check of a payload in its wire form, by the connection's integrity mode
+ */
+static unsigned int rudp_integrity(RUDPConnection* conn, const char* data, unsigned short length){
+    if (length == 0) {
         return 0;
     }
 
-    if(buffer.flags == ACK_FLAG){
+    // the clock costs about as much as checking a packet, so only a sample is timed
+    int timed = conn->integrityChecks++ % RUDP_INTEGRITY_SAMPLE == 0;
+    struct timespec start, end;
+    if (timed) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    unsigned int wire = 0;
+    if (conn->integrity == RUDP_INTEGRITY_CRC32C) {
+        wire = htonl(calculate_crc32c(data, length));
+    } else {
+        // an RFC 1071 sum doesn't depend on the byte order, so its bytes are sent as computed
+        unsigned short sum = calculate_checksum((void *) data, length);
+        memcpy(&wire, &sum, sizeof(sum));
+    }
+    if (timed) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        conn->integrityTime += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+        conn->integrityBytes += length;
+    }
+    return wire;
+}
+
+/**
+ * fill a wire header for the flags, sequence number and payload, only data packets get an integrity check
+ */
+static void rudp_fillHeader(RUDPConnection* conn, RUDPHeader* header, char flags, unsigned int seq,
+                            const char* data, unsigned short length){
+    header->connId = htonl(conn->connId);
+    header->seq = htonl(seq);
+    header->length = htons(length);
+    header->checksum = flags == DATA_FLAG || flags == END_FLAG ? rudp_integrity(conn, data, length) : 0;
+    header->flags = flags;
+}
+
+/**
+ * send a packet with the given flags, sequence number and payload to destAddress.
+ * Only the header and length bytes of payload go on the wire.
+ * @return -1: failure, 1: successful
+ */
+static int rudp_sendPacket(RUDPConnection* conn, struct sockaddr_in* destAddress, char flags, unsigned int seq,
+                           const char* data, unsigned short length){
+    RUDPHeader header;
+    rudp_fillHeader(conn, &header, flags, seq, data, length);
+
+    struct iovec iov[2];
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(RUDPHeader);
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = length;
+
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = destAddress;
+    message.msg_namelen = sizeof(*destAddress);
+    message.msg_iov = iov;
+    message.msg_iovlen = length > 0 ? 2 : 1;
+
+    if (sendmsg(conn->socket, &message, 0) == -1) {
+        printf("sendto() failed with error code  : %d\n", errno);
+        return -1;
+    }
+    conn->packetsSent++;
+    conn->sendCalls++;
+    counters_add(COUNTER_PACKETS_SENT, 1);
+    counters_add(COUNTER_SEND_CALLS, 1);
+    return 1;
+}
+
+/**
+ * put every run of queued datagrams to one address into one message, all of the same size
+ * but the last one, the kernel cuts the message at that size again (UDP_SEGMENT)
+ * @return the number of messages in batch->superMessages
+ */
+static int rudp_groupPackets(RUDPSendBatch* batch){
+    int count = 0;
+    int first = 0;
+    while (first < batch->count) {
+        struct msghdr* head = &batch->messages[first].msg_hdr;
+        size_t segmentSize = sizeof(RUDPHeader) + batch->iov[first][1].iov_len;
+        size_t bytes = segmentSize;
+        size_t length = segmentSize;
+        int last = first + 1;
+        while (last < batch->count && length == segmentSize && last - first < RUDP_GSO_MAX_SEGMENTS) {
+            length = sizeof(RUDPHeader) + batch->iov[last][1].iov_len;
+            if (length > segmentSize || bytes + length > RUDP_GSO_MAX_BYTES ||
+                batch->messages[last].msg_hdr.msg_name != head->msg_name) {
+                break;
+            }
+            bytes += length;
+            last++;
+        }
+
+        // the iovecs of the run follow each other, two per datagram
+        struct msghdr* message = &batch->superMessages[count].msg_hdr;
+        memset(message, 0, sizeof(*message));
+        message->msg_name = head->msg_name;
+        message->msg_namelen = head->msg_namelen;
+        message->msg_iov = batch->iov[first];
+        message->msg_iovlen = 2 * (last - first);
+        // the run leaves at the departure time of its first datagram, if it has one
+        message->msg_control = batch->control[count];
+        message->msg_controllen = head->msg_controllen;
+        if (head->msg_controllen > 0) {
+            memcpy(batch->control[count], head->msg_control, head->msg_controllen);
+        }
+        if (last - first > 1) {
+            unsigned short size = segmentSize;
+            struct cmsghdr* control = (struct cmsghdr *) (batch->control[count] + head->msg_controllen);
+            control->cmsg_level = SOL_UDP;
+            control->cmsg_type = UDP_SEGMENT;
+            control->cmsg_len = CMSG_LEN(sizeof(size));
+            memcpy(CMSG_DATA(control), &size, sizeof(size));
+            message->msg_controllen += CMSG_SPACE(sizeof(size));
+        }
+        if (message->msg_controllen == 0) {
+            message->msg_control = NULL;
+        }
+        batch->superCounts[count++] = last - first;
+        first = last;
+    }
+    return count;
+}
+
+/**
+ * send every queued data packet, batchSize datagrams per sendmmsg() call. With GSO a run of
+ * datagrams is one message, a path that refuses them turns GSO off and takes the rest one by one.
+ * @return -1: failure, 1: successful
+ */
+static int rudp_flushPackets(RUDPConnection* conn){
+    RUDPSendBatch* batch = conn->sendBatch;
+    int sent = 0;
+    if (conn->gso && batch->count > 1) {
+        int messages = rudp_groupPackets(batch);
+        int done = 0;
+        while (done < messages) {
+            int result = sendmmsg(conn->socket, batch->superMessages + done, messages - done, 0);
+            if (result == -1) {
+                break;
+            }
+            for (int i = done; i < done + result; i++) {
+                sent += batch->superCounts[i];
+            }
+            done += result;
+            conn->sendCalls++;
+            counters_add(COUNTER_SEND_CALLS, 1);
+        }
+        if (done < messages) {
+            // a device without segmentation offload or a route with a smaller MTU than the datagrams
+            if (errno != EIO && errno != EINVAL && errno != EMSGSIZE && errno != EOPNOTSUPP && errno != ENOPROTOOPT) {
+                printf("sendmmsg() failed with error code  : %d\n", errno);
+                batch->count = 0;
+                return -1;
+            }
+            printf("UDP GSO failed with error code %d, sending datagram by datagram\n", errno);
+            conn->gso = 0;
+        }
+    }
+    while (sent < batch->count) {
+        int result = sendmmsg(conn->socket, batch->messages + sent, batch->count - sent, 0);
+        if (result == -1) {
+            printf("sendmmsg() failed with error code  : %d\n", errno);
+            batch->count = 0;
+            return -1;
+        }
+        sent += result;
+        conn->sendCalls++;
+        counters_add(COUNTER_SEND_CALLS, 1);
+    }
+    conn->packetsSent += sent;
+    counters_add(COUNTER_PACKETS_SENT, sent);
+    batch->count = 0;
+    return 1;
+}
+
+/**
+ * queue a packet for the next sendmmsg() call, the batch is sent once it is full.
+ * The payload isn't copied and must stay valid until the batch is flushed.
+ * @return -1: failure, 1: successful
+ */
+static int rudp_queuePacket(RUDPConnection* conn, struct sockaddr_in* destAddress, char flags, unsigned int seq,
+                            const char* data, unsigned short length){
+    RUDPSendBatch* batch = conn->sendBatch;
+    int i = batch->count;
+    rudp_fillHeader(conn, &batch->headers[i], flags, seq, data, length);
+
+    batch->iov[i][0].iov_base = &batch->headers[i];
+    batch->iov[i][0].iov_len = sizeof(RUDPHeader);
+    batch->iov[i][1].iov_base = (void *) data;
+    batch->iov[i][1].iov_len = length;
+
+    struct msghdr* message = &batch->messages[i].msg_hdr;
+    memset(message, 0, sizeof(*message));
+    message->msg_name = destAddress;
+    message->msg_namelen = sizeof(*destAddress);
+    message->msg_iov = batch->iov[i];
+    message->msg_iovlen = length > 0 ? 2 : 1;
+
+    // the token bucket waited in rudp_pace() already, SO_TXTIME hands the departure time to the qdisc
+    double rate = rudp_pacingRate(conn);
+    if ((conn->pacer == RUDP_PACER_BUCKET || conn->pacer == RUDP_PACER_TXTIME) && rate > 0) {
+        if (conn->pacer == RUDP_PACER_TXTIME) {
+            unsigned long long departure = conn->pacingNext * 1000;
+            message->msg_control = batch->txtimeControl[i];
+            message->msg_controllen = sizeof(batch->txtimeControl[i]);
+            struct cmsghdr* control = CMSG_FIRSTHDR(message);
+            control->cmsg_level = SOL_SOCKET;
+            control->cmsg_type = SCM_TXTIME;
+            control->cmsg_len = CMSG_LEN(sizeof(departure));
+            memcpy(CMSG_DATA(control), &departure, sizeof(departure));
+        }
+        conn->pacingNext += (RUDP_PACING_OVERHEAD + sizeof(RUDPHeader) + length) * 1000000.0 / rate;
+    }
+
+    batch->count++;
+    if (batch->count >= conn->batchSize) {
+        return rudp_flushPackets(conn);
+    }
+    return 1;
+}
+
+/**
+ * read the datagram size of every buffer of a GRO batch, a buffer without one holds a single datagram
+ * @return the number of datagrams in the batch
+ */
+static int rudp_segmentBatch(RUDPRecvBatch* batch){
+    int datagrams = 0;
+    for (int i = 0; i < batch->count; i++) {
+        struct msghdr* message = &batch->messages[i].msg_hdr;
+        int length = batch->messages[i].msg_len;
+        int segmentSize = length;
+        for (struct cmsghdr* control = CMSG_FIRSTHDR(message); control != NULL; control = CMSG_NXTHDR(message, control)) {
+            if (control->cmsg_level == SOL_UDP && control->cmsg_type == UDP_GRO) {
+                memcpy(&segmentSize, CMSG_DATA(control), sizeof(segmentSize));
+            }
+        }
+        if (segmentSize <= 0 || segmentSize > length) {
+            segmentSize = length;
+        }
+        batch->segmentSizes[i] = segmentSize;
+        datagrams += segmentSize > 0 ? (length + segmentSize - 1) / segmentSize : 1;
+    }
+    return datagrams;
+}
+
+/**
+ * get one datagram, the header is converted to host byte order. Datagrams are
+ * read batchSize at a time with recvmmsg() and handed out from the batch, with GRO
+ * batchSize buffers at a time that are cut into their datagrams.
+ * @param packet set to the datagram, valid until the next call
+ * @param flags recvmmsg() flags, MSG_DONTWAIT to only take what is already queued
+ * @return -3: malformed, -2: timeout or nothing queued, -1: error, >=0: payload length
+ */
+int rudp_recvPacket(RUDPConnection* conn, RUDPPacket** packet, struct sockaddr_in* srcAddress, int flags){
+    RUDPRecvBatch* batch = conn->recvBatch;
+
+    if (batch->next == batch->count) {
+        for (int i = 0; i < conn->batchSize; i++) {
+            batch->iov[i].iov_base = &batch->packets[i];
+            batch->iov[i].iov_len = sizeof(RUDPPacket);
+            struct msghdr* message = &batch->messages[i].msg_hdr;
+            memset(message, 0, sizeof(*message));
+            message->msg_name = &batch->addresses[i];
+            message->msg_namelen = sizeof(batch->addresses[i]);
+            message->msg_iov = &batch->iov[i];
+            message->msg_iovlen = 1;
+            if (conn->gro) {
+                batch->iov[i].iov_base = batch->superBuffers + (size_t) i * RUDP_GRO_BUFFER_SIZE;
+                batch->iov[i].iov_len = RUDP_GRO_BUFFER_SIZE;
+                message->msg_control = batch->control[i];
+                message->msg_controllen = sizeof(batch->control[i]);
+            }
+        }
+
+        // block for the first datagram only, then take whatever else is queued
+        int received = recvmmsg(conn->socket, batch->messages, conn->batchSize, flags | MSG_WAITFORONE, NULL);
+        conn->receiveCalls++;
+        counters_add(COUNTER_RECEIVE_CALLS, 1);
+        if (received == -1) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                return -2;
+            }
+            printf("recvmmsg() failed with error code : %d", errno);
+            return -1;
+        }
+        batch->count = received;
+        batch->next = 0;
+        batch->offset = 0;
+        if (conn->gro) {
+            received = rudp_segmentBatch(batch);
+        }
+        conn->packetsReceived += received;
+        counters_add(COUNTER_PACKETS_RECEIVED, received);
+    }
+
+    int i = batch->next;
+    int received = batch->messages[i].msg_len;
+    *srcAddress = batch->addresses[i];
+    if (conn->gro) {
+        // one datagram of the buffer, the packed header needs no alignment
+        char* buffer = batch->superBuffers + (size_t) i * RUDP_GRO_BUFFER_SIZE;
+        *packet = (RUDPPacket *) (buffer + batch->offset);
+        if (received - batch->offset > batch->segmentSizes[i]) {
+            received = batch->segmentSizes[i];
+        } else {
+            received -= batch->offset;
+        }
+        batch->offset += received;
+        if (batch->offset >= (int) batch->messages[i].msg_len) {
+            batch->next++;
+            batch->offset = 0;
+        }
+        if (received > (int) sizeof(RUDPPacket)) {
+            return -3;
+        }
+    } else {
+        batch->next++;
+        *packet = &batch->packets[i];
+    }
+    if (received < (int) sizeof(RUDPHeader)) {
+        return -3;
+    }
+
+    (*packet)->header.connId = ntohl((*packet)->header.connId);
+    (*packet)->header.seq = ntohl((*packet)->header.seq);
+    (*packet)->header.length = ntohs((*packet)->header.length);
+    if ((*packet)->header.length != received - (int) sizeof(RUDPHeader)) {
+        return -3;
+    }
+    return (*packet)->header.length;
+}
+
+
+////********************** PACING METHODS***********************
+
+static const char* pacerNames[] = {"off", "fq", "txtime", "bucket"};
+
+/**
+ * find a pacer by name, "auto" picks one when pacing is enabled
+ * @return RUDP_PACER_*, -2 if unknown
+ */
+int rudp_pacerParse(const char* name){
+    if (strcmp(name, "auto") == 0) {
+        return RUDP_PACER_AUTO;
+    }
+    for (int i = 0; i < (int) (sizeof(pacerNames) / sizeof(pacerNames[0])); i++) {
+        if (strcmp(name, pacerNames[i]) == 0) {
+            return i;
+        }
+    }
+    return -2;
+}
+
+const char* rudp_pacerName(int pacer){
+    if (pacer < 0 || pacer >= (int) (sizeof(pacerNames) / sizeof(pacerNames[0]))) {
+        return "auto";
+    }
+    return pacerNames[pacer];
+}
+
+/**
+ * pace the data and parity datagrams at the congestion controller's rate, capped at cap.
+ * fq and SO_TXTIME only work where the outgoing device has the fq (or etf) qdisc, the kernel
+ * doesn't tell, a pacer it refuses falls back to the token bucket
+ * @param pacer RUDP_PACER_*, RUDP_PACER_AUTO takes fq if it is the system's default qdisc and
+ *              the peer isn't on loopback (that has no qdisc), the token bucket otherwise
+ * @param cap most bytes per second, 0 for no cap
+ * @return the pacer that is used
+ */
+int rudp_enablePacing(RUDPConnection* conn, int pacer, double cap){
+    conn->pacingCap = cap > 0 ? cap : 0;
+    conn->pacingNext = 0;
+    conn->pacingApplied = 0;
+    if (pacer == RUDP_PACER_AUTO) {
+        char qdisc[32] = "";
+        FILE* file = fopen("/proc/sys/net/core/default_qdisc", "r");
+        if (file != NULL) {
+            if (fscanf(file, "%31s", qdisc) != 1) {
+                qdisc[0] = '\0';
+            }
+            fclose(file);
+        }
+        int loopback = (ntohl(conn->peer.sin_addr.s_addr) >> 24) == 127;
+        pacer = strcmp(qdisc, "fq") == 0 && !loopback ? RUDP_PACER_FQ : RUDP_PACER_BUCKET;
+    }
+
+    if (pacer == RUDP_PACER_TXTIME) {
+        struct sock_txtime txtime;
+        memset(&txtime, 0, sizeof(txtime));
+        txtime.clockid = CLOCK_MONOTONIC;
+        if (setsockopt(conn->socket, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == -1) {
+            printf("SO_TXTIME isn't supported (error code %d), pacing in user space\n", errno);
+            pacer = RUDP_PACER_BUCKET;
+        }
+    }
+    if (pacer == RUDP_PACER_FQ) {
+        unsigned long long rate = 0;
+        socklen_t length = sizeof(rate);
+        if (getsockopt(conn->socket, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, &length) == -1) {
+            printf("SO_MAX_PACING_RATE isn't supported (error code %d), pacing in user space\n", errno);
+            pacer = RUDP_PACER_BUCKET;
+        }
+    }
+    conn->pacer = pacer;
+    return pacer;
+}
+
+/**
+ * bytes per second the sender paces at, the congestion controller's rate capped at pacingCap
+ * @return 0 while neither gives one
+ */
+double rudp_pacingRate(RUDPConnection* conn){
+    double rate = conn->cc.pacingRate;
+    if (conn->pacingCap > 0 && (rate <= 0 || rate > conn->pacingCap)) {
+        rate = conn->pacingCap;
+    }
+    return rate;
+}
+
+/**
+ * wait until the next datagram is due, before it takes its place in the send batch.
+ * The token bucket sends the datagrams that are due and sleeps, fq gets the rate once it
+ * moved by more than an eighth, SO_TXTIME needs no wait. rudp_queuePacket() moves the
+ * departure time on by the datagram.
+ * @return -1: failure, 1: successful
+ */
+static int rudp_pace(RUDPConnection* conn){
+    double rate = rudp_pacingRate(conn);
+    if (conn->pacer == RUDP_PACER_OFF || rate <= 0) {
+        return 1;
+    }
+
+    if (conn->pacer == RUDP_PACER_FQ) {
+        double difference = rate - conn->pacingApplied;
+        if (difference < 0) {
+            difference = -difference;
+        }
+        if (conn->pacingApplied != 0 && difference <= conn->pacingApplied / 8) {
+            return 1;
+        }
+        unsigned long long value = rate;
+        if (setsockopt(conn->socket, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof(value)) == -1) {
+            printf("SO_MAX_PACING_RATE failed with error code %d, pacing in user space\n", errno);
+            conn->pacer = RUDP_PACER_BUCKET;
+        } else {
+            conn->pacingApplied = rate;
+            conn->pacingUpdates++;
+            return 1;
+        }
+    }
+
+    // a sender that waited for ACKs keeps a burst worth of credit, no more
+    long long now = rudp_now();
+    if (conn->pacingNext < now - RUDP_PACING_BURST_US) {
+        conn->pacingNext = now - RUDP_PACING_BURST_US;
+    }
+    if (conn->pacer != RUDP_PACER_BUCKET || conn->pacingNext <= now) {
         return 1;
     }
-    return 0;
+
+    if (conn->sendBatch->count > 0 && rudp_flushPackets(conn) < 0) {
+        return -1;
+    }
+    long long wait = (long long) conn->pacingNext - rudp_now();
+    if (wait > 0) {
+        struct timespec pause;
+        pause.tv_sec = wait / 1000000;
+        pause.tv_nsec = (wait % 1000000) * 1000;
+        nanosleep(&pause, NULL);
+        conn->pacingWaits++;
+        conn->pacingWaitTime += wait;
+        counters_add(COUNTER_PACING_WAIT_US, wait);
+    }
+    return 1;
 }
 
+
+////********************** SENDER METHODS***********************
+
 /**
- *  request connect and waits for ACK
+ * make the socket's receive timeout follow the retransmission timeout, the
+ * socket is only updated when the RTO moved by more than an eighth
+ * @return -1: error, 1: successful
+ */
+static int rudp_applyTimeout(RUDPConnection* conn){
+    long long difference = conn->rto - conn->socketTimeout;
+    if (difference < 0) {
+        difference = -difference;
+    }
+    if (conn->socketTimeout != 0 && difference <= conn->socketTimeout / 8) {
+        return 1;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = conn->rto / 1000000;
+    timeout.tv_usec = conn->rto % 1000000;
+    if (setsockopt(conn->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        printf("setsockopt() failed with error code : %d\n", errno);
+        return -1;
+    }
+    conn->socketTimeout = conn->rto;
+    return 1;
+}
+
+/**
+ * feed a round trip sample into the estimator and recompute the RTO (RFC 6298)
+ * @param sample round trip time of a packet that was sent once, in microseconds
+ */
+static void rudp_updateRTT(RUDPConnection* conn, long long sample){
+    if (conn->rttHistogram != NULL) {
+        hist_record(conn->rttHistogram, sample * 1000);
+    }
+    if (conn->srtt == 0) {
+        conn->srtt = sample;
+        conn->rttvar = sample / 2;
+    } else {
+        long long error = conn->srtt - sample;
+        if (error < 0) {
+            error = -error;
+        }
+        conn->rttvar = (3 * conn->rttvar + error) / 4;
+        conn->srtt = (7 * conn->srtt + sample) / 8;
+    }
+
+    conn->rto = conn->srtt + 4 * conn->rttvar;
+    if (conn->rto < RUDP_MIN_RTO_US) {
+        conn->rto = RUDP_MIN_RTO_US;
+    }
+    if (conn->rto > RUDP_MAX_RTO_US) {
+        conn->rto = RUDP_MAX_RTO_US;
+    }
+    rudp_applyTimeout(conn);
+}
+
+/**
+ * double the RTO after a timeout, until the next sample resets it
+ */
+static void rudp_backoff(RUDPConnection* conn){
+    conn->rto *= 2;
+    if (conn->rto > RUDP_MAX_RTO_US) {
+        conn->rto = RUDP_MAX_RTO_US;
+    }
+    rudp_applyTimeout(conn);
+}
+
+/**
+ * receiveing ACK from the peer
+ * @param ackSeq set to the first sequence number the receiver is missing
+ * @param sack RUDP_SACK_BYTES buffer for the selective ACK bitmap, can be NULL
+ * return -3: not an ACK of this connection, -2: timeout, -1: error, 1: Received
+ */
+int rudp_receiveACK(RUDPConnection* conn, unsigned int* ackSeq, unsigned char* sack){
+    RUDPPacket* buffer;
+    struct sockaddr_in srcAddress;
+
+    int receiveACK = rudp_recvPacket(conn, &buffer, &srcAddress, 0);
+    if (receiveACK == -1) {
+        close(conn->socket);
+        return -1;
+    }
+    if (receiveACK < 0) {
+        return receiveACK;
+    }
+
+    // ACKs of another connection on the same port aren't ours
+    if(buffer->header.flags == ACK_FLAG && buffer->header.length <= RUDP_SACK_BYTES && buffer->header.connId == conn->connId){
+        *ackSeq = buffer->header.seq;
+        if (sack != NULL) {
+            memset(sack, 0, RUDP_SACK_BYTES);
+            memcpy(sack, buffer->data, buffer->header.length);
+        }
+        return 1;
+    }
+    return -3;
+}
+
+/**
+ * wait for the ACK of the control packet seq, that is an ACK of seq + 1, older ACKs are skipped.
+ * A control packet that was sent once gives a round trip sample.
+ * @param payload RUDP_SACK_BYTES buffer for the payload of the ACK, can be NULL
+ * return -2: timeout, -1: error, 0: disconnected, 1: Received
+ */
+static int rudp_waitForACK(RUDPConnection* conn, unsigned int seq, long long sentAt, int retransmitted,
+                           unsigned char* payload){
+    while (1) {
+        unsigned int ackSeq;
+        int ACKresult = rudp_receiveACK(conn, &ackSeq, payload);
+        if (ACKresult == 1 && ackSeq == seq + 1) {
+            if (!retransmitted) {
+                rudp_updateRTT(conn, rudp_now() - sentAt);
+            }
+            return 1;
+        }
+        if (ACKresult != 1 && ACKresult != -3) {
+            return ACKresult;
+        }
+    }
+}
+
+/**
+ *  request connect and waits for ACK. The SYN proposes the connection options,
+ *  the receiver's ACK tells which ones are used. A connection without an ID gets a random one.
  * @return -1: error, 0: disconnected, 1: received
  */
-int rudp_connect(int socket,struct sockaddr_in* destAddress,struct sockaddr_in* srcAddress){
+int rudp_connect(RUDPConnection* conn){
     
-    // create connect header 
-    RUDPHeader SYN;
-    memset(&SYN,0,sizeof(RUDPHeader));
-    SYN.length=0;
-    strcpy(SYN.data,"");
-    SYN.checksum = 0;
-    SYN.flags = SYN_FLAG;
+    // the sender waits for ACKs at most one RTO
+    if (rudp_applyTimeout(conn) < 0) {
+        return -1;
+    }
+
+    while (conn->connId == 0) {
+        if (getrandom(&conn->connId, sizeof(conn->connId), 0) != sizeof(conn->connId)) {
+            conn->connId = (unsigned int) (rudp_now() ^ getpid());
+        }
+    }
+
+    RUDPOptions options;
+    memset(&options, 0, sizeof(options));
+    options.integrity = conn->integrity;
+    options.congestion = conn->congestion >= 0 ? conn->congestion : RUDP_CC_AIMD;
+    options.fecData = conn->fecData;
+    options.fecParity = conn->fecParity;
+    options.compression = conn->compression;
+    options.delta = conn->delta;
 
     // while didnt get ack and timeout occured send again
+    int retransmitted = 0;
     while(1) {
 
-        int sendSYN = sendto(socket, &SYN, sizeof(RUDPHeader), 0, (struct sockaddr *) destAddress, sizeof(*destAddress));
+        long long sentAt = rudp_now();
+        int sendSYN = rudp_sendPacket(conn, &conn->peer, SYN_FLAG, conn->nextSeq, (char *) &options, sizeof(options));
         if (sendSYN == -1) {
-            printf("sendto() failed with error code  : %d", errno);
-            close(socket);
+            close(conn->socket);
             return -1;
         }
 
-        int ACKresult = rudp_receiveACK(socket, srcAddress);
+        // a receiver that sends no options back accepted none, that is the defaults
+        unsigned char accepted[RUDP_SACK_BYTES];
+        int ACKresult = rudp_waitForACK(conn, conn->nextSeq, sentAt, retransmitted, accepted);
+        if (ACKresult == 1) {
+            conn->nextSeq++;
+            conn->sendBase = conn->nextSeq;
+            conn->blockStart = conn->nextSeq;
+            conn->integrity = ((RUDPOptions *) accepted)->integrity;
+            conn->congestion = ((RUDPOptions *) accepted)->congestion;
+            conn->fecData = ((RUDPOptions *) accepted)->fecData;
+            conn->fecParity = ((RUDPOptions *) accepted)->fecParity;
+            conn->compression = ((RUDPOptions *) accepted)->compression;
+            conn->delta = ((RUDPOptions *) accepted)->delta;
+            conn->deliveredAt = rudp_now();
+            rudp_ccInit(&conn->cc, conn->congestion, conn->windowSize, conn->deliveredAt);
+            if (conn->fecData > 0) {
+                conn->parityBuffers = malloc(RUDP_MAX_BATCH * (sizeof(RUDPParity) + MESSAGE_SIZE));
+                if (conn->parityBuffers == NULL) {
+                    printf("malloc() failed\n");
+                    return -1;
+                }
+            }
+        }
         if (ACKresult != -2) {
             return ACKresult;
         }
 
-        printf("Timeout occurred, sending connect again\n");
+        rudp_backoff(conn);
+        retransmitted = 1;
+        counters_add(COUNTER_TIMEOUTS, 1);
+        printf("Timeout occurred, sending connect again (RTO %.1fms)\n", conn->rto / 1000.0);
     }
 }
+
+
 /**
- * send disconnect and wait for ack, if not sent send again
- * @param socket
- * @param destAddress
- * @param srcAddress
- * @return -1: error, 0: disconnected, 1: received
+ * Queue (or requeue) the packet with sequence number seq, its payload waits in its slot of the window
+ * @return -1: failure, 1: successful
  */
-int rudp_disconnect(int socket,struct sockaddr_in* destAddress,struct sockaddr_in* srcAddress){
+static int rudp_sendDataPacket(RUDPConnection* conn, unsigned int seq){
+    if (rudp_pace(conn) < 0) {
+        return -1;
+    }
 
-    // Create disconnect header
-    RUDPHeader FIN;
-    memset(&FIN,0,sizeof(RUDPHeader));
-    FIN.length=0;
-    strcpy(FIN.data,"");
-    FIN.checksum = 0;
-    FIN.flags = FIN_FLAG;
+    // the header stays in the batch after a flush, its integrity check goes into the parity
+    int queued = conn->sendBatch->count;
+    RUDPSendSlot* slot = &conn->sendWindow[seq % RUDP_MAX_WINDOW];
+    int sendData = rudp_queuePacket(conn, &conn->peer, slot->flags, seq, slot->data, slot->length);
+    if (sendData < 0) {
+        return -1;
+    }
 
-    // while didnt get ack send again
-    while (1) {
+    slot->checksum = conn->sendBatch->headers[queued].checksum;
+    slot->sentAt = rudp_now();
+    slot->delivered = conn->delivered;
+    slot->deliveredAt = conn->deliveredAt;
+    return 1;
+}
 
-        int sendFIN = sendto(socket, &FIN, sizeof(RUDPHeader), 0, (struct sockaddr *) destAddress, sizeof(*destAddress));
-        if (sendFIN == -1) {
-            printf("sendto() failed with error code  : %d\n", errno);
-            close(socket);
+/**
+ * XOR length bytes of from into into, 8 bytes at a time
+ */
+static void rudp_xor(char* into, const char* from, int length){
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word, other;
+        memcpy(&word, into + i, sizeof(word));
+        memcpy(&other, from + i, sizeof(other));
+        word ^= other;
+        memcpy(into + i, &word, sizeof(word));
+    }
+    for (; i < length; i++) {
+        into[i] ^= from[i];
+    }
+}
+
+/**
+ * Queue the fecParity parity packets of the data packets [blockStart, blockEnd), they take up no
+ * sequence number, aren't counted in flight and aren't sent again. Parity j covers the packets
+ * j, j + fecParity ... of the block, it is as long as the longest of them. Its payload waits in
+ * the parity buffer of its place in the batch.
+ * @return -1: failure, 1: successful
+ */
+static int rudp_sendParity(RUDPConnection* conn, unsigned int blockStart, unsigned int blockEnd){
+    for (unsigned int j = 0; j < (unsigned int) conn->fecParity && j < blockEnd - blockStart; j++) {
+        if (rudp_pace(conn) < 0) {
             return -1;
         }
-        int ACKresult = rudp_receiveACK(socket, srcAddress);
-        if (ACKresult != -2) {
-            return ACKresult;
+        char* payload = conn->parityBuffers + conn->sendBatch->count * (sizeof(RUDPParity) + MESSAGE_SIZE);
+        char* bytes = payload + sizeof(RUDPParity);
+        RUDPParity parity;
+        memset(&parity, 0, sizeof(parity));
+        unsigned short lengths = 0;
+        int parityLength = 0;
+
+        // the last packet of every rudp_send() buffer may be shorter, the bytes past it count as zeros
+        for (unsigned int seq = blockStart + j; seq - blockStart < blockEnd - blockStart; seq += conn->fecParity) {
+            RUDPSendSlot* slot = &conn->sendWindow[seq % RUDP_MAX_WINDOW];
+            int packetLength = slot->length;
+            if (parity.count == 0) {
+                memcpy(bytes, slot->data, packetLength);
+                parityLength = packetLength;
+            } else if (packetLength <= parityLength) {
+                rudp_xor(bytes, slot->data, packetLength);
+            } else {
+                rudp_xor(bytes, slot->data, parityLength);
+                memcpy(bytes + parityLength, slot->data + parityLength, packetLength - parityLength);
+                parityLength = packetLength;
+            }
+            parity.checksum ^= slot->checksum;
+            parity.flags ^= slot->flags;
+            lengths ^= packetLength;
+            parity.count++;
+        }
+        parity.length = htons(lengths);
+        parity.stride = conn->fecParity;
+        memcpy(payload, &parity, sizeof(parity));
+
+        if (rudp_queuePacket(conn, &conn->peer, PARITY_FLAG, blockStart + j, payload, sizeof(RUDPParity) + parityLength) < 0) {
+            return -1;
         }
+        conn->paritySent++;
+    }
+    return 1;
+}
 
-        printf("Timeout occurred, sending disconnect again\n");
+/**
+ * mark one packet of an ACK, the newest packet that is acknowledged for the first time
+ * gives the delivery rate sample and, if it was sent once, the RTT sample (Karn)
+ */
+static void rudp_ackPacket(RUDPConnection* conn, unsigned int seq, RUDPAckSample* sample,
+                           RUDPSendSlot** newest, RUDPSendSlot** newestOnce){
+    RUDPSendSlot* slot = &conn->sendWindow[seq % RUDP_MAX_WINDOW];
+    if (slot->acked) {
+        return;
+    }
+    slot->acked = 1;
+    sample->acked++;
+    counters_add(COUNTER_GOODPUT_BYTES, slot->length);
+    if (*newest == NULL || slot->sentAt > (*newest)->sentAt) {
+        *newest = slot;
+    }
+    if (!slot->retransmitted && (*newestOnce == NULL || slot->sentAt > (*newestOnce)->sentAt)) {
+        *newestOnce = slot;
     }
 }
 
+/**
+ * mark the packets of [base, next) that an ACK covers: all before the cumulative
+ * sequence number and the ones set in the SACK bitmap, then update the RTT
+ * estimate and tell the congestion controller what was delivered
+ */
+static void rudp_handleACK(RUDPConnection* conn, unsigned int base, unsigned int next,
+                           unsigned int cumulative, const unsigned char* sack){
+    RUDPAckSample sample;
+    memset(&sample, 0, sizeof(sample));
+    sample.now = rudp_now();
+    RUDPSendSlot* newest = NULL;
+    RUDPSendSlot* newestOnce = NULL;
+
+    // everything before the cumulative sequence number arrived, unless the ACK is older than base
+    if (cumulative - base <= next - base) {
+        for (unsigned int seq = base; seq != cumulative; seq++) {
+            rudp_ackPacket(conn, seq, &sample, &newest, &newestOnce);
+        }
+    }
+
+    // the packets after the first gap that arrived
+    for (int i = 0; i < RUDP_SACK_BYTES * 8; i++) {
+        unsigned int seq = cumulative + 1 + i;
+        if ((sack[i / 8] & (1 << (i % 8))) && seq - base < next - base) {
+            rudp_ackPacket(conn, seq, &sample, &newest, &newestOnce);
+        }
+    }
+
+    if (sample.acked == 0) {
+        return;
+    }
+    if (newestOnce != NULL) {
+        sample.rtt = sample.now - newestOnce->sentAt;
+        rudp_updateRTT(conn, sample.rtt);
+    }
+
+    conn->inflight -= sample.acked;
+    conn->delivered += sample.acked;
+    sample.inflight = conn->inflight;
+    sample.srtt = conn->srtt;
+    sample.delivered = conn->delivered;
+    sample.priorDelivered = newest->delivered;
+    if (sample.now > newest->deliveredAt) {
+        sample.deliveryRate = (conn->delivered - newest->delivered) * 1000000.0 / (sample.now - newest->deliveredAt);
+    }
+    conn->deliveredAt = sample.now;
+    conn->cc.ops->onAck(&conn->cc, &sample);
+}
 
 /**
- * Send the data and waits for ACK, if didnt get any, send again
- * @return -1: failure, 1: successful, 0: sender closed
+ * Send length bytes of data in packets of MESSAGE_SIZE, keeping up to windowSize
+ * packets in flight, and no more than the congestion controller's window. ACKs are cumulative with a SACK bitmap, so only the packets
+ * that are still missing are sent again (selective repeat): right away once
+ * RUDP_DUP_THRESH later packets were acknowledged, otherwise when their timer expires.
+ * ACKs of packets that were sent once update the RTT estimate, a timeout backs off the RTO.
+ * With FEC every block of fecData packets is followed by its parity packets.
+ * The payloads are copied into the window, so it stays open from one call to the next.
+ * @param lastFlags flags of the last packet, with END_FLAG an empty buffer is one END packet
+ * @param wait 0 to return once the last packet was sent, 1 once every packet was acknowledged
+ * @return -1: failure, 1: successful
  */
-int rudp_sendDataPacket(int socket,char* data,struct sockaddr_in* destAddress,struct sockaddr_in* srcAddress){
-    // Create a data message
-    RUDPHeader Data;
-    memset(&Data,0,sizeof(RUDPHeader));
-    Data.length = sizeof(char)* strlen(data);
-    strcpy(Data.data,data);
-    Data.checksum = calculate_checksum(Data.data,Data.length);
-    Data.flags = DATA_FLAG;
-    
-    // while didnt get ack and timeout occured send again
-   while(1) {
+static int rudp_sendPackets(RUDPConnection* conn, const char* data, int length, char lastFlags, int wait){
+    unsigned int firstSeq = conn->nextSeq;
+    unsigned int endSeq = firstSeq + (length + MESSAGE_SIZE - 1) / MESSAGE_SIZE;
+    if (endSeq == firstSeq && lastFlags != DATA_FLAG) {
+        endSeq++;
+    }
+
+    while (1) {
+
+        // fill the window with new packets
+        while (conn->nextSeq != endSeq && conn->nextSeq - conn->sendBase < (unsigned int) conn->windowSize &&
+               conn->inflight < (int) conn->cc.cwnd) {
+            unsigned int seq = conn->nextSeq;
+            int offset = (seq - firstSeq) * MESSAGE_SIZE;
+            RUDPSendSlot* slot = &conn->sendWindow[seq % RUDP_MAX_WINDOW];
+            slot->acked = 0;
+            slot->retransmitted = 0;
+            slot->closesBlock = 0;
+            slot->flags = seq + 1 == endSeq ? lastFlags : DATA_FLAG;
+            slot->length = length - offset < MESSAGE_SIZE ? length - offset : MESSAGE_SIZE;
+            memcpy(slot->data, data + offset, slot->length);
+            if (rudp_sendDataPacket(conn, seq) < 0) {
+                return -1;
+            }
+            conn->inflight++;
+            conn->nextSeq++;
+
+            // a block of fecData packets is complete, or the transfer ends in the middle of one
+            if (conn->fecData > 0 && (conn->nextSeq - conn->blockStart == (unsigned int) conn->fecData || slot->flags == END_FLAG)) {
+                if (rudp_sendParity(conn, conn->blockStart, conn->nextSeq) < 0) {
+                    return -1;
+                }
+                slot->closesBlock = 1;
+                conn->blockStart = conn->nextSeq;
+            }
+        }
+        if (rudp_flushPackets(conn) < 0) {
+            return -1;
+        }
+        if (conn->nextSeq == endSeq && (!wait || conn->sendBase == endSeq)) {
+            return 1;
+        }
+
+        unsigned int ackSeq;
+        unsigned char sack[RUDP_SACK_BYTES];
+        int ACKresult = rudp_receiveACK(conn, &ackSeq, sack);
+        if (ACKresult == -1) {
+            return -1;
+        }
+
+        if (ACKresult == 1) {
+            // mark the packets and slide the window over the acknowledged prefix
+            rudp_handleACK(conn, conn->sendBase, conn->nextSeq, ackSeq, sack);
+            while (conn->sendBase != conn->nextSeq && conn->sendWindow[conn->sendBase % RUDP_MAX_WINDOW].acked) {
+                conn->sendBase++;
+            }
+
+            // a hole with enough acknowledged packets after it is a loss, resend it once without waiting.
+            // With FEC only the packets after its block count, until then the parity may still fill it.
+            int ackedAfter = 0;
+            int ackedAfterBlock = 0;
+            for (unsigned int seq = conn->nextSeq; seq != conn->sendBase; ) {
+                seq--;
+                RUDPSendSlot* slot = &conn->sendWindow[seq % RUDP_MAX_WINDOW];
+                if (conn->fecData == 0 || slot->closesBlock) {
+                    ackedAfterBlock = ackedAfter;
+                }
+                if (slot->acked) {
+                    ackedAfter++;
+                } else if (ackedAfterBlock >= RUDP_DUP_THRESH && !slot->retransmitted) {
+                    slot->retransmitted = 1;
+                    conn->retransmits++;
+                    counters_add(COUNTER_RETRANSMITS, 1);
+                    conn->cc.ops->onLoss(&conn->cc, seq, conn->nextSeq);
+                    if (rudp_sendDataPacket(conn, seq) < 0) {
+                        return -1;
+                    }
+                }
+            }
+            if (rudp_flushPackets(conn) < 0) {
+                return -1;
+            }
+        }
+
+        // resend only the packets whose timer expired, and back off once per round
+        long long now = rudp_now();
+        long long rto = conn->rto;
+        int expired = 0;
+        for (unsigned int seq = conn->sendBase; seq != conn->nextSeq; seq++) {
+            RUDPSendSlot* slot = &conn->sendWindow[seq % RUDP_MAX_WINDOW];
+            if (!slot->acked && now - slot->sentAt >= rto) {
+                slot->retransmitted = 1;
+                conn->retransmits++;
+                counters_add(COUNTER_RETRANSMITS, 1);
+                if (rudp_sendDataPacket(conn, seq) < 0) {
+                    return -1;
+                }
+                expired = 1;
+            }
+        }
+        if (expired) {
+            if (rudp_flushPackets(conn) < 0) {
+                return -1;
+            }
+            rudp_backoff(conn);
+            counters_add(COUNTER_TIMEOUTS, 1);
+            conn->cc.ops->onTimeout(&conn->cc);
+        }
+    }
+}
 
-       int sendData = sendto(socket, &Data, sizeof(RUDPHeader), 0, 
-       (struct sockaddr *) destAddress, sizeof(*destAddress));
+/**
+ * send length bytes of data, see rudp_sendPackets(). Returns once the data is in the window,
+ * the packets may still be in flight.
+ * @return -1: failure, 1: successful
+ */
+int rudp_send(RUDPConnection* conn, const char* data, int length){
+    return rudp_sendPackets(conn, data, length, DATA_FLAG, 0);
+}
 
-       if (sendData < 0) {
-           printf("sendto() failed with error code  : %d\n", errno);
-           return -1;
-       }
+/**
+ * end the current transfer with an END packet, delivered in order after the data before it.
+ * Returns once the receiver acknowledged all of it.
+ * @return -1: failure, 1: successful
+ */
+int rudp_sendEnd(RUDPConnection* conn){
+    return rudp_sendPackets(conn, "", 0, END_FLAG, 1);
+}
 
-       int ACKresult = rudp_receiveACK(socket,srcAddress);
+/**
+ * send disconnect and wait for ack, if not sent send again. The packets still in flight
+ * are acknowledged first, the FIN can't overtake them.
+ * @return -1: error, 0: disconnected, 1: received
+ */
+int rudp_disconnect(RUDPConnection* conn){
+    if (conn->sendBase != conn->nextSeq && rudp_sendPackets(conn, NULL, 0, DATA_FLAG, 1) < 0) {
+        return -1;
+    }
 
-       if(ACKresult != -2) {
-           return ACKresult;
-       }
+    // while didnt get ack send again
+    int retransmitted = 0;
+    while (1) {
 
-       printf("Timeout occurred, sending file again\n");
-   }
+        long long sentAt = rudp_now();
+        int sendFIN = rudp_sendPacket(conn, &conn->peer, FIN_FLAG, conn->nextSeq, NULL, 0);
+        if (sendFIN == -1) {
+            close(conn->socket);
+            return -1;
+        }
+        int ACKresult = rudp_waitForACK(conn, conn->nextSeq, sentAt, retransmitted, NULL);
+        if (ACKresult == 1) {
+            conn->nextSeq++;
+        }
+        if (ACKresult != -2) {
+            return ACKresult;
+        }
+
+        rudp_backoff(conn);
+        retransmitted = 1;
+        counters_add(COUNTER_TIMEOUTS, 1);
+        printf("Timeout occurred, sending disconnect again (RTO %.1fms)\n", conn->rto / 1000.0);
+    }
 }
 
 
@@ -146,60 +1146,325 @@ int rudp_sendDataPacket(int socket,char* data,struct sockaddr_in* destAddress,st
 
 
 /**
- * function that sends ACK to destAddress
- * @param socket
- * @param destAddress
+ * function that sends a cumulative ACK with a SACK bitmap to destAddress: the header
+ * holds the first missing packet and bit i of the payload packet seq + 1 + i.
+ * The bitmap is cut after its last set byte, so an in-order ACK is a bare header.
  * @return -1: failed\n 1: successful
  */
-int rudp_sendACK(int socket,struct sockaddr_in* destAddress){
-    // Create a ACK message and send it
-    RUDPHeader ACK;
-    memset(&ACK,0,sizeof(RUDPHeader));
-    ACK.length=0;
-    strcpy(ACK.data,"");
-    ACK.checksum = 0;
-    ACK.flags = ACK_FLAG;
-    int sendACK = sendto(socket, &ACK, sizeof(RUDPHeader), 0, (struct sockaddr *)destAddress, sizeof(*destAddress));
-    if (sendACK == -1) {
-        printf("sendto() failed with error code  : %d\n", errno);
-        return -1;
+int rudp_sendACK(RUDPConnection* conn, struct sockaddr_in* destAddress){
+    // packets that wait in the receive window arrived too
+    unsigned int cumulative = conn->expectedSeq;
+    while (cumulative - conn->expectedSeq < RUDP_MAX_WINDOW && conn->recvWindow[cumulative % RUDP_MAX_WINDOW].present) {
+        cumulative++;
+    }
+
+    unsigned char sack[RUDP_SACK_BYTES];
+    memset(sack, 0, sizeof(sack));
+    int sackLength = 0;
+    for (int i = 0; i < RUDP_SACK_BYTES * 8; i++) {
+        unsigned int seq = cumulative + 1 + i;
+        if (seq - conn->expectedSeq >= RUDP_MAX_WINDOW) {
+            break;
+        }
+        if (conn->recvWindow[seq % RUDP_MAX_WINDOW].present) {
+            sack[i / 8] |= 1 << (i % 8);
+            sackLength = i / 8 + 1;
+        }
+    }
+
+    conn->unackedPackets = 0;
+    return rudp_sendPacket(conn, destAddress, ACK_FLAG, cumulative, (char *) sack, sackLength);
+}
+
+/**
+ * count an in-order packet and acknowledge once ackEvery of them are waiting
+ * or the oldest one waited RUDP_ACK_DELAY_US
+ * @return -1: failed\n 1: successful
+ */
+static int rudp_delayACK(RUDPConnection* conn){
+    long long now = rudp_now();
+    if (conn->unackedPackets == 0) {
+        conn->firstUnackedAt = now;
+    }
+    conn->unackedPackets++;
+    if (conn->unackedPackets >= conn->ackEvery || now - conn->firstUnackedAt >= RUDP_ACK_DELAY_US) {
+        return rudp_sendACK(conn, &conn->peer);
     }
     return 1;
 }
 
 /**
- * recieve the data from the sender and sends ACK
- * @return -1: failure, 0: exit message, -2: EOF, -3:bad packet >0:Data
+ * hand an in-order payload to the caller, an END packet ends the transfer whatever its payload
+ * @return -2: EOF, >0: Data
+ */
+static int rudp_deliver(const char* payload, unsigned short length, char flags, char* data){
+    if (flags == END_FLAG) {
+        printf("File transfer completed.\n");
+        return -2;
+    }
+    if (data != NULL) {
+        memcpy(data, payload, length);
+    }
+    counters_add(COUNTER_GOODPUT_BYTES, length);
+    return length;
+}
+
+/**
+ * hand out the next in-order packet if it already waits in the receive window
+ * @return -4: not there yet, -2: EOF, >0: Data
+ */
+int rudp_deliverWindow(RUDPConnection* conn, char* data){
+    RUDPRecvSlot* slot = &conn->recvWindow[conn->expectedSeq % RUDP_MAX_WINDOW];
+    if (!slot->present) {
+        return -4;
+    }
+    slot->present = 0;
+    conn->expectedSeq++;
+    return rudp_deliver(slot->data, slot->length, slot->flags, data);
+}
+
+/**
+ * recieve the data from the sender and sends ACK. Payloads are returned in
+ * sequence order, a packet that arrives early waits in the receive window
+ * and is returned by a later call once the gap before it is filled.
+ * The first SYN binds the connection to its connection ID, packets of other connections are dropped.
+ * @param data buffer of MESSAGE_SIZE bytes for the payload, can be NULL
+ * @return -1: failure, 0: exit message, -2: EOF, -3:bad packet, -4: nothing in order yet, >0:Data
  */
-int rudp_receive(int socket,struct sockaddr_in* senderAddress){
-    RUDPHeader buffer;
-    memset(&buffer,0,sizeof(RUDPHeader));
+int rudp_receive(RUDPConnection* conn, char* data){
 
-    // Recieve Data from sender
-    socklen_t senderAddressLen = sizeof(*senderAddress);
-    int recvData = recvfrom(socket, &buffer, sizeof(buffer), 0, (struct sockaddr *)senderAddress,&senderAddressLen);
+    // a packet that arrived early may already complete the sequence
+    int delivered = rudp_deliverWindow(conn, data);
+    if (delivered != -4) {
+        return delivered;
+    }
+
+    RUDPPacket* buffer;
+
+    // Recieve Data from sender. While an ACK is held back only take what is queued,
+    // if the socket is drained the sender waits for it, so send it before blocking.
+    struct sockaddr_in senderAddress;
+    int recvData = -2;
+    if (conn->unackedPackets > 0) {
+        recvData = rudp_recvPacket(conn, &buffer, &senderAddress, MSG_DONTWAIT);
+        if (recvData == -2 && rudp_sendACK(conn, &conn->peer) < 0) {
+            return -1;
+        }
+    }
+    if (recvData == -2) {
+        recvData = rudp_recvPacket(conn, &buffer, &senderAddress, 0);
+    }
+    if (recvData == -3) {
+        return -3;
+    }
     if (recvData < 0){
-        printf("recvfrom() failed with error code : %d", errno);
-        close(socket);
+        close(conn->socket);
         return -1;
     }
+    if (conn->connId != 0 && buffer->header.connId != conn->connId) {
+        return -3;
+    }
+
+    return rudp_handlePacket(conn, buffer, recvData, &senderAddress, data);
+}
+
+/**
+ * keep a copy of a data packet in its receive window slot
+ */
+static void rudp_holdPacket(RUDPConnection* conn, const RUDPPacket* packet){
+    RUDPRecvSlot* slot = &conn->recvWindow[packet->header.seq % RUDP_MAX_WINDOW];
+    slot->held = 1;
+    slot->seq = packet->header.seq;
+    slot->checksum = packet->header.checksum;
+    slot->length = packet->header.length;
+    slot->flags = packet->header.flags;
+    memcpy(slot->data, packet->data, packet->header.length);
+}
 
+/**
+ * check, buffer and acknowledge a data packet, and hand it to the caller if it is in order.
+ * With FEC the in-order packets are held too, a parity packet may need them.
+ * @return -1: failure, -2: EOF, -3: bad packet, -4: nothing in order yet, >0: Data
+ */
+static int rudp_handleData(RUDPConnection* conn, RUDPPacket* buffer, struct sockaddr_in* senderAddress, char* data){
     int ACKResult;
+    if(buffer->header.length > MESSAGE_SIZE || buffer->header.checksum != rudp_integrity(conn, buffer->data, buffer->header.length)){
+        counters_add(COUNTER_CHECKSUM_FAILURES, 1);
+        return -3;
+    }
+
+    // packet that was already delivered, the ACK was lost so send it again
+    unsigned int offset = buffer->header.seq - conn->expectedSeq;
+    if ((int) offset < 0) {
+        counters_add(COUNTER_DUPLICATES, 1);
+        ACKResult = rudp_sendACK(conn, senderAddress);
+        if(ACKResult < 0){return -1;}
+        return -4;
+    }
+    // beyond the receive window, drop it and let the sender retransmit
+    if (offset >= RUDP_MAX_WINDOW) {
+        return -4;
+    }
+
+    // in order, deliver right away. The ACK may wait for the next packets,
+    // unless this packet filled a gap and the sender should hear it now.
+    if (offset == 0) {
+        if (conn->fecData > 0) {
+            rudp_holdPacket(conn, buffer);
+        }
+        conn->peer = *senderAddress;
+        conn->expectedSeq++;
+        if (conn->recvWindow[conn->expectedSeq % RUDP_MAX_WINDOW].present) {
+            ACKResult = rudp_sendACK(conn, senderAddress);
+        } else {
+            ACKResult = rudp_delayACK(conn);
+        }
+        if(ACKResult < 0){return -1;}
+        return rudp_deliver(buffer->data, buffer->header.length, buffer->header.flags, data);
+    }
+
+    // early, keep it until the packets before it arrive and report the gap right away
+    RUDPRecvSlot* slot = &conn->recvWindow[buffer->header.seq % RUDP_MAX_WINDOW];
+    if (!slot->present) {
+        slot->present = 1;
+        rudp_holdPacket(conn, buffer);
+    } else {
+        counters_add(COUNTER_DUPLICATES, 1);
+    }
+    ACKResult = rudp_sendACK(conn, senderAddress);
+    if(ACKResult < 0){return -1;}
+    return -4;
+}
+
+/**
+ * rebuild the packet a parity packet's group is missing from the ones that are held, and take
+ * it like a data packet that arrived. The integrity check of the rebuilt packet is the XOR of
+ * the parity's and the held packets' ones, so it is checked like any other. A group that misses
+ * more than one packet is left to the retransmissions.
+ * @return -1: failure, -2: EOF, -3: bad packet, -4: nothing rebuilt or nothing in order yet, >0: Data
+ */
+static int rudp_handleParity(RUDPConnection* conn, RUDPPacket* buffer, struct sockaddr_in* senderAddress, char* data){
+    RUDPParity parity;
+    int parityLength = buffer->header.length - (int) sizeof(RUDPParity);
+    if (conn->fecData == 0 || parityLength < 0) {
+        return -3;
+    }
+    memcpy(&parity, buffer->data, sizeof(parity));
+    if (parity.count == 0 || parity.stride == 0) {
+        return -3;
+    }
+
+    unsigned int missing = 0;
+    int missingCount = 0;
+    for (unsigned int i = 0; i < parity.count && missingCount < 2; i++) {
+        unsigned int seq = buffer->header.seq + i * parity.stride;
+        RUDPRecvSlot* slot = &conn->recvWindow[seq % RUDP_MAX_WINDOW];
+        if (!slot->held || slot->seq != seq) {
+            missing = seq;
+            missingCount++;
+        }
+    }
+    // nothing lost, too much lost, or a packet that was delivered long ago
+    if (missingCount != 1 || missing - conn->expectedSeq >= RUDP_MAX_WINDOW) {
+        return -4;
+    }
+
+    RUDPPacket rebuilt;
+    unsigned short length = ntohs(parity.length);
+    char flags = parity.flags;
+    rebuilt.header.checksum = parity.checksum;
+    memcpy(rebuilt.data, buffer->data + sizeof(RUDPParity), parityLength);
+    memset(rebuilt.data + parityLength, 0, MESSAGE_SIZE - parityLength);
+    for (unsigned int i = 0; i < parity.count; i++) {
+        unsigned int seq = buffer->header.seq + i * parity.stride;
+        RUDPRecvSlot* slot = &conn->recvWindow[seq % RUDP_MAX_WINDOW];
+        if (seq != missing) {
+            rudp_xor(rebuilt.data, slot->data, slot->length);
+            rebuilt.header.checksum ^= slot->checksum;
+            length ^= slot->length;
+            flags ^= slot->flags;
+        }
+    }
+    if (length > parityLength || (flags != DATA_FLAG && flags != END_FLAG)) {
+        return -3;
+    }
+    rebuilt.header.connId = buffer->header.connId;
+    rebuilt.header.seq = missing;
+    rebuilt.header.length = length;
+    rebuilt.header.flags = flags;
+
+    int result = rudp_handleData(conn, &rebuilt, senderAddress, data);
+    if (result != -3 && result != -1) {
+        conn->fecRecovered++;
+        counters_add(COUNTER_FEC_RECOVERED, 1);
+    }
+    return result;
+}
+
+/**
+ * act on one datagram of the connection: answer SYN and FIN, check, buffer and
+ * acknowledge data, rebuild lost data from parity, and hand in-order payloads to the caller
+ * @param recvData payload length of the datagram
+ * @return -1: failure, 0: exit message, 1: connected, -2: EOF, -3:bad packet, -4: nothing in order yet or a repeated SYN, >0:Data
+ */
+int rudp_handlePacket(RUDPConnection* conn, RUDPPacket* buffer, int recvData, struct sockaddr_in* senderAddress, char* data){
+    int ACKResult;
+    unsigned int offset;
+    RUDPOptions options;
     //Analyze data from sender
-    switch (buffer.flags) {
+    switch (buffer->header.flags) {
         
-        // if SYN save client IP and send ACK
+        // if SYN save client address and options and send ACK with the options that are used,
+        // the SYN takes up one sequence number
         case SYN_FLAG:
             printf("Connection request received, sending ACK.\n");
-            char clientIPAddrReadable[32] = {'\0'};
-            inet_ntop(AF_INET, &senderAddress->sin_addr, clientIPAddrReadable, sizeof(clientIPAddrReadable));
-            ACKResult = rudp_sendACK(socket,senderAddress);
+            conn->peer = *senderAddress;
+            memset(&options, 0, sizeof(options));
+            memcpy(&options, buffer->data, recvData < (int) sizeof(options) ? recvData : (int) sizeof(options));
+            if (options.integrity != RUDP_INTEGRITY_CRC32C) {
+                options.integrity = RUDP_INTEGRITY_CHECKSUM;
+            }
+            if (options.congestion >= RUDP_CC_COUNT) {
+                options.congestion = RUDP_CC_AIMD;
+            }
+            if (options.fecData == 0 || options.fecData > RUDP_FEC_MAX_DATA || options.fecParity == 0 ||
+                options.fecParity > RUDP_FEC_MAX_PARITY || options.fecParity > options.fecData) {
+                options.fecData = 0;
+                options.fecParity = 0;
+            }
+            if (options.compression != conn->compression) {
+                options.compression = 0;
+            }
+            options.delta = options.delta != 0;
+            offset = buffer->header.seq - conn->expectedSeq;
+            if (offset == 0) {
+                conn->expectedSeq++;
+                conn->connId = buffer->header.connId;
+                conn->integrity = options.integrity;
+                conn->fecData = options.fecData;
+                conn->fecParity = options.fecParity;
+                conn->compression = options.compression;
+                conn->delta = options.delta;
+                // the receiver's own choice of algorithm wins over the sender's
+                if (conn->congestion < 0) {
+                    conn->congestion = options.congestion;
+                }
+            }
+            options.integrity = conn->integrity;
+            options.congestion = conn->congestion;
+            options.fecData = conn->fecData;
+            options.fecParity = conn->fecParity;
+            options.compression = conn->compression;
+            options.delta = conn->delta;
+            ACKResult = rudp_sendPacket(conn, senderAddress, ACK_FLAG, buffer->header.seq + 1,
+                                        (char *) &options, sizeof(options));
             if(ACKResult < 0){return -1;}
-            return 1;
+            // a repeated SYN only means the sender missed the ACK
+            return offset == 0 ? 1 : -4;
 
         // if FIN send ACK
         case FIN_FLAG:
-            ACKResult = rudp_sendACK(socket,senderAddress);
+            ACKResult = rudp_sendPacket(conn, senderAddress, ACK_FLAG, buffer->header.seq + 1, NULL, 0);
             if(ACKResult < 0){return -1;}
             printf("ACK Sent. Exiting...\n");
             return 0;
@@ -207,44 +1472,13 @@ int rudp_receive(int socket,struct sockaddr_in* senderAddress){
         // if Message check checksum, return ACK if checksum is not OK dont send ack,
         // return -2 if got EOF 
         case DATA_FLAG:
-            if(buffer.checksum == calculate_checksum(buffer.data,buffer.length)){
-                ACKResult = rudp_sendACK(socket,senderAddress);
-                if(ACKResult < 0){return -1;}
-                if(buffer.data[0]==EOF){
-                    printf("File transfer completed.\n");
-                    printf("ACK Sent.\n");
-                    return -2;
-                }
-                // if not EOF send the bytes received
-                return buffer.length;
-            }
-            else{
-                printf(" something wrong with the packet, sending ACK\n");
-                return -3;
-            }
-    }
-    return -1;
-}
-
-/* 
-*   A checksum function that returns 16 bit checksum for data.
-*   This function is taken from RFC1071, can be found here:
-*   https://tools.ietf.org/html/rfc1071
-*
-*/
-unsigned short int calculate_checksum(void *data, unsigned int bytes) {
-    unsigned short int *data_pointer = (unsigned short int *)data;
-    unsigned int total_sum = 0;
-// Main summing loop
-    while (bytes > 1) {
-        total_sum += *data_pointer++;
-        bytes -= 2;
-    }
-// Add left-over byte, if any
-    if (bytes > 0)
-        total_sum += *((unsigned char *)data_pointer);
-// Fold 32-bit sum to 16 bits
-    while (total_sum >> 16)
-        total_sum = (total_sum & 0xFFFF) + (total_sum >> 16);
-    return (~((unsigned short int)total_sum));
-}
\ No newline at end of file
+        case END_FLAG:
+            return rudp_handleData(conn, buffer, senderAddress, data);
+
+        // a parity packet may stand in for a lost one
+        case PARITY_FLAG:
+            return rudp_handleParity(conn, buffer, senderAddress, data);
+    }
+    // a flag nobody sends is dropped like a corrupted packet
+    return -3;
+}
@@ -1,6 +1,10 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sendmmsg() and recvmmsg()
+#endif
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -9,42 +13,379 @@
 #include <time.h>
 #include "stdio.h"
 #include <sys/time.h>
+#include "Histogram.h"
+#include "Counters.h"
 
-#define BUFFER_SIZE 4096
 #define MESSAGE_SIZE 2048
 #define DEFAULT_IP "127.0.0.1"
 
+// window and timer settings
+#define RUDP_MAX_WINDOW 256     // capacity of the send and receive windows (in packets)
+#define RUDP_DEFAULT_WINDOW 16  // packets in flight when the sender doesn't ask for another size
+#define RUDP_INITIAL_RTO_US 1000000 // retransmission timeout before the first RTT sample (RFC 6298)
+#define RUDP_MIN_RTO_US 1000        // lower bound of the retransmission timeout
+#define RUDP_MAX_RTO_US 4000000     // upper bound of the retransmission timeout, also caps the backoff
+#define RUDP_SIDE_SEND 1        // rudp_init() allocates the send window and batch
+#define RUDP_SIDE_RECEIVE 2     // rudp_init() allocates the receive window and batch
+
+// acknowledgement settings
+#define RUDP_SACK_BYTES (RUDP_MAX_WINDOW / 8) // selective ACK bitmap, one bit per packet of the receive window
+#define RUDP_ACK_EVERY 4        // the receiver acknowledges at least every this many in-order packets
+#define RUDP_ACK_DELAY_US 200   // and holds an ACK back for at most this long while packets keep coming
+#define RUDP_DUP_THRESH 3       // a packet with this many acknowledged packets after it is resent right away
+
+// batched socket I/O
+#define RUDP_MAX_BATCH 64       // most datagrams moved by one sendmmsg() or recvmmsg() call
+#define RUDP_DEFAULT_BATCH 32
+
+// UDP segmentation offload, a run of datagrams crosses the stack as one buffer (UDP_SEGMENT, UDP_GRO)
+#define RUDP_GSO_MAX_SEGMENTS 64    // most datagrams in one buffer, the kernel's UDP_MAX_SEGMENTS
+#define RUDP_GSO_MAX_BYTES 65000    // most bytes of one buffer, a UDP datagram's limit less the headers
+#define RUDP_GRO_BUFFER_SIZE 65536  // room for one coalesced buffer on the receiver
+
+// pacing, the sender spaces its data and parity datagrams out instead of sending a window at once
+#define RUDP_PACER_AUTO -1      // fq where it is the system's qdisc and the peer isn't on loopback, the token bucket otherwise
+#define RUDP_PACER_OFF 0
+#define RUDP_PACER_FQ 1         // SO_MAX_PACING_RATE, the fq qdisc of the outgoing device spaces the datagrams
+#define RUDP_PACER_TXTIME 2     // SO_TXTIME, every datagram carries its departure time for the fq or etf qdisc
+#define RUDP_PACER_BUCKET 3     // token bucket in user space, the sender sleeps until a datagram is due
+#define RUDP_PACING_BURST_US 1000   // credit a sender that waited keeps, this much of its rate may go at once
+#define RUDP_PACING_OVERHEAD 28     // IPv4 and UDP header bytes counted for every datagram
+
+// receiver sessions, one per sender address and connection ID
+#define RUDP_MAX_SESSIONS 1024          // concurrent sessions one receiver socket serves
+#define RUDP_SESSION_BUCKETS (2 * RUDP_MAX_SESSIONS) // hash index size, a power of two kept at most half full
+#define RUDP_SESSION_IDLE_US 30000000   // a session that heard nothing from its sender this long is dropped
+#define RUDP_SESSION_POLL_US 1000000    // how often idle sessions are looked for, also while the socket is quiet
+
+// integrity modes, proposed by the sender in the SYN
+#define RUDP_INTEGRITY_CHECKSUM 0 // RFC 1071 internet checksum (default)
+#define RUDP_INTEGRITY_CRC32C 1   // CRC32C (Castagnoli)
+#define RUDP_INTEGRITY_SAMPLE 64  // one integrity check in this many is timed for the statistics
+
+// congestion control algorithms, proposed by the sender in the SYN, the receiver may override
+#define RUDP_CC_AIMD 0  // Reno-like additive increase, multiplicative decrease (default)
+#define RUDP_CC_BBR 1   // rate based, from the measured bottleneck bandwidth and min RTT
+#define RUDP_CC_NONE 2  // no congestion control, the window is the only limit
+#define RUDP_CC_COUNT 3
+
+// forward error correction, proposed by the sender in the SYN
+#define RUDP_FEC_MAX_DATA 64    // most data packets in a block
+#define RUDP_FEC_MAX_PARITY 16  // most parity packets per block
+
 // flags
 #define SYN_FLAG 'S'
 #define FIN_FLAG 'F'
 #define ACK_FLAG 'A'
 #define DATA_FLAG 'D'
+#define END_FLAG 'E'    // a data packet without payload that ends the sender's current transfer
+#define PARITY_FLAG 'P'
 
 
-typedef struct RUDPHeader{
-    char data[BUFFER_SIZE];
+// Header sent in front of the payload, connId, seq and length are in network byte order on the wire.
+// The sender picks a random connId for the connection, the receiver tells sessions apart by it.
+// An ACK's seq is the first packet the receiver is missing and its payload is the SACK
+// bitmap, bit i (byte i / 8, bit i % 8) set means packet seq + 1 + i arrived.
+// SYN and FIN take up one sequence number each. The SYN's payload is the RUDPOptions
+// the sender asks for, the ACK of the SYN carries the ones the receiver accepted.
+// A parity packet takes up no sequence number, its seq is the first data packet it covers.
+// End of a transfer is an END packet in the data sequence, never a payload the receiver parses.
+typedef struct __attribute__((packed)) RUDPHeader{
+    unsigned int connId; // connection the packet belongs to
+    unsigned int seq; // sequence number of the packet
     unsigned short length; // length of data
-    unsigned short checksum; // checksum of data
+    unsigned int checksum; // integrity check of data, RFC 1071 sum or CRC32C
     char flags;
 }RUDPHeader;
 
+// A checksum or CRC32C kernel the CPU can run, listed for ChecksumTest.c, one of the two functions is set
+typedef struct RUDPIntegrityKernel{
+    const char* name;
+    unsigned short int (*checksum)(void *data, unsigned int bytes);
+    unsigned int (*crc32c)(const void *data, unsigned int bytes);
+}RUDPIntegrityKernel;
+
+// Connection options negotiated by the SYN
+typedef struct __attribute__((packed)) RUDPOptions{
+    unsigned char integrity; // RUDP_INTEGRITY_CHECKSUM or RUDP_INTEGRITY_CRC32C
+    unsigned char congestion; // RUDP_CC_*
+    unsigned char fecData; // data packets per FEC block, 0 for no FEC
+    unsigned char fecParity; // parity packets per FEC block
+    unsigned char compression; // codec of the payload, COMPRESS_* of Compression.h, 0 for the file as it is
+    unsigned char delta; // 1 if the runs after the first carry the changed blocks only, as DeltaRecords
+}RUDPOptions;
+
+// Front of a parity packet's payload, the XOR of the packets it covers follows. Parity j of a
+// block covers its packets j, j + stride, j + 2 * stride ..., so up to stride packets in a row
+// that are lost from one block are rebuilt. The parity packet itself has no integrity check,
+// a packet rebuilt from a damaged one fails the check of the packet it stands for.
+typedef struct __attribute__((packed)) RUDPParity{
+    unsigned int checksum; // XOR of the wire integrity checks of the packets
+    unsigned short length; // XOR of their lengths, in network byte order
+    unsigned char count; // packets covered
+    unsigned char stride; // sequence numbers between them
+    unsigned char flags; // XOR of their flags, a rebuilt END packet stays one
+}RUDPParity;
+
+// A whole datagram, only sizeof(RUDPHeader) + length bytes of it are sent.
+// Data packets carry at most MESSAGE_SIZE bytes, a parity packet its RUDPParity in front of them.
+typedef struct RUDPPacket{
+    RUDPHeader header;
+    char data[sizeof(RUDPParity) + MESSAGE_SIZE];
+}RUDPPacket;
+
+// Sender side state of a packet in the window
+typedef struct RUDPSendSlot{
+    char acked;         // 1 once the receiver acknowledged the packet
+    char retransmitted; // 1 if the packet was sent more than once, its ACK is no RTT sample (Karn)
+    long long sentAt;   // time of the last transmission in microseconds
+    long long delivered;    // packets delivered when it was sent, for delivery rate samples
+    long long deliveredAt;  // time the last of those was acknowledged
+    unsigned int checksum;  // wire integrity check of the packet, for the parity of its block
+    char flags;             // DATA_FLAG or END_FLAG
+    char closesBlock;       // 1 if the parity of its FEC block went out after it
+    unsigned short length;  // payload bytes, kept until the packet is acknowledged
+    char data[MESSAGE_SIZE];
+}RUDPSendSlot;
+
+// Receiver side state of a packet that arrived out of order. With FEC the in-order
+// packets are kept here as well, until no parity packet can need them.
+typedef struct RUDPRecvSlot{
+    char present;       // 1 if the packet is buffered and not delivered yet
+    char held;          // 1 if data holds packet seq, delivered or not
+    unsigned int seq;
+    unsigned int checksum;  // wire integrity check
+    unsigned short length;
+    char flags;         // DATA_FLAG or END_FLAG
+    char data[MESSAGE_SIZE];
+}RUDPRecvSlot;
+
+// What an ACK told the congestion controller
+typedef struct RUDPAckSample{
+    long long now;              // time of the ACK in microseconds
+    int acked;                  // packets newly acknowledged
+    int inflight;               // packets still unacknowledged after the ACK
+    long long rtt;              // round trip sample in microseconds, 0 if none (Karn)
+    long long srtt;             // smoothed round trip time in microseconds
+    long long delivered;        // packets delivered so far
+    long long priorDelivered;   // packets delivered when the newest acknowledged packet was sent
+    double deliveryRate;        // packets per second over that interval, 0 if none
+}RUDPAckSample;
+
+struct RUDPCongestionOps;
+
+// Congestion controller state, the fields after ssthresh belong to BBR
+typedef struct RUDPCongestion{
+    const struct RUDPCongestionOps* ops;
+    double cwnd;                // packets allowed in flight
+    double maxCwnd;             // the connection's window, cwnd never grows past it
+    double pacingRate;          // bytes per second the controller would send at, 0 if unknown
+    double ssthresh;            // AIMD: slow start threshold in packets
+    int inRecovery;             // AIMD: 1 until the packets sent before the last reduction are acknowledged
+    unsigned int recoveryEnd;   // AIMD: first packet sent after the last reduction
+    int mode;                   // BBR: startup, drain, probe bandwidth or probe RTT
+    double pacingGain;
+    double cwndGain;
+    double bandwidth;           // BBR: bottleneck bandwidth in packets per second, max of bandwidthRounds
+    double bandwidthRounds[10]; // BBR: max delivery rate of each of the last 10 rounds
+    long long minRtt;           // BBR: min RTT in microseconds, 0 before the first sample
+    long long minRttAt;         // BBR: time minRtt was measured
+    long long round;            // BBR: round trips so far
+    long long nextRoundDelivered;
+    double fullBandwidth;       // BBR: bandwidth at the last 25% growth in startup
+    int fullBandwidthRounds;    // BBR: rounds since then
+    int cycleIndex;             // BBR: phase of the probe bandwidth gain cycle
+    long long cycleAt;          // BBR: start of the phase
+    long long probeRttDone;     // BBR: end of the probe RTT phase, 0 while not probing
+}RUDPCongestion;
+
+// A congestion control algorithm
+typedef struct RUDPCongestionOps{
+    const char* name;
+    void (*init)(RUDPCongestion* cc, long long now);
+    void (*onAck)(RUDPCongestion* cc, const RUDPAckSample* sample);
+    void (*onLoss)(RUDPCongestion* cc, unsigned int lostSeq, unsigned int nextSeq);  // lost by fast retransmit
+    void (*onTimeout)(RUDPCongestion* cc);                                           // retransmission timer expired
+}RUDPCongestionOps;
+
+// Data packets waiting for one sendmmsg() call, the payloads point into the caller's buffer
+typedef struct RUDPSendBatch{
+    RUDPHeader headers[RUDP_MAX_BATCH];
+    struct iovec iov[RUDP_MAX_BATCH][2];
+    struct mmsghdr messages[RUDP_MAX_BATCH];
+    int count;
+    // with GSO, every run of equal sized datagrams to one address (the last may be shorter) as one message
+    struct mmsghdr superMessages[RUDP_MAX_BATCH];
+    char control[RUDP_MAX_BATCH][CMSG_SPACE(sizeof(unsigned long long)) + CMSG_SPACE(sizeof(unsigned short))];
+    int superCounts[RUDP_MAX_BATCH];    // datagrams in each of them
+    // with SO_TXTIME, the departure time of every datagram
+    char txtimeControl[RUDP_MAX_BATCH][CMSG_SPACE(sizeof(unsigned long long))];
+}RUDPSendBatch;
+
+// Datagrams read by one recvmmsg() call, handed out one at a time
+typedef struct RUDPRecvBatch{
+    RUDPPacket packets[RUDP_MAX_BATCH];
+    struct sockaddr_in addresses[RUDP_MAX_BATCH];
+    struct iovec iov[RUDP_MAX_BATCH];
+    struct mmsghdr messages[RUDP_MAX_BATCH];
+    int count;  // datagrams in the batch, with GRO buffers of datagrams
+    int next;   // next datagram to hand out, with GRO the buffer it is in
+    // with GRO, batchSize buffers of RUDP_GRO_BUFFER_SIZE bytes take the place of packets
+    char* superBuffers;
+    char control[RUDP_MAX_BATCH][CMSG_SPACE(sizeof(int))];
+    int segmentSizes[RUDP_MAX_BATCH];   // size of the datagrams in each buffer, all but the last one
+    int offset;                         // next datagram's place in buffer next
+}RUDPRecvBatch;
+
+typedef struct RUDPConnection{
+    int socket;
+    struct sockaddr_in peer;    // address of the other side
+    unsigned int connId;        // connection ID in every header, 0 until the sender picks one
+    long long lastActive;       // receiver session: arrival time of its last packet in microseconds
+    int sessionIndex;           // receiver session: position in the server's session list
+    void* context;              // receiver session: the application's state of the transfer
+    int windowSize;             // max number of unacknowledged packets in flight
+    unsigned int nextSeq;       // sequence number of the next packet to send
+    unsigned int sendBase;      // sender: oldest packet that wasn't acknowledged, the window stays open between rudp_send() calls
+    unsigned int blockStart;    // sender: first packet of the FEC block that is being filled
+    unsigned int expectedSeq;   // sequence number of the next in-order packet to receive
+    long long srtt;             // smoothed round trip time in microseconds, 0 before the first sample
+    long long rttvar;           // round trip time variation in microseconds
+    long long rto;              // current retransmission timeout in microseconds
+    Histogram* rttHistogram;    // sender: every round trip sample is counted here too, NULL for none
+    long long socketTimeout;    // receive timeout that is set on the socket in microseconds
+    int ackEvery;               // receiver: send an ACK at least every ackEvery in-order packets
+    int unackedPackets;         // receiver: in-order packets that arrived since the last ACK
+    long long firstUnackedAt;   // receiver: arrival time of the oldest of them in microseconds
+    int batchSize;              // most datagrams per sendmmsg()/recvmmsg() call, 1..RUDP_MAX_BATCH
+    RUDPSendBatch* sendBatch;
+    RUDPRecvBatch* recvBatch;
+    long long packetsSent;      // datagrams sent, and the system calls that sent them
+    long long sendCalls;
+    long long retransmits;      // sender: data packets sent again, after a timeout or a loss
+    long long packetsReceived;  // datagrams received, and the system calls that received them
+    long long receiveCalls;
+    int gso;                    // sender: 1 if runs of queued datagrams go to the kernel as one buffer (UDP_SEGMENT)
+    int gro;                    // 1 if the socket hands over coalesced datagrams (UDP_GRO)
+    int pacer;                  // sender: RUDP_PACER_* that spaces the datagrams out
+    double pacingCap;           // sender: most bytes per second, 0 to follow the congestion controller alone
+    double pacingNext;          // sender: departure time of the next datagram in microseconds
+    double pacingApplied;       // sender: rate last set with SO_MAX_PACING_RATE
+    long long pacingUpdates;    // sender: SO_MAX_PACING_RATE changes
+    long long pacingWaits;      // sender: times the token bucket held a datagram back, and the microseconds it did
+    long long pacingWaitTime;
+    int integrity;              // integrity mode of the data packets, the sender's proposal until the SYN is acknowledged
+    long long integrityTime;    // nanoseconds spent computing the timed integrity checks, and the bytes they covered
+    long long integrityBytes;
+    long long integrityChecks;  // integrity checks computed, every RUDP_INTEGRITY_SAMPLE-th one is timed
+    int congestion;             // RUDP_CC_* of the sender, its proposal until the SYN is acknowledged
+    RUDPCongestion cc;
+    int fecData;                // data and parity packets per FEC block, the sender's proposal until the SYN
+    int fecParity;              // is acknowledged, 0 data packets for no FEC
+    int compression;            // codec of the payload, the sender's proposal until the SYN is acknowledged,
+                                // a receiver takes it only if it is the one it was set up with
+    int delta;                  // 1 if the runs after the first carry the changed blocks only, the sender's proposal
+                                // until the SYN is acknowledged
+    char* parityBuffers;        // sender: RUDP_MAX_BATCH parity payloads, one per place in the send batch
+    long long paritySent;       // sender: parity packets sent
+    long long fecRecovered;     // receiver: lost data packets rebuilt from parity
+    int inflight;               // sender: packets sent and not acknowledged yet
+    long long delivered;        // sender: packets acknowledged so far
+    long long deliveredAt;      // sender: time the last of them was acknowledged
+    RUDPSendSlot* sendWindow;   // RUDP_MAX_WINDOW slots, indexed by seq % RUDP_MAX_WINDOW
+    RUDPRecvSlot* recvWindow;   // RUDP_MAX_WINDOW slots, indexed by seq % RUDP_MAX_WINDOW
+}RUDPConnection;
+
+// Receiver socket shared by many sessions. Datagrams are read by the listener and
+// handed to the session of their sender address and connection ID.
+typedef struct RUDPServer{
+    RUDPConnection listener;    // owns the socket's receive batch and the receive counters
+    int ackEvery;               // settings of new sessions, like the fields of RUDPConnection
+    int congestion;
+    int compression;
+    RUDPConnection** buckets;   // RUDP_SESSION_BUCKETS slots, open addressing with linear probing
+    RUDPConnection** sessions;  // the live sessions packed in front, for ACK flushing and expiry
+    int sessionCount;
+    RUDPConnection* ready;      // session of the last data packet, its window may hold in-order packets
+    int ackPending;             // 1 if a session may hold back an ACK
+    long long lastExpiry;       // last time idle sessions were looked for
+}RUDPServer;
+
+
+// Connection Functions
+
+int rudp_init(RUDPConnection* conn, int socket, struct sockaddr_in* peer, int windowSize, int batchSize, int sides);
+
+void rudp_free(RUDPConnection* conn);
+
+int rudp_enableGSO(RUDPConnection* conn);
+
+int rudp_enableGRO(RUDPConnection* conn);
+
+int rudp_enablePacing(RUDPConnection* conn, int pacer, double cap);
 
 // Sender Functions
 
-int rudp_receiveACK(int socket,struct sockaddr_in* srcAddress);
+int rudp_receiveACK(RUDPConnection* conn, unsigned int* ackSeq, unsigned char* sack);
+
+int rudp_connect(RUDPConnection* conn);
 
-int rudp_connect(int socket,struct sockaddr_in* destAddress,struct sockaddr_in* srcAddress);
+int rudp_disconnect(RUDPConnection* conn);
 
-int rudp_disconnect(int socket,struct sockaddr_in* destAddress,struct sockaddr_in* srcAddress);
+int rudp_send(RUDPConnection* conn, const char* data, int length);
 
-int rudp_sendDataPacket(int socket,char* data,struct sockaddr_in* destAddress,struct sockaddr_in* srcAddress);
+int rudp_sendEnd(RUDPConnection* conn);
 
 // Receiver Functions
 
-int rudp_sendACK(int socket,struct sockaddr_in* destAddress);
+int rudp_sendACK(RUDPConnection* conn, struct sockaddr_in* destAddress);
+
+int rudp_receive(RUDPConnection* conn, char* data);
+
+int rudp_handlePacket(RUDPConnection* conn, RUDPPacket* buffer, int recvData, struct sockaddr_in* senderAddress, char* data);
+
+int rudp_deliverWindow(RUDPConnection* conn, char* data);
+
+// Session Functions
+
+int rudp_serverInit(RUDPServer* server, int socket, int batchSize, int ackEvery, int congestion, int compression);
+
+void rudp_serverFree(RUDPServer* server);
+
+int rudp_serverReceive(RUDPServer* server, RUDPConnection** session, char* data);
+
+void rudp_serverClose(RUDPServer* server, RUDPConnection* session);
+
+// Congestion Control Functions
 
-int rudp_receive(int socket,struct sockaddr_in* senderAddress);
+int rudp_ccParse(const char* name);
+
+const char* rudp_ccName(int algorithm);
+
+// Pacing Functions
+
+int rudp_pacerParse(const char* name);
+
+const char* rudp_pacerName(int pacer);
+
+double rudp_pacingRate(RUDPConnection* conn);
+
+void rudp_ccInit(RUDPCongestion* cc, int algorithm, int maxWindow, long long now);
 
 // Other Functions
 
-unsigned short int calculate_checksum(void *data, unsigned int bytes);
\ No newline at end of file
+long long rudp_now();
+
+int rudp_recvPacket(RUDPConnection* conn, RUDPPacket** packet, struct sockaddr_in* srcAddress, int flags);
+
+unsigned short int calculate_checksum(void *data, unsigned int bytes);
+
+unsigned short int calculate_checksum_scalar(void *data, unsigned int bytes);
+
+const char* rudp_checksumImplementation(void);
+
+unsigned int calculate_crc32c(const void *data, unsigned int bytes);
+
+const char* rudp_crc32cImplementation(void);
+
+int rudp_integrityKernels(RUDPIntegrityKernel* kernels, int capacity);
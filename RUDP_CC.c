@@ -0,0 +1,245 @@
+#include "RUDP.h"
+
+////********************** AIMD ***********************
+
+/**
+ * Reno-like: slow start up to ssthresh, then one packet per window per round trip.
+ * A loss halves the window once per window of data, a timeout restarts from one packet.
+ */
+static void aimd_init(RUDPCongestion* cc, long long now){
+    cc->cwnd = 10;
+    cc->ssthresh = cc->maxCwnd;
+}
+
+static void aimd_onAck(RUDPCongestion* cc, const RUDPAckSample* sample){
+    if (cc->cwnd < cc->ssthresh) {
+        cc->cwnd += sample->acked;
+    } else {
+        cc->cwnd += sample->acked / cc->cwnd;
+    }
+    if (cc->cwnd > cc->maxCwnd) {
+        cc->cwnd = cc->maxCwnd;
+    }
+    // ahead of the window like Linux, twice it in slow start, so pacing doesn't hold back its growth
+    if (sample->srtt > 0) {
+        cc->pacingRate = (cc->cwnd < cc->ssthresh ? 2 : 1.2) * cc->cwnd * MESSAGE_SIZE * 1000000.0 / sample->srtt;
+    }
+}
+
+static void aimd_onLoss(RUDPCongestion* cc, unsigned int lostSeq, unsigned int nextSeq){
+    // losses of packets sent before the last reduction belong to the same event
+    if (cc->inRecovery && (int) (lostSeq - cc->recoveryEnd) < 0) {
+        return;
+    }
+    cc->ssthresh = cc->cwnd / 2 > 2 ? cc->cwnd / 2 : 2;
+    cc->cwnd = cc->ssthresh;
+    cc->inRecovery = 1;
+    cc->recoveryEnd = nextSeq;
+}
+
+static void aimd_onTimeout(RUDPCongestion* cc){
+    cc->ssthresh = cc->cwnd / 2 > 2 ? cc->cwnd / 2 : 2;
+    cc->cwnd = 1;
+    cc->inRecovery = 0;
+}
+
+
+////********************** BBR ***********************
+
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+#define BBR_PROBE_RTT 3
+
+#define BBR_HIGH_GAIN 2.885           // 2/ln(2), doubles the sending rate every round in startup
+#define BBR_MIN_CWND 4
+#define BBR_MIN_RTT_EXPIRY 10000000   // min RTT is measured again after 10 seconds
+#define BBR_PROBE_RTT_TIME 200000     // for 200 milliseconds with a window of BBR_MIN_CWND
+
+static const double bbrGainCycle[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+/**
+ * BBR-like: models the path by its bottleneck bandwidth (max delivery rate of the last
+ * 10 rounds) and min RTT, and keeps about one bandwidth-delay product in flight.
+ * Losses don't shrink the window, only the model does.
+ */
+static void bbr_init(RUDPCongestion* cc, long long now){
+    cc->cwnd = 10;
+    cc->mode = BBR_STARTUP;
+    cc->pacingGain = BBR_HIGH_GAIN;
+    cc->cwndGain = BBR_HIGH_GAIN;
+    cc->minRttAt = now;
+}
+
+/**
+ * bandwidth-delay product in packets
+ */
+static double bbr_bdp(RUDPCongestion* cc){
+    return cc->bandwidth * cc->minRtt / 1000000.0;
+}
+
+static void bbr_onAck(RUDPCongestion* cc, const RUDPAckSample* sample){
+    // a round ends when a packet sent after its start is acknowledged
+    int roundStart = 0;
+    if (sample->priorDelivered >= cc->nextRoundDelivered) {
+        cc->nextRoundDelivered = sample->delivered;
+        cc->round++;
+        roundStart = 1;
+        cc->bandwidthRounds[cc->round % 10] = 0;
+    }
+
+    // max filter of the delivery rate over the last 10 rounds
+    double* current = &cc->bandwidthRounds[cc->round % 10];
+    if (sample->deliveryRate > *current) {
+        *current = sample->deliveryRate;
+    }
+    cc->bandwidth = 0;
+    for (int i = 0; i < 10; i++) {
+        if (cc->bandwidthRounds[i] > cc->bandwidth) {
+            cc->bandwidth = cc->bandwidthRounds[i];
+        }
+    }
+
+    // min RTT, an old one is measured again by draining the pipe for a moment
+    int minRttExpired = sample->now - cc->minRttAt > BBR_MIN_RTT_EXPIRY;
+    if (sample->rtt > 0 && (cc->minRtt == 0 || sample->rtt <= cc->minRtt || minRttExpired)) {
+        cc->minRtt = sample->rtt;
+        cc->minRttAt = sample->now;
+    }
+    if (minRttExpired && cc->mode != BBR_PROBE_RTT) {
+        cc->mode = BBR_PROBE_RTT;
+        cc->pacingGain = 1;
+        cc->probeRttDone = sample->now + BBR_PROBE_RTT_TIME;
+    }
+
+    switch (cc->mode) {
+        // leave startup once the bandwidth didn't grow by 25% for 3 rounds
+        case BBR_STARTUP:
+            if (roundStart && cc->bandwidth > 0) {
+                if (cc->bandwidth >= cc->fullBandwidth * 1.25) {
+                    cc->fullBandwidth = cc->bandwidth;
+                    cc->fullBandwidthRounds = 0;
+                } else if (++cc->fullBandwidthRounds >= 3) {
+                    cc->mode = BBR_DRAIN;
+                    cc->pacingGain = 1 / BBR_HIGH_GAIN;
+                }
+            }
+            break;
+
+        // drain the queue startup built, then cycle around the bandwidth
+        case BBR_DRAIN:
+            if (sample->inflight <= bbr_bdp(cc)) {
+                cc->mode = BBR_PROBE_BW;
+                cc->cwndGain = 2;
+                cc->cycleIndex = 2;
+                cc->cycleAt = sample->now;
+                cc->pacingGain = bbrGainCycle[cc->cycleIndex];
+            }
+            break;
+
+        // one gain phase per min RTT
+        case BBR_PROBE_BW:
+            if (sample->now - cc->cycleAt > cc->minRtt) {
+                cc->cycleIndex = (cc->cycleIndex + 1) % 8;
+                cc->cycleAt = sample->now;
+                cc->pacingGain = bbrGainCycle[cc->cycleIndex];
+            }
+            break;
+
+        case BBR_PROBE_RTT:
+            if (sample->now >= cc->probeRttDone) {
+                cc->mode = BBR_PROBE_BW;
+                cc->cycleAt = sample->now;
+                cc->pacingGain = bbrGainCycle[cc->cycleIndex];
+            }
+            break;
+    }
+
+    // grow with the ACKs until the model knows the bandwidth-delay product, then follow it
+    double target = cc->cwndGain * bbr_bdp(cc);
+    if (cc->mode == BBR_PROBE_RTT) {
+        cc->cwnd = BBR_MIN_CWND;
+    } else if (cc->mode == BBR_STARTUP || cc->cwnd + sample->acked < target) {
+        cc->cwnd += sample->acked;
+    } else {
+        cc->cwnd = target;
+    }
+    if (cc->cwnd < BBR_MIN_CWND) {
+        cc->cwnd = BBR_MIN_CWND;
+    }
+    if (cc->cwnd > cc->maxCwnd) {
+        cc->cwnd = cc->maxCwnd;
+    }
+    cc->pacingRate = cc->pacingGain * cc->bandwidth * MESSAGE_SIZE;
+}
+
+static void bbr_onLoss(RUDPCongestion* cc, unsigned int lostSeq, unsigned int nextSeq){
+}
+
+static void bbr_onTimeout(RUDPCongestion* cc){
+    cc->cwnd = BBR_MIN_CWND;
+}
+
+
+////********************** NONE ***********************
+
+static void none_init(RUDPCongestion* cc, long long now){
+    cc->cwnd = cc->maxCwnd;
+}
+
+static void none_onAck(RUDPCongestion* cc, const RUDPAckSample* sample){
+}
+
+static void none_onLoss(RUDPCongestion* cc, unsigned int lostSeq, unsigned int nextSeq){
+}
+
+static void none_onTimeout(RUDPCongestion* cc){
+}
+
+
+// indexed by RUDP_CC_*
+static const RUDPCongestionOps congestionAlgorithms[RUDP_CC_COUNT] = {
+    {"aimd", aimd_init, aimd_onAck, aimd_onLoss, aimd_onTimeout},
+    {"bbr", bbr_init, bbr_onAck, bbr_onLoss, bbr_onTimeout},
+    {"none", none_init, none_onAck, none_onLoss, none_onTimeout},
+};
+
+/**
+ * find an algorithm by name, "reno" is an alias of aimd
+ * @return RUDP_CC_*, -1 if unknown
+ */
+int rudp_ccParse(const char* name){
+    if (strcmp(name, "reno") == 0) {
+        return RUDP_CC_AIMD;
+    }
+    for (int i = 0; i < RUDP_CC_COUNT; i++) {
+        if (strcmp(name, congestionAlgorithms[i].name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+const char* rudp_ccName(int algorithm){
+    if (algorithm < 0 || algorithm >= RUDP_CC_COUNT) {
+        return "unknown";
+    }
+    return congestionAlgorithms[algorithm].name;
+}
+
+/**
+ * reset the controller to the start state of the algorithm, unknown ones fall back to AIMD
+ * @param maxWindow the connection's window, the controller never allows more in flight
+ */
+void rudp_ccInit(RUDPCongestion* cc, int algorithm, int maxWindow, long long now){
+    if (algorithm < 0 || algorithm >= RUDP_CC_COUNT) {
+        algorithm = RUDP_CC_AIMD;
+    }
+    memset(cc, 0, sizeof(RUDPCongestion));
+    cc->ops = &congestionAlgorithms[algorithm];
+    cc->maxCwnd = maxWindow;
+    cc->ops->init(cc, now);
+    if (cc->cwnd > cc->maxCwnd) {
+        cc->cwnd = cc->maxCwnd;
+    }
+}
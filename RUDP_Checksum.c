@@ -0,0 +1,264 @@
+#include "RUDP.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RUDP_X86 1
+#endif
+
+// 32 bit lanes take 2 words of at most 0xFFFF per step, spill them to 64 bits long before they can wrap
+#define CHECKSUM_SPILL_STEPS 16384
+
+/* 
+*   A checksum function that returns 16 bit checksum for data.
+*   This function is taken from RFC1071, can be found here:
+*   https://tools.ietf.org/html/rfc1071
+*   It is the reference for the vectorized versions below.
+*/
+unsigned short int calculate_checksum_scalar(void *data, unsigned int bytes) {
+    unsigned short int *data_pointer = (unsigned short int *)data;
+    unsigned int total_sum = 0;
+// Main summing loop
+    while (bytes > 1) {
+        total_sum += *data_pointer++;
+        bytes -= 2;
+    }
+// Add left-over byte, if any
+    if (bytes > 0)
+        total_sum += *((unsigned char *)data_pointer);
+// Fold 32-bit sum to 16 bits
+    while (total_sum >> 16)
+        total_sum = (total_sum & 0xFFFF) + (total_sum >> 16);
+    return (~((unsigned short int)total_sum));
+}
+
+/*
+*   Finish a checksum the way calculate_checksum_scalar does. wideSum is the exact sum of the
+*   words before data, cutting it to 32 bits gives the same (wrapped) sum as the scalar loop.
+*/
+static unsigned short int checksum_finish(unsigned long long wideSum, const unsigned char *data, unsigned int bytes) {
+    const unsigned short int *data_pointer = (const unsigned short int *)data;
+    while (bytes > 1) {
+        wideSum += *data_pointer++;
+        bytes -= 2;
+    }
+    unsigned int total_sum = (unsigned int) wideSum;
+    if (bytes > 0)
+        total_sum += *((const unsigned char *)data_pointer);
+    while (total_sum >> 16)
+        total_sum = (total_sum & 0xFFFF) + (total_sum >> 16);
+    return (~((unsigned short int)total_sum));
+}
+
+#ifdef RUDP_X86
+
+/*
+*   SSE2: widen 8 words per 16 bytes to 32 bit lanes and add them up.
+*/
+static unsigned short int calculate_checksum_sse2(void *data, unsigned int bytes) {
+    const unsigned char *pointer = (const unsigned char *)data;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i wide = zero;
+
+    while (bytes >= 16) {
+        __m128i lanes = zero;
+        for (int step = 0; step < CHECKSUM_SPILL_STEPS && bytes >= 16; step++) {
+            __m128i words = _mm_loadu_si128((const __m128i *)pointer);
+            lanes = _mm_add_epi32(lanes, _mm_unpacklo_epi16(words, zero));
+            lanes = _mm_add_epi32(lanes, _mm_unpackhi_epi16(words, zero));
+            pointer += 16;
+            bytes -= 16;
+        }
+        wide = _mm_add_epi64(wide, _mm_unpacklo_epi32(lanes, zero));
+        wide = _mm_add_epi64(wide, _mm_unpackhi_epi32(lanes, zero));
+    }
+
+    unsigned long long parts[2];
+    _mm_storeu_si128((__m128i *)parts, wide);
+    return checksum_finish(parts[0] + parts[1], pointer, bytes);
+}
+
+/*
+*   AVX2: the same with 16 words per 32 bytes.
+*/
+__attribute__((target("avx2")))
+static unsigned short int calculate_checksum_avx2(void *data, unsigned int bytes) {
+    const unsigned char *pointer = (const unsigned char *)data;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i wide = zero;
+
+    while (bytes >= 32) {
+        __m256i lanes = zero;
+        for (int step = 0; step < CHECKSUM_SPILL_STEPS && bytes >= 32; step++) {
+            __m256i words = _mm256_loadu_si256((const __m256i *)pointer);
+            lanes = _mm256_add_epi32(lanes, _mm256_unpacklo_epi16(words, zero));
+            lanes = _mm256_add_epi32(lanes, _mm256_unpackhi_epi16(words, zero));
+            pointer += 32;
+            bytes -= 32;
+        }
+        wide = _mm256_add_epi64(wide, _mm256_unpacklo_epi32(lanes, zero));
+        wide = _mm256_add_epi64(wide, _mm256_unpackhi_epi32(lanes, zero));
+    }
+
+    unsigned long long parts[4];
+    _mm256_storeu_si256((__m256i *)parts, wide);
+    return checksum_finish(parts[0] + parts[1] + parts[2] + parts[3], pointer, bytes);
+}
+
+#endif
+
+/*
+*   CRC32C (Castagnoli, reflected polynomial 0x82F63B78), table driven, 8 bytes per step.
+*   crc32c_table is filled by checksum_select().
+*/
+static unsigned int crc32c_table[8][256];
+
+static unsigned int calculate_crc32c_table(const void *data, unsigned int bytes) {
+    const unsigned char *pointer = (const unsigned char *)data;
+    unsigned int crc = 0xFFFFFFFF;
+
+    while (bytes >= 8) {
+        unsigned int low, high;
+        memcpy(&low, pointer, 4);
+        memcpy(&high, pointer + 4, 4);
+        low ^= crc;
+        crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF] ^
+              crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24] ^
+              crc32c_table[3][high & 0xFF] ^ crc32c_table[2][(high >> 8) & 0xFF] ^
+              crc32c_table[1][(high >> 16) & 0xFF] ^ crc32c_table[0][high >> 24];
+        pointer += 8;
+        bytes -= 8;
+    }
+    while (bytes > 0) {
+        crc = crc32c_table[0][(crc ^ *pointer++) & 0xFF] ^ (crc >> 8);
+        bytes--;
+    }
+    return ~crc;
+}
+
+static void crc32c_fillTable(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++)
+        for (int slice = 1; slice < 8; slice++)
+            crc32c_table[slice][i] = crc32c_table[0][crc32c_table[slice - 1][i] & 0xFF] ^ (crc32c_table[slice - 1][i] >> 8);
+}
+
+#ifdef RUDP_X86
+
+/*
+*   CRC32C with the SSE4.2 crc32 instruction, same result as the table version.
+*/
+__attribute__((target("sse4.2")))
+static unsigned int calculate_crc32c_sse42(const void *data, unsigned int bytes) {
+    const unsigned char *pointer = (const unsigned char *)data;
+#ifdef __x86_64__
+    unsigned long long crc = 0xFFFFFFFF;
+    while (bytes >= 8) {
+        unsigned long long word;
+        memcpy(&word, pointer, 8);
+        crc = _mm_crc32_u64(crc, word);
+        pointer += 8;
+        bytes -= 8;
+    }
+#else
+    unsigned int crc = 0xFFFFFFFF;
+#endif
+    unsigned int crc32 = (unsigned int) crc;
+    while (bytes > 0) {
+        crc32 = _mm_crc32_u8(crc32, *pointer++);
+        bytes--;
+    }
+    return ~crc32;
+}
+
+#endif
+
+// kernels picked by checksum_select() before main() runs
+static unsigned short int (*checksum_kernel)(void *data, unsigned int bytes) = calculate_checksum_scalar;
+static const char *checksum_name = "scalar";
+static unsigned int (*crc32c_kernel)(const void *data, unsigned int bytes) = calculate_crc32c_table;
+static const char *crc32c_name = "table";
+
+/*
+*   Pick the widest kernels the CPU supports (CPUID), once at startup.
+*/
+__attribute__((constructor))
+static void checksum_select(void) {
+    crc32c_fillTable();
+#ifdef RUDP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        checksum_kernel = calculate_checksum_avx2;
+        checksum_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        checksum_kernel = calculate_checksum_sse2;
+        checksum_name = "sse2";
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_kernel = calculate_crc32c_sse42;
+        crc32c_name = "sse4.2";
+    }
+#endif
+}
+
+/*
+*   RFC 1071 checksum of data, same result as calculate_checksum_scalar
+*/
+unsigned short int calculate_checksum(void *data, unsigned int bytes) {
+    return checksum_kernel(data, bytes);
+}
+
+/*
+*   name of the checksum kernel in use
+*/
+const char* rudp_checksumImplementation(void) {
+    return checksum_name;
+}
+
+
+/*
+*   CRC32C of data (0xE3069283 for "123456789")
+*/
+unsigned int calculate_crc32c(const void *data, unsigned int bytes) {
+    return crc32c_kernel(data, bytes);
+}
+
+/*
+*   name of the CRC32C kernel in use
+*/
+const char* rudp_crc32cImplementation(void) {
+    return crc32c_name;
+}
+
+/*
+*   every checksum and CRC32C kernel this CPU can run, the scalar and table ones first
+*   @return the number of kernels put into kernels, at most capacity
+*/
+int rudp_integrityKernels(RUDPIntegrityKernel* kernels, int capacity) {
+    RUDPIntegrityKernel all[5];
+    int count = 0;
+    all[count++] = (RUDPIntegrityKernel) {"checksum scalar", calculate_checksum_scalar, NULL};
+#ifdef RUDP_X86
+    if (__builtin_cpu_supports("sse2")) {
+        all[count++] = (RUDPIntegrityKernel) {"checksum sse2", calculate_checksum_sse2, NULL};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        all[count++] = (RUDPIntegrityKernel) {"checksum avx2", calculate_checksum_avx2, NULL};
+    }
+#endif
+    all[count++] = (RUDPIntegrityKernel) {"crc32c table", NULL, calculate_crc32c_table};
+#ifdef RUDP_X86
+    if (__builtin_cpu_supports("sse4.2")) {
+        all[count++] = (RUDPIntegrityKernel) {"crc32c sse4.2", NULL, calculate_crc32c_sse42};
+    }
+#endif
+    if (count > capacity) {
+        count = capacity;
+    }
+    memcpy(kernels, all, count * sizeof(RUDPIntegrityKernel));
+    return count;
+}
@@ -1,36 +1,112 @@
 #include "RUDP.h"
+#include "RunReport.h"
+#include "Compression.h"
+#include "Delta.h"
 #include <stdio.h>
-
-#define MAX_RUNS 50
-
+#include <math.h>
+#include <endian.h>
+#include <sys/resource.h>
 
 
 // Structure to store statistics for each run
 struct RunStatistics {
     double time;    // Time taken for the run in milliseconds
     double speed;   // Data transfer speed in MB/s
+    double cpu;     // CPU time (user + system) spent per GB in milliseconds, shared by the sessions running at the time
+};
+
+// State of the transfer of one sender, kept in its session's context
+struct Transfer {
+    int id;                     // order in which the senders connected
+    long long totalReceived;    // bytes of the file in the current run, after decompression, only the changed blocks in delta runs
+    uint64_t start;             // monotonic clock in nanoseconds
+    uint64_t lastArrival;       // of the run's last data packet, 0 before the first
+    double cpuStart;
+    int measureTime;            // 1 while runs are received, 0 after the exit message
+    int waitingForChoice;       // 1 between the EOF of a run and the sender's choice
+    struct RunStatistics* runStatistics;    // grows with the runs
+    int numRuns;
+    int runCapacity;
+    Histogram arrivals;         // time between data packets of all runs in nanoseconds
+    CompressDecoder decoder;    // with compression, for the frames that span the packets
+    char* frame;                // the frame coming in, its header and its wire bytes
+    char* raw;                  // the file bytes of the last frame
+    size_t frameFill;           // bytes of the frame so far
+    DeltaRecord record;         // in delta runs, the record coming in
+    size_t recordFill;          // bytes of its header so far
+    uint64_t recordLeft;        // bytes of its block still to come
+    DeltaTable delta;           // counts of the delta runs, there are no hashes on this side
 };
 
-void printStatistics(struct RunStatistics* statistics, int numRuns);
-void calcTime(int fileSize, struct timeval start, struct RunStatistics* runStatistics, int numRuns);
+// Function to print a finished transfer and release its state
+void closeTransfer(RUDPServer* server, RUDPConnection* session, const char* reason);
+
+// Function to take the frames of compressed payload apart, returns the file bytes restored or -1 for a damaged frame
+long long receiveFrames(struct Transfer* transfer, const char* payload, int length);
+
+// Function to take the records of a delta run apart, returns the bytes of changed blocks in the payload or -1 for a damaged record
+long long receiveRecords(struct Transfer* transfer, const char* payload, int length);
+
+// Function to print the mean, spread and tail of the runs
+void printStatistics(struct RunStatistics* statistics, int numRuns, const Histogram* arrivals);
+
+// Function to calculate time and speed for a run
+void calcTime(long long fileSize, uint64_t start, double cpuStart, struct RunStatistics* runStatistics, int numRuns);
+
+// Function to get the CPU time (user + system) the process used so far in milliseconds
+double cpuTime();
 
 int main(int argc,char** argv) {
 
    // Check command line arguments
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s -p <port> -algo <algorithm>\n", argv[0]);
+    if (argc < 3 || argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s -p <port> [-algo aimd|bbr|none] [-ack <packets per ACK>] [-b <batch>] [-sessions <count, 0 for no limit>] [-compress deflate|off] [-gro on|off] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    // time statistics variables
-    struct RunStatistics runStatistics[MAX_RUNS];
-    int numRuns = 0;
-    struct timeval start;
-
     // Parse command line arguments
-    int port = atoi(argv[2]);
+    int port = 0;
+    int ackEvery = RUDP_ACK_EVERY;
+    int batchSize = RUDP_DEFAULT_BATCH;
+    int algorithm = -1;
+    int sessionLimit = 1;
+    int codec = COMPRESS_DEFLATE;
+    int gro = 0;
+    char *csvName = NULL;
+    char *statsName = NULL;
+    int statsInterval = COUNTERS_DEFAULT_INTERVAL;
+    for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "-p") == 0) {
+            port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-ack") == 0) {
+            ackEvery = atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : 1;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            batchSize = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-algo") == 0 && rudp_ccParse(argv[i + 1]) >= 0) {
+            algorithm = rudp_ccParse(argv[i + 1]);
+        } else if (strcmp(argv[i], "-sessions") == 0) {
+            sessionLimit = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-compress") == 0 && compress_parse(argv[i + 1]) >= 0) {
+            codec = compress_parse(argv[i + 1]);
+        } else if (strcmp(argv[i], "-gro") == 0 && (strcmp(argv[i + 1], "on") == 0 || strcmp(argv[i + 1], "off") == 0)) {
+            gro = strcmp(argv[i + 1], "on") == 0;
+        } else if (strcmp(argv[i], "-csv") == 0) {
+            csvName = argv[i + 1];
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            statsName = argv[i + 1];
+        } else if (strcmp(argv[i], "-stats-ms") == 0) {
+            statsInterval = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Usage: %s -p <port> [-algo aimd|bbr|none] [-ack <packets per ACK>] [-b <batch>] [-sessions <count, 0 for no limit>] [-compress deflate|off] [-gro on|off] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Live counters, on SIGUSR1 and in the stats file
+    if (counters_start(statsName, statsInterval) == -1) {
+        exit(EXIT_FAILURE);
+    }
 
-    
     // Create a UDP connection between the Receiver and the Sender.
     int receiver_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (receiver_socket == -1) {
@@ -48,10 +124,7 @@ int main(int argc,char** argv) {
         return -1;
     }
 
-    struct sockaddr_in senderAddress;
-    memset((char *)&senderAddress, 0, sizeof(senderAddress));
-
-    printf("Starting Receiver...\n");
+    printf("Starting Receiver (checksum: %s, crc32c: %s)...\n", rudp_checksumImplementation(), rudp_crc32cImplementation());
 
     int bindResult = bind(receiver_socket, (struct sockaddr *)&receiverAddress, sizeof(receiverAddress));
     if (bindResult == -1) {
@@ -59,97 +132,288 @@ int main(int argc,char** argv) {
         return -1;
     }
 
-    //Get a connection from the sender
+    // every sender gets its own session on this socket
+    RUDPServer server;
+    if (rudp_serverInit(&server, receiver_socket, batchSize, ackEvery, algorithm, codec) < 0) {
+        close(receiver_socket);
+        return -1;
+    }
+    if (gro && rudp_enableGRO(&server.listener) < 0) {
+        rudp_serverFree(&server);
+        close(receiver_socket);
+        return -1;
+    }
+
     printf("Waiting for RUDP Connection...\n");
-    int recvResult = rudp_receive(receiver_socket, &senderAddress);
-    if(recvResult<=0){return -1;}
-    printf("Sender connected, beginning to receive file...\n");
-
-    // Receive the file.
-    int keepReceiving = 1;
-    int measureTime=1;
-    while(keepReceiving) {
-
-        // count the total of bytes received
-        int totalReceived = 0;
-
-        // start measriung time
-        gettimeofday(&start,NULL);
-        while (1) {
-            
-            int receiveResult = rudp_receive(receiver_socket, &senderAddress);
-
-            // add the received data to the total sent
-            if(receiveResult > 0){totalReceived+=receiveResult;}
-            
-            // if failed return -1,
-            if (receiveResult == -1) { return -1; }
-            
-
-            // if got exitMessage break
-            else if (receiveResult == 0) {
-                keepReceiving =0;
-                break; }
-
-            //if got EOF break
-            else if (receiveResult == -2) {
-                break; }
-        }
-        
-            if (measureTime) {
-                  // data sent. calc the time it took 
-            calcTime(totalReceived, start, runStatistics, numRuns);
-            numRuns++;
-
-            // Wait for Sender response:
-            printf("Waiting for Sender response...\n");
-            int receiveChoice = rudp_receive(receiver_socket,&senderAddress);
-
-            // if no respone, exit
-            if(receiveChoice == -1){return -1;}
-
-
-            // handle case where sender wants to exit
-            if(receiveChoice == 2) {
-                printf("Sender sent exit message...\n");
-                measureTime=0;
+    int connected = 0, finished = 0;
+    char packet[MESSAGE_SIZE];
+    while (sessionLimit <= 0 || finished < sessionLimit) {
+        RUDPConnection* session = NULL;
+        int receiveResult = rudp_serverReceive(&server, &session, packet);
+        struct Transfer* transfer = session != NULL ? session->context : NULL;
+
+        if (receiveResult == -1) {
+            return -1;
+        }
+        if (receiveResult == -3 || receiveResult == -4) {
+            continue;
+        }
+
+        // the sender went quiet, or it's gone, a session that never connected has no transfer to report
+        if (receiveResult == -5 || receiveResult == 0) {
+            if (transfer == NULL) {
+                rudp_serverClose(&server, session);
+                continue;
             }
-            // handle case where sender is sending again
-            else {
-                printf("Sender sending  again...\n");
-                totalReceived=0;
-                gettimeofday(&start, NULL);  // Reset start time for the new run
+            closeTransfer(&server, session, receiveResult == 0 ? "disconnected" : "timed out");
+            finished++;
+            continue;
+        }
+
+        // a new sender, start measuring its first run
+        if (transfer == NULL) {
+            if (receiveResult != 1) {
+                continue;
+            }
+            transfer = calloc(1, sizeof(struct Transfer));
+            if (transfer == NULL) {
+                printf("calloc() failed\n");
+                return -1;
             }
+            transfer->id = ++connected;
+            transfer->measureTime = 1;
+            transfer->cpuStart = cpuTime();
+            transfer->start = hist_now();
+            hist_init(&transfer->arrivals);
+            session->context = transfer;
+            if (session->compression != COMPRESS_NONE) {
+                transfer->frame = malloc(sizeof(CompressFrame) + 2 * COMPRESS_BLOCK_SIZE);
+                if (transfer->frame == NULL || compress_decoderInit(&transfer->decoder, session->compression) == -1) {
+                    printf("malloc() failed\n");
+                    return -1;
+                }
+                transfer->raw = transfer->frame + sizeof(CompressFrame) + COMPRESS_BLOCK_SIZE;
+            }
+            printf("Sender #%d connected (congestion control: %s, compression: %s), beginning to receive file...\n",
+                   transfer->id, rudp_ccName(session->congestion), compress_name(session->compression));
+            continue;
+        }
 
+
+        // the run is done, calc the time it took and wait for the sender's choice
+        if (receiveResult == -2 && transfer->measureTime) {
+            struct RunStatistics* runs = report_grow(transfer->runStatistics, transfer->numRuns, &transfer->runCapacity, sizeof(struct RunStatistics));
+            if (runs == NULL) {
+                return -1;
+            }
+            transfer->runStatistics = runs;
+            calcTime(transfer->totalReceived, transfer->start, transfer->cpuStart, runs, transfer->numRuns);
+            transfer->numRuns++;
+            if (csvName != NULL) {
+                RunReport report = {"rudp", "receiver", rudp_ccName(session->congestion), transfer->totalReceived, transfer->numRuns,
+                                    runs[transfer->numRuns - 1].time, runs[transfer->numRuns - 1].speed, runs[transfer->numRuns - 1].cpu, -1};
+                report_run(csvName, &report);
             }
+            transfer->waitingForChoice = 1;
+            continue;
+        }
+        if (receiveResult <= 0) {
+            continue;
+        }
 
+        // "no" ends the runs, "yes" starts the next one
+        if (transfer->waitingForChoice) {
+            transfer->waitingForChoice = 0;
+            if (receiveResult == 2) {
+                printf("Sender #%d sent exit message...\n", transfer->id);
+                transfer->measureTime = 0;
+            } else {
+                printf("Sender #%d sending again...\n", transfer->id);
+                transfer->totalReceived = 0;
+                transfer->lastArrival = 0;
+                transfer->frameFill = 0;
+                transfer->recordFill = 0;
+                transfer->recordLeft = 0;
+                transfer->cpuStart = cpuTime();
+                transfer->start = hist_now();
+            }
+            continue;
+        }
+        if (transfer->measureTime) {
+            uint64_t now = hist_now();
+            if (transfer->lastArrival) {
+                hist_record(&transfer->arrivals, now - transfer->lastArrival);
+            }
+            transfer->lastArrival = now;
+            // a delta run only carries the changed blocks, the bytes they stand for are in transfer->delta
+            if (session->delta && transfer->numRuns > 0) {
+                long long changed = receiveRecords(transfer, packet, receiveResult);
+                if (changed < 0) {
+                    closeTransfer(&server, session, "sent a damaged delta record");
+                    finished++;
+                    continue;
+                }
+                transfer->totalReceived += changed;
+                continue;
+            }
+            if (session->compression == COMPRESS_NONE) {
+                transfer->totalReceived += receiveResult;
+                continue;
+            }
+            long long restored = receiveFrames(transfer, packet, receiveResult);
+            if (restored < 0) {
+                closeTransfer(&server, session, "sent a damaged frame");
+                finished++;
+                continue;
+            }
+            transfer->totalReceived += restored;
         }
+    }
+
+    printf("- Packets per receive syscall: %.2f (%lld packets, %lld calls%s)\n",
+           server.listener.receiveCalls ? (double) server.listener.packetsReceived / server.listener.receiveCalls : 0.0,
+           server.listener.packetsReceived, server.listener.receiveCalls, server.listener.gro ? ", UDP GRO" : "");
 
+    // Exit and close connections
+    rudp_serverFree(&server);
+    close(receiver_socket);
+    return 0;
+}
+
+// Function to print a finished transfer and release its state
+void closeTransfer(RUDPServer* server, RUDPConnection* session, const char* reason) {
+    struct Transfer* transfer = session->context;
 
-    
-     // Print statistics after receiving the exit message
     printf("----------------------------------\n");
-    printf("- * Statistics * -\n");
+    printf("- * Statistics of sender #%d (%s:%d, %s) * -\n", transfer->id,
+           inet_ntoa(session->peer.sin_addr), ntohs(session->peer.sin_port), reason);
 
-    for (int i = 0; i < numRuns; i++) {
-        printf("- Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", i + 1, runStatistics[i].time, runStatistics[i].speed);
+    for (int i = 0; i < transfer->numRuns; i++) {
+        printf("- Run #%d Data: Time=%.2fms; Speed=%.2fMB/s; CPU=%.2fms/GB\n", i + 1, transfer->runStatistics[i].time,
+               transfer->runStatistics[i].speed, transfer->runStatistics[i].cpu);
     }
 
-    // Calculate and print averages
-    //printStatistics(runStatistics, numRuns);
-
+    // Calculate and print averages and the tail
+    printStatistics(transfer->runStatistics, transfer->numRuns, &transfer->arrivals);
+    printf("- Integrity check (%s %s): %.2fms per GB\n",
+           session->integrity == RUDP_INTEGRITY_CRC32C ? "crc32c" : "checksum",
+           session->integrity == RUDP_INTEGRITY_CRC32C ? rudp_crc32cImplementation() : rudp_checksumImplementation(),
+           session->integrityBytes ? session->integrityTime / 1e6 / (session->integrityBytes / 1e9) : 0.0);
+    if (session->fecData > 0) {
+        printf("- FEC (%d+%d): %lld lost packets rebuilt from parity\n", session->fecData, session->fecParity,
+               session->fecRecovered);
+    }
+    if (session->delta) {
+        printf("- ");
+        delta_print(&transfer->delta);
+    }
     printf("----------------------------------\n");
 
-    // Exit and close connections
-    close(receiver_socket);
-    return 0;
+    session->context = NULL;
+    if (session->compression != COMPRESS_NONE) {
+        compress_decoderFree(&transfer->decoder);
+        free(transfer->frame);
+    }
+    free(transfer->runStatistics);
+    free(transfer);
+    rudp_serverClose(server, session);
 }
 
-// Function to print statistics for each run
-void printStatistics(struct RunStatistics* statistics, int numRuns) {
+// Function to take the frames of compressed payload apart, returns the file bytes restored or -1 for a damaged frame
+long long receiveFrames(struct Transfer* transfer, const char* payload, int length) {
+    long long restored = 0;
+    CompressFrame frame;
+
+    while (length > 0) {
+        // the header first, then as many wire bytes as it announces
+        size_t need = sizeof(frame);
+        if (transfer->frameFill >= sizeof(frame)) {
+            memcpy(&frame, transfer->frame, sizeof(frame));
+            need += ntohl(frame.wireLength);
+        }
+        size_t take = need - transfer->frameFill < (size_t) length ? need - transfer->frameFill : (size_t) length;
+        memcpy(transfer->frame + transfer->frameFill, payload, take);
+        transfer->frameFill += take;
+        payload += take;
+        length -= take;
+        if (transfer->frameFill < need) {
+            continue;
+        }
+
+        memcpy(&frame, transfer->frame, sizeof(frame));
+        frame.rawLength = ntohl(frame.rawLength);
+        frame.wireLength = ntohl(frame.wireLength);
+        if (need == sizeof(frame)) {
+            // a header that just got complete, an empty frame can't be sent
+            if (compress_checkFrame(&frame, COMPRESS_BLOCK_SIZE) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (compress_decode(&transfer->decoder, &frame, transfer->frame + sizeof(frame), transfer->raw) == -1) {
+            return -1;
+        }
+        restored += frame.rawLength;
+        transfer->frameFill = 0;
+    }
+
+    return restored;
+}
+
+// Function to take the records of a delta run apart, returns the bytes of changed blocks in the payload or -1 for a damaged record
+long long receiveRecords(struct Transfer* transfer, const char* payload, int length) {
+    long long changed = 0;
+
+    while (length > 0) {
+        // the block of a record is counted and dropped like the data of a whole run
+        if (transfer->recordLeft > 0) {
+            uint64_t take = transfer->recordLeft < (uint64_t) length ? transfer->recordLeft : (uint64_t) length;
+            transfer->recordLeft -= take;
+            changed += take;
+            payload += take;
+            length -= take;
+            continue;
+        }
+
+        size_t take = sizeof(DeltaRecord) - transfer->recordFill < (size_t) length ? sizeof(DeltaRecord) - transfer->recordFill : (size_t) length;
+        memcpy((char *) &transfer->record + transfer->recordFill, payload, take);
+        transfer->recordFill += take;
+        payload += take;
+        length -= take;
+        if (transfer->recordFill < sizeof(DeltaRecord)) {
+            continue;
+        }
+
+        DeltaRecord record;
+        record.offset = be64toh(transfer->record.offset);
+        record.length = be64toh(transfer->record.length);
+        transfer->recordFill = 0;
+        int kind = delta_checkRecord(&record, 0, DELTA_END);
+        if (kind == -1) {
+            return -1;
+        }
+        if (kind == 1) {
+            transfer->delta.checkedBlocks += (record.length + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+            transfer->delta.coveredBytes += record.length;
+            continue;
+        }
+        transfer->recordLeft = record.length;
+        transfer->delta.changedBlocks++;
+        transfer->delta.changedBytes += record.length;
+    }
+
+    return changed;
+}
+
+// Function to print the mean, spread and tail of the runs
+void printStatistics(struct RunStatistics* statistics, int numRuns, const Histogram* arrivals) {
     double totalTime = 0.0;
     double totalSpeed = 0.0;
+    double squares = 0.0;
 
+    if (numRuns == 0) {
+        return;
+    }
     for (int i = 0; i < numRuns; i++) {
         totalTime += statistics[i].time;
         totalSpeed += statistics[i].speed;
@@ -158,19 +422,32 @@ void printStatistics(struct RunStatistics* statistics, int numRuns) {
     double avgTime = totalTime / numRuns;
     double avgSpeed = totalSpeed / numRuns;
 
+    // sample standard deviation, a slow run stands out against the mean
+    for (int i = 0; i < numRuns; i++) {
+        squares += (statistics[i].speed - avgSpeed) * (statistics[i].speed - avgSpeed);
+    }
+    double stddevSpeed = numRuns > 1 ? sqrt(squares / (numRuns - 1)) : 0.0;
+
     printf("- Average time: %.2fms\n", avgTime);
-    printf("- Average bandwidth: %.2fMB/s\n", avgSpeed);
+    printf("- Average bandwidth: %.2fMB/s (stddev %.2fMB/s)\n", avgSpeed, stddevSpeed);
+    hist_print("Packet inter-arrival", arrivals);
 }
 
 // Function to calculate time and speed for a run
-void calcTime(int fileSize, struct timeval start, struct RunStatistics* runStatistics, int numRuns) {
-    struct timeval end;
-    gettimeofday(&end, NULL);
-    double elapsedTime = (end.tv_sec - start.tv_sec) * 1000.0;  // Convert to milliseconds
-    elapsedTime += (end.tv_usec - start.tv_usec) / 1000.0;
+void calcTime(long long fileSize, uint64_t start, double cpuStart, struct RunStatistics* runStatistics, int numRuns) {
+    double elapsedTime = (hist_now() - start) / 1e6;  // Convert to milliseconds
 
     double speed = (fileSize / elapsedTime) * 1000.0 / (1024 * 1024);  // Speed in MB/s
 
     runStatistics[numRuns].time = elapsedTime;
     runStatistics[numRuns].speed = speed;
+    runStatistics[numRuns].cpu = fileSize ? (cpuTime() - cpuStart) / (fileSize / 1e9) : 0;
+}
+
+// Function to get the CPU time (user + system) the process used so far in milliseconds
+double cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
 }
\ No newline at end of file
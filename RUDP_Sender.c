@@ -1,27 +1,112 @@
 #include "RUDP.h"
+#include "Compression.h"
+#include "Delta.h"
+#include "RunReport.h"
+#include <endian.h>
+#include <sys/resource.h>
 
 
-// Function to read content from a file and return it along with its size
-char* readFromFile(int* size);
-
 // Global variables
 char *fileName = "tosend.txt";
 
+// Function to send the blocks whose hashes differ from the ones of the last run, and the end of the run
+int sendDelta(RUDPConnection* conn, FileStream* stream, DeltaTable* table, char* buffer);
+
+// Function to get the CPU time (user + system) the process used so far in milliseconds
+double cpuTime();
+
 int main(int argc,char** argv) {
 
      // Check command line arguments
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s -a <receiver_ip> -f <file_path>\n", argv[0]);
+    if (argc < 5 || argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s -ip <receiver_ip> -p <port> [-w <window>] [-b <batch>] [-integrity checksum|crc32c] [-algo aimd|bbr|none] [-fec <data>/<parity>|off] [-compress deflate|off] [-delta on|off] [-gso on|off] [-pacing off|auto|<Mbit/s>] [-pacer auto|fq|txtime|bucket] [-runs <count>] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>]\n", argv[0]);
         exit(1);
     }
 
     // Parse command line arguments
-    int port = atoi(argv[4]);
-    char *receiver_ip = argv[2];
+    int port = 0;
+    char *receiver_ip = NULL;
+    int windowSize = RUDP_DEFAULT_WINDOW;
+    int batchSize = RUDP_DEFAULT_BATCH;
+    int integrity = RUDP_INTEGRITY_CHECKSUM;
+    int algorithm = RUDP_CC_AIMD;
+    int fecData = 0, fecParity = 0;
+    int codec = COMPRESS_NONE;
+    int delta = 0;
+    int gso = 0;
+    int pacing = 0;
+    double pacingCap = 0;
+    int pacer = RUDP_PACER_AUTO;
+    int runs = 0;
+    char *csvName = NULL;
+    char *statsName = NULL;
+    int statsInterval = COUNTERS_DEFAULT_INTERVAL;
+    for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "-ip") == 0) {
+            receiver_ip = argv[i + 1];
+        } else if (strcmp(argv[i], "-p") == 0) {
+            port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            windowSize = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-b") == 0) {
+            batchSize = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-integrity") == 0 && strcmp(argv[i + 1], "crc32c") == 0) {
+            integrity = RUDP_INTEGRITY_CRC32C;
+        } else if (strcmp(argv[i], "-integrity") == 0 && strcmp(argv[i + 1], "checksum") == 0) {
+            integrity = RUDP_INTEGRITY_CHECKSUM;
+        } else if (strcmp(argv[i], "-algo") == 0 && rudp_ccParse(argv[i + 1]) >= 0) {
+            algorithm = rudp_ccParse(argv[i + 1]);
+        } else if (strcmp(argv[i], "-fec") == 0 && strcmp(argv[i + 1], "off") == 0) {
+            fecData = 0;
+            fecParity = 0;
+        } else if (strcmp(argv[i], "-fec") == 0 && sscanf(argv[i + 1], "%d/%d", &fecData, &fecParity) == 2 &&
+                   fecData >= 1 && fecData <= RUDP_FEC_MAX_DATA && fecParity >= 1 && fecParity <= RUDP_FEC_MAX_PARITY &&
+                   fecParity <= fecData) {
+            // a block of fecData packets and fecParity parity packets
+        } else if (strcmp(argv[i], "-compress") == 0 && compress_parse(argv[i + 1]) >= 0) {
+            codec = compress_parse(argv[i + 1]);
+        } else if (strcmp(argv[i], "-delta") == 0 && (strcmp(argv[i + 1], "on") == 0 || strcmp(argv[i + 1], "off") == 0)) {
+            delta = strcmp(argv[i + 1], "on") == 0;
+        } else if (strcmp(argv[i], "-gso") == 0 && (strcmp(argv[i + 1], "on") == 0 || strcmp(argv[i + 1], "off") == 0)) {
+            gso = strcmp(argv[i + 1], "on") == 0;
+        } else if (strcmp(argv[i], "-pacing") == 0 && (strcmp(argv[i + 1], "off") == 0 || strcmp(argv[i + 1], "auto") == 0)) {
+            pacing = strcmp(argv[i + 1], "auto") == 0;
+            pacingCap = 0;
+        } else if (strcmp(argv[i], "-pacing") == 0 && atof(argv[i + 1]) > 0) {
+            // at most this many Mbit/s, below the congestion controller's rate if that is lower
+            pacing = 1;
+            pacingCap = atof(argv[i + 1]) * 1e6 / 8;
+        } else if (strcmp(argv[i], "-pacer") == 0 && rudp_pacerParse(argv[i + 1]) != -2 &&
+                   rudp_pacerParse(argv[i + 1]) != RUDP_PACER_OFF) {
+            pacer = rudp_pacerParse(argv[i + 1]);
+        } else if (strcmp(argv[i], "-runs") == 0) {
+            runs = atoi(argv[i + 1]) < 1 ? 1 : atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-csv") == 0) {
+            csvName = argv[i + 1];
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            statsName = argv[i + 1];
+        } else if (strcmp(argv[i], "-stats-ms") == 0) {
+            statsInterval = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Usage: %s -ip <receiver_ip> -p <port> [-w <window>] [-b <batch>] [-integrity checksum|crc32c] [-algo aimd|bbr|none] [-fec <data>/<parity>|off] [-compress deflate|off] [-delta on|off] [-gso on|off] [-pacing off|auto|<Mbit/s>] [-pacer auto|fq|txtime|bucket] [-runs <count>] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (receiver_ip == NULL) {
+        fprintf(stderr, "Usage: %s -ip <receiver_ip> -p <port> [-w <window>] [-b <batch>] [-integrity checksum|crc32c] [-algo aimd|bbr|none] [-fec <data>/<parity>|off] [-compress deflate|off] [-delta on|off] [-gso on|off] [-pacing off|auto|<Mbit/s>] [-pacer auto|fq|txtime|bucket] [-runs <count>] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>]\n", argv[0]);
+        exit(1);
+    }
+
+    // Live counters, on SIGUSR1 and in the stats file
+    if (counters_start(statsName, statsInterval) == -1) {
+        exit(1);
+    }
 
     // File-related variables
-    char *fileContent =NULL;
-    int fileSize = 0;
+    FileStream stream;
+    CompressPipeline pipeline;
+    DeltaTable table;
+    char* deltaBuffer = NULL;
 
 
     //Create a UDP socket between the Sender and the Receiver.
@@ -30,13 +115,6 @@ int main(int argc,char** argv) {
         return -1;
     }
 
-    // Create a timeout of receive in sender socket
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 1000;
-
-    setsockopt(sender_socket,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
-
     struct sockaddr_in receiverAddress;
     memset(&receiverAddress, 0, sizeof(receiverAddress));
     receiverAddress.sin_family = AF_INET;
@@ -46,50 +124,147 @@ int main(int argc,char** argv) {
         printf("inet_pton() failed");
         return -1;
     }
-    struct sockaddr_in fromAddress;
-    memset((char *)&fromAddress, 0, sizeof(fromAddress));
+
+    RUDPConnection conn;
+    if (rudp_init(&conn, sender_socket, &receiverAddress, windowSize, batchSize, RUDP_SIDE_SEND | RUDP_SIDE_RECEIVE) < 0) {
+        return -1;
+    }
+    conn.integrity = integrity;
+    conn.congestion = algorithm;
+    conn.fecData = fecData;
+    conn.fecParity = fecParity;
+    conn.compression = codec;
+    conn.delta = delta;
+    if (gso) {
+        rudp_enableGSO(&conn);
+    }
+    if (pacing) {
+        rudp_enablePacing(&conn, pacer, pacingCap);
+        if (pacingCap > 0) {
+            printf("Pacing (%s): at the congestion controller's rate, at most %.2f Mbit/s\n", rudp_pacerName(conn.pacer),
+                   pacingCap * 8 / 1e6);
+        } else {
+            printf("Pacing (%s): at the congestion controller's rate\n", rudp_pacerName(conn.pacer));
+        }
+    }
+    Histogram roundTrips;
+    hist_init(&roundTrips);
+    conn.rttHistogram = &roundTrips;
 
     // Connecet to receiver
     printf("Sending connect message to receiver\n");
-    int connectionResult = rudp_connect(sender_socket,&receiverAddress,&fromAddress);
+    int connectionResult = rudp_connect(&conn);
     if(connectionResult <= 0){
         printf("Connction to Receiver Failed\n");
         return -1;
     }
-    printf("got ACK connection successful, sending file\n");
+    printf("got ACK connection successful, sending file (window of %d packets, %d per system call, %s, %s)\n",
+           conn.windowSize, conn.batchSize, conn.integrity == RUDP_INTEGRITY_CRC32C ? "crc32c" : "checksum",
+           rudp_ccName(conn.congestion));
+    if (conn.fecData > 0) {
+        printf("FEC: %d parity packets for every %d data packets\n", conn.fecParity, conn.fecData);
+    } else if (fecData > 0) {
+        printf("FEC: the receiver turned it down\n");
+    }
+    if (conn.compression != COMPRESS_NONE) {
+        printf("Compression: %s\n", compress_name(conn.compression));
+    } else if (codec != COMPRESS_NONE) {
+        printf("Compression: the receiver turned it down\n");
+    }
+    if (conn.delta) {
+        printf("Delta runs: the runs after the first send the changed blocks only\n");
+    } else if (delta) {
+        printf("Delta runs: the receiver turned them down\n");
+    }
+
+    // open the file, it's read one chunk at a time while sending
+    if (stream_open(&stream, fileName, STREAM_CHUNK_SIZE) < 0) {
+        return -1;
+    }
+    printf("File \"%s\" total size is %llu bytes.\n", fileName, (unsigned long long) stream.size);
+    if (conn.compression != COMPRESS_NONE && compress_init(&pipeline, &stream, conn.compression) == -1) {
+        return -1;
+    }
 
-    // read the file
-    fileContent = readFromFile(&fileSize);
+    // the receiver can't send its hashes back, the sender keeps the ones of what it acknowledged
+    if (conn.delta) {
+        deltaBuffer = malloc(sizeof(DeltaRecord) + DELTA_BLOCK_SIZE);
+        if (deltaBuffer == NULL || delta_init(&table, 0, stream.size) == -1 || delta_hashFile(&table, stream.fd) == -1) {
+            printf("Can't hash the file\n");
+            return -1;
+        }
+    }
 
     //Send the file to the receiver
     int userChoice = 1;
 
-    while(userChoice) {
+    for (int run = 1; userChoice; run++) {
         printf("Sending file...\n");
-        
-        // Send data in chunks
-        char data[MESSAGE_SIZE];
-        int i;
-        for(i=0;i+MESSAGE_SIZE<fileSize;i+=MESSAGE_SIZE) {
-            strncpy(data,fileContent+i,MESSAGE_SIZE);
-            rudp_sendDataPacket(sender_socket, data, &receiverAddress, &fromAddress);
+        long long retransmits = conn.retransmits;
+        double cpuStart = cpuTime();
+        uint64_t start = hist_now();
+
+        // Send the file chunk by chunk, the window keeps several packets in flight. With compression
+        // a thread turns the chunks into frames while the ones before them are sent. A delta run
+        // sends the blocks that changed since the last one only
+        const char* chunk;
+        ssize_t chunkLength = 0;
+        if (conn.delta && run > 1) {
+            if (sendDelta(&conn, &stream, &table, deltaBuffer) == -1) {
+                return -1;
+            }
+        } else {
+            if (conn.compression != COMPRESS_NONE) {
+                if (compress_start(&pipeline) == -1) {
+                    return -1;
+                }
+            } else {
+                stream_rewind(&stream);
+            }
+            while ((chunkLength = conn.compression != COMPRESS_NONE ? compress_next(&pipeline, &chunk) : stream_next(&stream, &chunk)) > 0) {
+                if (rudp_send(&conn, chunk, chunkLength) <= 0) {
+                    printf("send() failed\n");
+                    return -1;
+                }
+            }
+            if (conn.compression != COMPRESS_NONE) {
+                compress_finish(&pipeline);
+            }
+            if (chunkLength < 0) {
+                return -1;
+            }
+        }
+        printf("RTT estimate: SRTT=%.3fms RTTVAR=%.3fms RTO=%.3fms\n",
+               conn.srtt / 1000.0, conn.rttvar / 1000.0, conn.rto / 1000.0);
+        printf("Congestion control (%s): cwnd=%.1f packets, pacing rate=%.2fMB/s\n",
+               rudp_ccName(conn.congestion), conn.cc.cwnd, conn.cc.pacingRate / (1024 * 1024));
+
+        // Send the EOF, the run only counts once the receiver has it
+        if (rudp_sendEnd(&conn) <= 0) {
+            printf("send() failed\n");
+            return -1;
+        }
+        uint64_t end = hist_now();
+
+        if (csvName != NULL) {
+            double time = (end - start) / 1e6;
+            RunReport report = {"rudp", "sender", rudp_ccName(conn.congestion), stream.size, run, time,
+                                (stream.size / time) * 1000.0 / (1024 * 1024), stream.size ? (cpuTime() - cpuStart) / (stream.size / 1e9) : 0,
+                                conn.retransmits - retransmits};
+            report_run(csvName, &report);
         }
-        char* lastData = (char*) malloc(sizeof (char)*fileSize-i);
-        strncpy(lastData, fileContent+i,(fileSize-i));
-        rudp_sendDataPacket(sender_socket, lastData, &receiverAddress, &fromAddress);
-        free(lastData);
-
-        // Send the EOF
-        char endOfFile[1] = {EOF};
-        rudp_sendDataPacket(sender_socket, endOfFile, &receiverAddress, &fromAddress);
-
-        // waiting for user descision
-        printf("Resend the file? 1 for resend, 0 for exit \n");
-        scanf("%d",&userChoice);
-        
+
+        // waiting for user descision, a given run count answers it
+        if (runs > 0) {
+            userChoice = run < runs;
+        } else {
+            printf("Resend the file? 1 for resend, 0 for exit \n");
+            scanf("%d",&userChoice);
+        }
+
         // send the data agagin
         if(userChoice == 1){
-            int sendChoice = rudp_sendDataPacket(sender_socket,"yes",&receiverAddress, &fromAddress);
+            int sendChoice = rudp_send(&conn, "yes", strlen("yes"));
             if(sendChoice < 0){
                 printf("send() failed\n");
                 return -1;
@@ -97,7 +272,7 @@ int main(int argc,char** argv) {
         }
         // send to the receiver exit 
         if(userChoice == 0){
-            int sendChoice = rudp_sendDataPacket(sender_socket,"no",&receiverAddress, &fromAddress);
+            int sendChoice = rudp_send(&conn, "no", strlen("no"));
             if(sendChoice < 0){
                 printf("send() failed\n");
                 return -1;
@@ -108,41 +283,92 @@ int main(int argc,char** argv) {
 
      //Send an exit message to the receiver.
     printf("Sending disconnect message to receiver\n");
-    int diconnectionResult = rudp_disconnect(sender_socket,&receiverAddress,&fromAddress);
+    int diconnectionResult = rudp_disconnect(&conn);
     if(diconnectionResult<=0){
         printf("Disconnction to Receiver Failed\n");
         return -1;
     }
     printf("Got Ack from receiver, sender Exit...\n");
+    hist_print("ACK round trip", &roundTrips);
+    printf("Packets per send syscall: %.2f%s\n", conn.sendCalls ? (double) conn.packetsSent / conn.sendCalls : 0.0,
+           conn.gso ? " (UDP GSO)" : "");
+    if (conn.pacer == RUDP_PACER_BUCKET) {
+        printf("Pacing (bucket): last rate %.2f Mbit/s, %lld datagrams held back for %.2fms\n", rudp_pacingRate(&conn) * 8 / 1e6,
+               conn.pacingWaits, conn.pacingWaitTime / 1000.0);
+    } else if (conn.pacer == RUDP_PACER_FQ) {
+        printf("Pacing (fq): last rate %.2f Mbit/s, SO_MAX_PACING_RATE set %lld times\n", conn.pacingApplied * 8 / 1e6,
+               conn.pacingUpdates);
+    } else if (conn.pacer == RUDP_PACER_TXTIME) {
+        printf("Pacing (txtime): last rate %.2f Mbit/s\n", rudp_pacingRate(&conn) * 8 / 1e6);
+    }
+    if (conn.fecData > 0) {
+        printf("FEC (%d+%d): %lld parity packets, %lld retransmissions\n", conn.fecData, conn.fecParity,
+               conn.paritySent, conn.retransmits);
+    }
+    printf("Integrity (%s): %.2fms per GB\n",
+           conn.integrity == RUDP_INTEGRITY_CRC32C ? rudp_crc32cImplementation() : rudp_checksumImplementation(),
+           conn.integrityBytes ? conn.integrityTime / 1e6 / (conn.integrityBytes / 1e9) : 0.0);
+    if (conn.compression != COMPRESS_NONE) {
+        compress_print(&pipeline);
+        compress_free(&pipeline);
+    }
+    if (conn.delta) {
+        delta_print(&table);
+        delta_free(&table);
+        free(deltaBuffer);
+    }
 
 
     //Close the connection and exit 
+    rudp_free(&conn);
+    stream_close(&stream);
     close(sender_socket);
     return 0;
 }
 
+// Function to send the blocks whose hashes differ from the ones of the last run, and the end of the run
+int sendDelta(RUDPConnection* conn, FileStream* stream, DeltaTable* table, char* buffer) {
+    uint64_t position = 0;
+    const char* chunk;
+    ssize_t length;
+    DeltaRecord record;
 
-char* readFromFile(int* size) {
-    FILE *fpointer = NULL;
-    char* fileContent;
-
-    fpointer = fopen(fileName, "r");
-
-    if (fpointer == NULL) {
-        perror("fopen");
-        exit(1);
+    // the chunks start on block boundaries, a block that hashes the same is left out
+    stream_rewind(stream);
+    while ((length = stream_next(stream, &chunk)) > 0) {
+        for (ssize_t offset = 0; offset < length; offset += DELTA_BLOCK_SIZE) {
+            size_t block = length - offset < DELTA_BLOCK_SIZE ? length - offset : DELTA_BLOCK_SIZE;
+            if (!delta_update(table, (position + offset) / DELTA_BLOCK_SIZE, chunk + offset, block)) {
+                continue;
+            }
+            record.offset = htobe64(position + offset);
+            record.length = htobe64(block);
+            memcpy(buffer, &record, sizeof(record));
+            memcpy(buffer + sizeof(record), chunk + offset, block);
+            if (rudp_send(conn, buffer, sizeof(record) + block) <= 0) {
+                printf("send() failed\n");
+                return -1;
+            }
+        }
+        position += length;
+    }
+    if (length < 0) {
+        return -1;
     }
 
-    // Find the file size and allocate enough memory for it.
-    fseek(fpointer, 0L, SEEK_END);
-    *size = (int) ftell(fpointer);
-    fileContent = (char*) malloc(*size * sizeof(char));
-    fseek(fpointer, 0L, SEEK_SET);
-
-    fread(fileContent, sizeof(char), *size, fpointer);
-    fclose(fpointer);
-
-    printf("File \"%s\" total size is %d bytes.\n", fileName, *size);
+    // the end of the run tells how much of the file it covered
+    record.offset = htobe64(DELTA_END);
+    record.length = htobe64(position);
+    if (rudp_send(conn, (char *) &record, sizeof(record)) <= 0) {
+        printf("send() failed\n");
+        return -1;
+    }
+    return 0;
+}
 
-    return fileContent;
+double cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
 }
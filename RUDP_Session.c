@@ -0,0 +1,266 @@
+#include "RUDP.h"
+
+
+/**
+ * first bucket of a sender address and connection ID, the key is mixed so
+ * neighbouring ports and IDs spread over the whole index
+ */
+static unsigned int session_hash(const struct sockaddr_in* address, unsigned int connId){
+    unsigned long long key = ((unsigned long long) address->sin_addr.s_addr << 16) ^ address->sin_port;
+    key = (key << 32 | connId) ^ key >> 32;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return (unsigned int) key & (RUDP_SESSION_BUCKETS - 1);
+}
+
+static int session_matches(const RUDPConnection* session, const struct sockaddr_in* address, unsigned int connId){
+    return session->connId == connId && session->peer.sin_addr.s_addr == address->sin_addr.s_addr &&
+           session->peer.sin_port == address->sin_port;
+}
+
+/**
+ * bucket that holds the session, or the empty bucket where it would go.
+ * The index is at most half full, so a probe ends after a few buckets.
+ */
+static unsigned int session_find(RUDPServer* server, const struct sockaddr_in* address, unsigned int connId){
+    unsigned int bucket = session_hash(address, connId);
+    while (server->buckets[bucket] != NULL && !session_matches(server->buckets[bucket], address, connId)) {
+        bucket = (bucket + 1) & (RUDP_SESSION_BUCKETS - 1);
+    }
+    return bucket;
+}
+
+/**
+ * start a session for a SYN from a new sender, it shares the server's socket. It has no send
+ * side and its receive window is left out until the SYN is accepted, see session_establish(),
+ * so SYNs from spoofed addresses pin little memory.
+ * @return NULL: out of sessions or memory
+ */
+static RUDPConnection* session_open(RUDPServer* server, unsigned int bucket, struct sockaddr_in* address, unsigned int connId){
+    if (server->sessionCount == RUDP_MAX_SESSIONS) {
+        printf("Too many sessions, dropping a connection request\n");
+        return NULL;
+    }
+    RUDPConnection* session = malloc(sizeof(RUDPConnection));
+    // the server's listener reads for all sessions and a session only sends ACKs, it starts without windows
+    if (session == NULL || rudp_init(session, server->listener.socket, address, RUDP_MAX_WINDOW, 1, 0) < 0) {
+        free(session);
+        return NULL;
+    }
+    session->connId = connId;
+    session->ackEvery = server->ackEvery;
+    session->congestion = server->congestion;
+    session->compression = server->compression;
+    session->sessionIndex = server->sessionCount;
+
+    server->buckets[bucket] = session;
+    server->sessions[server->sessionCount++] = session;
+    return session;
+}
+
+/**
+ * allocate the receive window of a session for its first data or parity packet
+ * @return -1: out of memory, 0: the session's SYN wasn't accepted yet, 1: the window is there
+ */
+static int session_establish(RUDPConnection* session){
+    if (session->recvWindow != NULL) {
+        return 1;
+    }
+    if (session->expectedSeq == 0) {
+        return 0;
+    }
+    session->recvWindow = calloc(RUDP_MAX_WINDOW, sizeof(RUDPRecvSlot));
+    if (session->recvWindow == NULL) {
+        printf("calloc() failed\n");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * send the ACKs that sessions hold back, the socket is drained and no packet will trigger them
+ * @return -1: failed, 1: successful
+ */
+static int session_flushACKs(RUDPServer* server){
+    for (int i = 0; i < server->sessionCount; i++) {
+        RUDPConnection* session = server->sessions[i];
+        if (session->unackedPackets > 0 && rudp_sendACK(session, &session->peer) < 0) {
+            return -1;
+        }
+    }
+    server->ackPending = 0;
+    return 1;
+}
+
+/**
+ * set up a server on a bound socket, the socket wakes the server up every
+ * RUDP_SESSION_POLL_US to expire idle sessions
+ * @param ackEvery and congestion are given to every new session, congestion -1 leaves the choice to the senders
+ * @param compression the codec a sender may ask for, 0 for none
+ * @return -1: error, 1: successful
+ */
+int rudp_serverInit(RUDPServer* server, int socket, int batchSize, int ackEvery, int congestion, int compression){
+    memset(server, 0, sizeof(RUDPServer));
+    if (rudp_init(&server->listener, socket, NULL, 1, batchSize, RUDP_SIDE_RECEIVE) < 0) {
+        return -1;
+    }
+    server->ackEvery = ackEvery;
+    server->congestion = congestion;
+    server->compression = compression;
+    server->lastExpiry = rudp_now();
+    server->buckets = calloc(RUDP_SESSION_BUCKETS, sizeof(RUDPConnection*));
+    server->sessions = calloc(RUDP_MAX_SESSIONS, sizeof(RUDPConnection*));
+    if (server->buckets == NULL || server->sessions == NULL) {
+        printf("calloc() failed\n");
+        rudp_serverFree(server);
+        return -1;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = RUDP_SESSION_POLL_US / 1000000;
+    timeout.tv_usec = RUDP_SESSION_POLL_US % 1000000;
+    if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        printf("setsockopt() failed with error code : %d\n", errno);
+        rudp_serverFree(server);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * close every session that is still open and release the server, the socket stays open
+ */
+void rudp_serverFree(RUDPServer* server){
+    while (server->sessions != NULL && server->sessionCount > 0) {
+        rudp_serverClose(server, server->sessions[server->sessionCount - 1]);
+    }
+    free(server->buckets);
+    free(server->sessions);
+    server->buckets = NULL;
+    server->sessions = NULL;
+    rudp_free(&server->listener);
+}
+
+/**
+ * remove a session from the server and release it. Its context is the caller's
+ * and must be released before.
+ */
+void rudp_serverClose(RUDPServer* server, RUDPConnection* session){
+    unsigned int bucket = session_find(server, &session->peer, session->connId);
+    server->buckets[bucket] = NULL;
+
+    // move later entries of the probe sequence back into the hole, so every probe still ends at an empty bucket
+    unsigned int hole = bucket;
+    for (unsigned int next = (bucket + 1) & (RUDP_SESSION_BUCKETS - 1); server->buckets[next] != NULL;
+         next = (next + 1) & (RUDP_SESSION_BUCKETS - 1)) {
+        unsigned int home = session_hash(&server->buckets[next]->peer, server->buckets[next]->connId);
+        if (((next - home) & (RUDP_SESSION_BUCKETS - 1)) >= ((next - hole) & (RUDP_SESSION_BUCKETS - 1))) {
+            server->buckets[hole] = server->buckets[next];
+            server->buckets[next] = NULL;
+            hole = next;
+        }
+    }
+
+    // the last session takes the free place in the list
+    RUDPConnection* last = server->sessions[--server->sessionCount];
+    server->sessions[session->sessionIndex] = last;
+    last->sessionIndex = session->sessionIndex;
+
+    if (server->ready == session) {
+        server->ready = NULL;
+    }
+    rudp_free(session);
+    free(session);
+}
+
+/**
+ * receive the next event of any session. A datagram is handed to the session of its
+ * sender address and connection ID, a SYN from a new sender opens a session, other
+ * packets of unknown sessions are dropped. Results are the ones of rudp_receive for
+ * that session. Sessions that were idle for RUDP_SESSION_IDLE_US are reported one at
+ * a time, the caller closes them, and closes a session after its exit message too,
+ * also the ones that never connected.
+ * @param session set to the session the result belongs to
+ * @param data buffer of MESSAGE_SIZE bytes for the payload, can be NULL
+ * @return -5: session expired, -1: failure, 0: exit message, 1: connected, -2: EOF, -3: bad packet, -4: nothing in order yet, >0: Data
+ */
+int rudp_serverReceive(RUDPServer* server, RUDPConnection** session, char* data){
+    while (1) {
+        // a packet that filled a gap may have made the next ones deliverable
+        if (server->ready != NULL) {
+            *session = server->ready;
+            int delivered = rudp_deliverWindow(server->ready, data);
+            if (delivered != -4) {
+                return delivered;
+            }
+            server->ready = NULL;
+        }
+
+        long long now = rudp_now();
+        if (now - server->lastExpiry >= RUDP_SESSION_POLL_US) {
+            for (int i = 0; i < server->sessionCount; i++) {
+                if (now - server->sessions[i]->lastActive >= RUDP_SESSION_IDLE_US) {
+                    // reported once per idle period, even if the caller keeps it open
+                    server->sessions[i]->lastActive = now;
+                    *session = server->sessions[i];
+                    return -5;
+                }
+            }
+            server->lastExpiry = now;
+        }
+
+        // while ACKs are held back only take what is queued, and send them before blocking
+        RUDPPacket* buffer;
+        struct sockaddr_in senderAddress;
+        int recvData = -2;
+        if (server->ackPending) {
+            recvData = rudp_recvPacket(&server->listener, &buffer, &senderAddress, MSG_DONTWAIT);
+            if (recvData == -2 && session_flushACKs(server) < 0) {
+                return -1;
+            }
+        }
+        if (recvData == -2) {
+            recvData = rudp_recvPacket(&server->listener, &buffer, &senderAddress, 0);
+        }
+        if (recvData == -2 || recvData == -3) {
+            continue;
+        }
+        if (recvData < 0) {
+            return -1;
+        }
+
+        unsigned int bucket = session_find(server, &senderAddress, buffer->header.connId);
+        RUDPConnection* found = server->buckets[bucket];
+        if (found == NULL) {
+            // only the SYN that starts a connection opens a session, it takes sequence number 0
+            if (buffer->header.flags != SYN_FLAG || buffer->header.seq != 0) {
+                continue;
+            }
+            found = session_open(server, bucket, &senderAddress, buffer->header.connId);
+            if (found == NULL) {
+                continue;
+            }
+        }
+        if (buffer->header.flags == DATA_FLAG || buffer->header.flags == END_FLAG || buffer->header.flags == PARITY_FLAG) {
+            int established = session_establish(found);
+            if (established < 0) {
+                return -1;
+            }
+            if (established == 0) {
+                continue;
+            }
+        }
+        found->lastActive = rudp_now();
+
+        *session = found;
+        int result = rudp_handlePacket(found, buffer, recvData, &senderAddress, data);
+        if (buffer->header.flags == DATA_FLAG || buffer->header.flags == END_FLAG || buffer->header.flags == PARITY_FLAG) {
+            server->ready = found;
+        }
+        if (found->unackedPackets > 0) {
+            server->ackPending = 1;
+        }
+        return result;
+    }
+}
@@ -0,0 +1,59 @@
+#include "RunReport.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define REPORT_HEADER "protocol,role,algorithm,bytes,run,time_ms,speed_mbs,cpu_ms_per_gb,retransmits\n"
+
+int report_run(const char* path, const RunReport* report){
+    char line[512];
+    char retransmits[32] = "";
+    struct stat fileStat;
+
+    if (report->retransmits >= 0) {
+        snprintf(retransmits, sizeof(retransmits), "%lld", report->retransmits);
+    }
+    int length = snprintf(line, sizeof(line), "%s,%s,%s,%llu,%d,%.3f,%.3f,%.3f,%s\n", report->protocol, report->role,
+                          report->algorithm, (unsigned long long) report->bytes, report->run, report->time,
+                          report->speed, report->cpu, retransmits);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    // the first writer of a new file puts the header in front
+    flock(fd, LOCK_EX);
+    int result = 0;
+    if (fstat(fd, &fileStat) == 0 && fileStat.st_size == 0 &&
+        write(fd, REPORT_HEADER, sizeof(REPORT_HEADER) - 1) != sizeof(REPORT_HEADER) - 1) {
+        result = -1;
+    }
+    if (write(fd, line, length) != length) {
+        result = -1;
+    }
+    if (result == -1) {
+        perror("write");
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return result;
+}
+
+void* report_grow(void* runs, int numRuns, int* capacity, size_t size){
+    if (numRuns < *capacity) {
+        return runs;
+    }
+    int grown = *capacity ? *capacity * 2 : 16;
+    void* larger = realloc(runs, grown * size);
+    if (larger == NULL) {
+        perror("realloc");
+        return NULL;
+    }
+    *capacity = grown;
+    return larger;
+}
@@ -0,0 +1,30 @@
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * One measured run, as the benchmark script collects it from the senders and receivers.
+ */
+typedef struct {
+    const char* protocol;   // "tcp" or "rudp"
+    const char* role;       // "sender" or "receiver"
+    const char* algorithm;  // congestion control
+    uint64_t bytes;         // file size
+    int run;                // 1 for the first run
+    double time;            // milliseconds
+    double speed;           // MB/s
+    double cpu;             // CPU time per GB in milliseconds
+    long long retransmits;  // packets sent again during the run, -1 where the side doesn't know
+} RunReport;
+
+/**
+ * Appends the run as a CSV line to path, a new file gets the header line first.
+ * Each line is a single write, so threads and processes can share the file.
+ * @return -1: failure, 0: success
+ */
+int report_run(const char* path, const RunReport* report);
+
+/**
+ * Grows an array of per-run records so index numRuns fits, the capacity doubles.
+ * @return the array, NULL when out of memory (the old array is still valid then)
+ */
+void* report_grow(void* runs, int numRuns, int* capacity, size_t size);
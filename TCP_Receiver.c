@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // splice() and F_SETPIPE_SZ
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -12,20 +13,132 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/statvfs.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <math.h>
+#include "UringIO.h"
+#include "RunReport.h"
+#include "Histogram.h"
+#include "Counters.h"
+#include "TcpTuning.h"
+#include "Compression.h"
+#include "Delta.h"
 
-#define MAX_RUNS 50
+#define RECEIVE_CHUNK_SIZE (1 << 20) // bytes moved from the socket to the file at a time
+#define RING_SIZE (4 * RECEIVE_CHUNK_SIZE) // the ring buffer is written to the file once half full
+#define DEFAULT_OUTPUT "received.txt"
+#define MAX_WORKERS 64
+#define MAX_EVENTS 64 // events handled per epoll_wait()
+#define MAX_STREAMS 16 // parallel connections of a striped transfer
+
+// ways to move the data from the socket to the file, each falls back to the next one
+#define MODE_URING 0   // io_uring with registered buffers, receives queued ahead
+#define MODE_SPLICE 1  // splice() through a pipe, no user space copy
+#define MODE_RING 2    // recv() into the ring buffer and write() it out
 
 // Structure to store statistics for each run
 struct RunStatistics {
     double time;    // Time taken for the run in milliseconds
     double speed;   // Data transfer speed in MB/s
+    double cpu;     // CPU time (user + system) spent per GB in milliseconds
+};
+
+// Sent on every connection before the data, all fields in network byte order
+struct __attribute__((packed)) TransferHeader {
+    uint64_t fileSize;      // size of the whole file
+    uint64_t offset;        // part of the file this connection carries
+    uint64_t length;
+    uint32_t transferId;    // the same on all connections of a striped transfer
+    uint16_t streamIndex;
+    uint16_t streamCount;
+    uint8_t codec;          // COMPRESS_* the sender asks for
+    uint8_t delta;          // 1 if the runs after the first should carry the changed blocks only
+};
+
+// Sent back on the connection when the sender asks for compression or delta runs
+struct __attribute__((packed)) TransferAnswer {
+    uint8_t codec;          // COMPRESS_* the receiver takes, COMPRESS_NONE if it isn't the one asked for
+    uint8_t delta;          // 1 if the receiver sends the hashes of its copy before every run after the first
+};
+
+// Fixed size ring buffer between the socket and the file, head and tail only grow
+struct RingBuffer {
+    char* data;
+    size_t size;
+    uint64_t head;  // bytes received into the ring so far
+    uint64_t tail;  // bytes written out to the file so far
+};
+
+// One connection of a transfer in the blocking mode, each runs in its own thread when striped
+struct ReceiveStream {
+    pthread_t thread;
+    int socketfd;
+    int outputfd;
+    uint64_t offset;        // part of the file it carries
+    uint64_t length;
+    uint64_t received;      // bytes of the last run
+    int pipefd[2];
+    bool useSplice;
+    bool useUring;
+    UringIO uring;
+    struct RingBuffer ring;
+    int codec;              // COMPRESS_* of the frames, COMPRESS_NONE for the file as it is
+    CompressDecoder decoder;
+    char* frameBuffer;      // a frame as it arrived and its file bytes, COMPRESS_BLOCK_SIZE each
+    int delta;              // 1 if the runs after the first carry the changed blocks only
+    int deltaRun;           // 1 while such a run is received
+    DeltaTable table;       // hashes of the part of the file as the last run left it
+    char* deltaBuffer;      // one changed block, DELTA_BLOCK_SIZE
+    uint64_t start;         // start of the run on the monotonic clock in nanoseconds, the same for all connections
+    struct RunStatistics statistics; // of the last run
+    Histogram arrivals;     // time between the reads of all runs in nanoseconds
+};
+
+// What a sender connection is waiting for next
+enum ConnectionState {
+    STATE_HEADER,   // the TransferHeader
+    STATE_DATA,     // the file itself
+    STATE_COMMAND   // 'R' to send again or 'E' to exit
+};
+
+// State of one sender in the event-driven mode
+struct Connection {
+    int socketfd;
+    int outputfd;
+    int id;
+    char address[INET_ADDRSTRLEN];
+    enum ConnectionState state;
+    struct TransferHeader header;
+    uint64_t received;      // bytes of the header or of the file received so far
+    uint64_t start;         // monotonic clock in nanoseconds
+    uint64_t lastArrival;   // of the run's last read, 0 before the first
+    double cpuStart;
+    struct RunStatistics* runStatistics;    // grows with the runs
+    int numRuns;
+    int runCapacity;
+    Histogram arrivals;     // time between the reads of all runs in nanoseconds
+};
+
+// A worker thread serves its own share of the connections with its own epoll instance
+struct Worker {
+    pthread_t thread;
+    int epollfd;
+    char* buffer;           // one receive buffer for all of its connections
+    const char* outputName;
+    const char* algorithm;
+    const char* csvName;    // runs are appended here, NULL for none
 };
 
 // Function to set the congestion control algorithm for the socket
 void SetCCAlgorithm(int socketfd, char* algo);
 
 // Function to set up the socket for communication
-int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo);
+int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo, const TcpTuning* tuning);
 
 // Function to receive data from the client
 int getDataFromClient(int clientSocket, void *buffer, int len);
@@ -33,27 +146,114 @@ int getDataFromClient(int clientSocket, void *buffer, int len);
 // Function to send data to the client
 int sendData(int clientSocket, void* buffer, int len);
 
-// Function to print statistics for each run
-void printStatistics(struct RunStatistics* statistics, int numRuns);
+// Function to receive exactly len bytes, returns 0 if the sender closed the connection first
+int receiveFull(int clientSocket, void *buffer, int len);
+
+// Function to read a connection's TransferHeader, returns -1 if the sender closed it first
+int receiveHeader(int clientSocket, struct TransferHeader* header);
+
+// Function to answer a sender that asks for compression or delta runs, the codec only if it asked for that one
+int answerOptions(int clientSocket, const struct TransferHeader* header, int codec, int delta, struct TransferAnswer* answer);
+
+// Function to move len bytes from the socket into the file at offset through a pipe with splice()
+int64_t receiveSplice(int clientSocket, int filefd, int pipefd[2], uint64_t offset, uint64_t len, Histogram* arrivals);
+
+// Function to move len bytes from the socket into the file at offset through the ring buffer
+uint64_t receiveRing(int clientSocket, int filefd, struct RingBuffer* ring, uint64_t offset, uint64_t len, Histogram* arrivals);
+
+// Function to receive len bytes of the file as frames and write what they restore into the file at offset
+uint64_t receiveCompressed(int clientSocket, int filefd, CompressDecoder* decoder, char* frameBuffer, uint64_t offset, uint64_t len, Histogram* arrivals);
+
+// Function to send the hashes of the part of the file and write the changed blocks the sender answers with
+uint64_t receiveDelta(int clientSocket, int filefd, DeltaTable* table, char* buffer, Histogram* arrivals);
+
+// Function to receive one run of a connection's part of the file, the thread body of striped transfers
+void* receiveRange(void* arg);
+
+// Function to write the whole buffer to the file at offset
+void writeAll(int filefd, const char* buffer, size_t len, uint64_t offset);
+
+// Function to open the destination file, returns -1 if the file can't hold fileSize bytes
+int openOutput(const char* outputName, uint64_t fileSize);
+
+// Function to accept senders and hand them to worker threads that serve them with epoll
+int serveEpoll(int socketfd, int numWorkers, const char* outputName, const char* algorithm, const char* csvName);
+
+// Function to print the mean, spread and tail of the runs
+void printStatistics(struct RunStatistics* statistics, int numRuns, const Histogram* arrivals);
 
 // Function to calculate time and speed for a run
-void calcTime(int fileSize, struct timeval start, struct RunStatistics* runStatistics, int numRuns);
+void calcTime(uint64_t fileSize, uint64_t start, double cpuStart, struct RunStatistics* runStatistics, int numRuns);
+
+// Function to get the CPU time (user + system) the calling thread used so far in milliseconds
+double cpuTime();
+
+// Global variables
+TcpTuning tuning;   // socket options, the accepted connections inherit them from the listening socket
+int codec = COMPRESS_DEFLATE;   // compression a sender may ask for
 
 // Main function
 int main(int argc, char *argv[]) {
     // Check command line arguments
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s -p <port> -algo <algorithm>\n", argv[0]);
+    if (argc < 5 || argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s -p <port> -algo <algorithm> [-o <output file>] [-workers <threads>] [-mode uring|splice|ring] [-compress deflate|off] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>] " TUNING_USAGE "\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    // time statistics variables
-    struct RunStatistics runStatistics[MAX_RUNS];
-    int numRuns = 0;
+    // time statistics variables, they grow with the runs
+    struct RunStatistics* runStatistics = NULL;
+    struct RunStatistics (*streamStatistics)[MAX_STREAMS] = NULL;
+    int numRuns = 0,
+        runCapacity = 0,
+        streamCapacity = 0;
 
     // Parse command line arguments
-    int port = atoi(argv[2]);
-    char *algorithm = argv[4];
+    int port = 0;
+    char *algorithm = NULL;
+    char *outputName = DEFAULT_OUTPUT;
+    int workers = 0;
+    int mode = MODE_SPLICE;
+    char *csvName = NULL;
+    char *statsName = NULL;
+    int statsInterval = COUNTERS_DEFAULT_INTERVAL;
+    tuning_init(&tuning);
+    for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "-p") == 0) {
+            port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-algo") == 0) {
+            algorithm = argv[i + 1];
+        } else if (strcmp(argv[i], "-o") == 0) {
+            outputName = argv[i + 1];
+        } else if (strcmp(argv[i], "-workers") == 0) {
+            workers = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-mode") == 0 && strcmp(argv[i + 1], "uring") == 0) {
+            mode = MODE_URING;
+        } else if (strcmp(argv[i], "-mode") == 0 && strcmp(argv[i + 1], "splice") == 0) {
+            mode = MODE_SPLICE;
+        } else if (strcmp(argv[i], "-mode") == 0 && strcmp(argv[i + 1], "ring") == 0) {
+            mode = MODE_RING;
+        } else if (strcmp(argv[i], "-compress") == 0 && compress_parse(argv[i + 1]) >= 0) {
+            codec = compress_parse(argv[i + 1]);
+        } else if (strcmp(argv[i], "-csv") == 0) {
+            csvName = argv[i + 1];
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            statsName = argv[i + 1];
+        } else if (strcmp(argv[i], "-stats-ms") == 0) {
+            statsInterval = atoi(argv[i + 1]);
+        } else if (!tuning_parse(&tuning, argv[i], argv[i + 1])) {
+            fprintf(stderr, "Usage: %s -p <port> -algo <algorithm> [-o <output file>] [-workers <threads>] [-mode uring|splice|ring] [-compress deflate|off] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>] " TUNING_USAGE "\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (algorithm == NULL) {
+        fprintf(stderr, "Usage: %s -p <port> -algo <algorithm> [-o <output file>] [-workers <threads>] [-mode uring|splice|ring] [-compress deflate|off] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>] " TUNING_USAGE "\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Live counters, on SIGUSR1 and in the stats file
+    if (counters_start(statsName, statsInterval) == -1) {
+        exit(1);
+    }
 
     // Socket and address variables
     int clientSocket = -1;
@@ -61,84 +261,213 @@ int main(int argc, char *argv[]) {
     socklen_t clientAddrLen = sizeof(clientAddr);
 
     char clientAddress[INET_ADDRSTRLEN];
-    char* buffer = NULL;
 
     //data releated variables
-    int fileSize,
-        totalReceived = 0,
-        socketfd = -1;
+    uint64_t fileSize = 0;
+    int socketfd = -1,
+        outputfd = -1,
+        numStreams = 1;
+    struct TransferHeader header;
+    struct ReceiveStream streams[MAX_STREAMS];
 
     printf("Starting Receiver...\n");
 
     // Set up the socket
-    socketfd = socketSetup(&serverAddr, port, algorithm);
-
-    // Accept connection from the sender
-    memset(&clientAddress, 0, sizeof(clientAddress));
-    clientSocket = accept(socketfd, (struct sockaddr *) &clientAddr, &clientAddrLen);
+    socketfd = socketSetup(&serverAddr, port, algorithm, &tuning);
 
-    if (clientSocket == -1) {
-        perror("accept");
-        exit(1);
+    // Serve many senders at once, each into its own numbered output file
+    if (workers > 0) {
+        return serveEpoll(socketfd, workers < MAX_WORKERS ? workers : MAX_WORKERS, outputName, algorithm, csvName);
     }
-    printf("Sender connected, beginning to receive file...\n");
 
-    // Get sender's IP address
-    inet_ntop(AF_INET, &(clientAddr.sin_addr), clientAddress, INET_ADDRSTRLEN);
+    // Accept the connections of the sender, a striped transfer has several
+    memset(streams, 0, sizeof(streams));
+    for (int connected = 0; connected < numStreams; ) {
+        memset(&clientAddress, 0, sizeof(clientAddress));
+        clientSocket = accept(socketfd, (struct sockaddr *) &clientAddr, &clientAddrLen);
+
+        if (clientSocket == -1) {
+            perror("accept");
+            exit(1);
+        }
+
+        // Get sender's IP address
+        inet_ntop(AF_INET, &(clientAddr.sin_addr), clientAddress, INET_ADDRSTRLEN);
+
+        // Receive the size and the part of the file this connection carries
+        struct TransferHeader streamHeader;
+        if (receiveHeader(clientSocket, &streamHeader) == -1) {
+            printf("Sender closed the connection before sending the size.\n");
+            exit(1);
+        }
+        struct TransferAnswer answer;
+        if (answerOptions(clientSocket, &streamHeader, codec, 1, &answer) == -1) {
+            exit(1);
+        }
 
-    // Receive expected file size from the sender
-    getDataFromClient(clientSocket, &fileSize, sizeof(int));
+        // The first connection tells how many belong to the transfer
+        if (!connected) {
+            header = streamHeader;
+            fileSize = header.fileSize;
+            numStreams = header.streamCount;
+            if (numStreams < 1 || numStreams > MAX_STREAMS) {
+                printf("Sender asked for %d connections, at most %d are supported.\n", numStreams, MAX_STREAMS);
+                exit(1);
+            }
+            printf("Sender connected, beginning to receive file...\n");
+            tuning_print(clientSocket);
+            printf("Expected file size is %llu bytes.\n", (unsigned long long) fileSize);
+            if (answer.codec != COMPRESS_NONE) {
+                printf("Compression: %s\n", compress_name(answer.codec));
+            }
+            if (answer.delta) {
+                printf("Delta runs: the runs after the first send the changed blocks only\n");
+            }
+        }
 
-    printf("Expected file size is %d bytes.\n", fileSize);
+        int index = streamHeader.streamIndex;
+        if (streamHeader.transferId != header.transferId || streamHeader.fileSize != fileSize ||
+            index >= numStreams || streams[index].socketfd != 0 ||
+            streamHeader.offset > fileSize || streamHeader.length > fileSize - streamHeader.offset) {
+            printf("Connection from %s doesn't belong to the transfer, closing it.\n", clientAddress);
+            close(clientSocket);
+            continue;
+        }
 
-    // Allocate memory for the file data
-    buffer = malloc(fileSize * sizeof(char));
+        streams[index].socketfd = clientSocket;
+        streams[index].offset = streamHeader.offset;
+        streams[index].length = streamHeader.length;
+        streams[index].codec = answer.codec;
+        streams[index].delta = answer.delta;
+        connected++;
+    }
+    if (numStreams > 1) {
+        printf("Receiving over %d connections.\n", numStreams);
+    }
 
-    if (buffer == NULL) {
-        perror("malloc");
+    // Open the destination file, the size from the network has to fit on its file system
+    if ((outputfd = openOutput(outputName, fileSize)) == -1) {
         exit(1);
     }
 
+    // Memory stays at the io_uring buffers, the pipes or the ring buffers whatever the file size
+    for (int i = 0; i < numStreams; i++) {
+        streams[i].outputfd = outputfd;
+        streams[i].useUring = mode == MODE_URING && uring_open(&streams[i].uring, streams[i].socketfd, outputfd, RECEIVE_CHUNK_SIZE) == 0;
+        if (mode == MODE_URING && !streams[i].useUring) {
+            printf("io_uring isn't available, using splice()\n");
+        }
+        streams[i].useSplice = mode != MODE_RING && pipe(streams[i].pipefd) == 0;
+        if (streams[i].useSplice) {
+            fcntl(streams[i].pipefd[1], F_SETPIPE_SZ, RECEIVE_CHUNK_SIZE);  // best effort, pipe-max-size may be lower
+        } else {
+            streams[i].pipefd[0] = streams[i].pipefd[1] = -1;
+        }
+        streams[i].ring.size = RING_SIZE;
+        hist_init(&streams[i].arrivals);
+
+        // Frames are taken apart in user space whatever the mode
+        if (streams[i].codec != COMPRESS_NONE) {
+            streams[i].frameBuffer = malloc(2 * COMPRESS_BLOCK_SIZE);
+            if (streams[i].frameBuffer == NULL || compress_decoderInit(&streams[i].decoder, streams[i].codec) == -1) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+
+        // The copy of the last run stays, later runs only overwrite what changed
+        if (streams[i].delta) {
+            streams[i].deltaBuffer = malloc(DELTA_BLOCK_SIZE);
+            if (streams[i].deltaBuffer == NULL || delta_init(&streams[i].table, streams[i].offset, streams[i].length) == -1) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+    }
+
     _Bool continueReceiving = true;
-    
+    uint64_t start;
+
     while (continueReceiving) {
-        int BytesReceived;
+        // Every run rewrites the destination file, striped connections fill it in any order.
+        // A delta run keeps it and overwrites the changed blocks
+        bool deltaRun = streams[0].delta && numRuns > 0;
+        for (int i = 0; i < numStreams; i++) {
+            streams[i].deltaRun = deltaRun;
+        }
+        if (!deltaRun && ftruncate(outputfd, numStreams > 1 ? fileSize : 0) == -1) {
+            perror("ftruncate");
+            exit(1);
+        }
 
-        if (!totalReceived) {
-            memset(buffer, 0, fileSize);
+        start = hist_now();
+
+        // Receive data from the sender straight into the file
+        if (numStreams == 1) {
+            streams[0].start = start;
+            receiveRange(&streams[0]);
+        } else {
+            for (int i = 0; i < numStreams; i++) {
+                streams[i].start = start;
+                if (pthread_create(&streams[i].thread, NULL, receiveRange, &streams[i]) != 0) {
+                    perror("pthread_create");
+                    exit(1);
+                }
+            }
+            for (int i = 0; i < numStreams; i++) {
+                pthread_join(streams[i].thread, NULL);
+            }
         }
 
-        struct timeval start;
-        gettimeofday(&start, NULL);  // Initialize start time
+        uint64_t totalReceived = 0;
+        bool complete = true;
+        for (int i = 0; i < numStreams; i++) {
+            totalReceived += streams[i].received;
+            complete = complete && streams[i].received == streams[i].length;
+        }
+        if (!complete) {
+            printf("Sender closed the connection after %llu bytes.\n", (unsigned long long) totalReceived);
+            break;
+        }
+
+        if ((runStatistics = report_grow(runStatistics, numRuns, &runCapacity, sizeof(*runStatistics))) == NULL ||
+            (streamStatistics = report_grow(streamStatistics, numRuns, &streamCapacity, sizeof(*streamStatistics))) == NULL) {
+            exit(1);
+        }
+
+        // The run took as long as its slowest connection, its CPU time is the sum of theirs
+        double time = 0, cpu = 0;
+        for (int i = 0; i < numStreams; i++) {
+            streamStatistics[numRuns][i] = streams[i].statistics;
+            time = streams[i].statistics.time > time ? streams[i].statistics.time : time;
+            cpu += streams[i].statistics.cpu * (streams[i].length / 1e9);
+        }
+        runStatistics[numRuns].time = time;
+        runStatistics[numRuns].speed = (fileSize / time) * 1000.0 / (1024 * 1024);
+        runStatistics[numRuns].cpu = fileSize ? cpu / (fileSize / 1e9) : 0;
+        numRuns++;
+
+        if (csvName != NULL) {
+            RunReport report = {"tcp", "receiver", algorithm, fileSize, numRuns, runStatistics[numRuns - 1].time,
+                                runStatistics[numRuns - 1].speed, runStatistics[numRuns - 1].cpu, -1};
+            report_run(csvName, &report);
+        }
 
-        // Receive data from the sender
-        BytesReceived = getDataFromClient(clientSocket, buffer + totalReceived, fileSize - totalReceived);
-        totalReceived += BytesReceived;
+        printf("File transfer completed, Received total %llu bytes into \"%s\".\n", (unsigned long long) totalReceived, outputName);
 
-        if (!BytesReceived) {
+        // Get the sender's response, it comes on every connection
+        printf("Waiting for sender decision...\n");
+        char exitCommand = 'E';
+        for (int i = 0; i < numStreams; i++) {
+            getDataFromClient(streams[i].socketfd, &exitCommand, sizeof(char));
+        }
+
+        if (exitCommand == 'E') {
+            printf("Sender wants to exit\n");
+            continueReceiving = false;
             break;
-        } else if (totalReceived == fileSize) {
-
-            // Calculate the time for the packet
-            calcTime(fileSize, start, runStatistics, numRuns);
-            numRuns++;
-
-            printf("File transfer completed, Received total %d bytes.\n", totalReceived);
-
-            // Get the sender's response
-            printf("Waiting for sender decision...\n");
-            char exitCommand;
-            getDataFromClient(clientSocket, &exitCommand, sizeof(char));
-
-            if (exitCommand == 'E') {
-                printf("Sender wants to exit\n");
-                continueReceiving = false;
-                break;
-            } else if (exitCommand == 'R') {
-                printf("Sender is sending again\n");
-                totalReceived = 0;
-                gettimeofday(&start, NULL);  // Reset start time for the new run
-            }
+        } else if (exitCommand == 'R') {
+            printf("Sender is sending again\n");
         }
     }
 
@@ -147,16 +476,53 @@ int main(int argc, char *argv[]) {
     printf("- * Statistics * -\n");
 
     for (int i = 0; i < numRuns; i++) {
-        printf("- Run #%d Data: Time=%.2fms; Speed=%.2fMB/s\n", i + 1, runStatistics[i].time, runStatistics[i].speed);
+        printf("- Run #%d Data: Time=%.2fms; Speed=%.2fMB/s; CPU=%.2fms/GB\n", i + 1, runStatistics[i].time, runStatistics[i].speed, runStatistics[i].cpu);
+        for (int j = 0; numStreams > 1 && j < numStreams; j++) {
+            printf("-   Stream #%d: Time=%.2fms; Speed=%.2fMB/s; CPU=%.2fms/GB\n", j + 1,
+                   streamStatistics[i][j].time, streamStatistics[i][j].speed, streamStatistics[i][j].cpu);
+        }
     }
 
-    // Calculate and print averages
-    printStatistics(runStatistics, numRuns);
+    // Calculate and print averages and the tail, the reads of all connections together
+    for (int i = 1; i < numStreams; i++) {
+        hist_merge(&streams[0].arrivals, &streams[i].arrivals);
+    }
+    printStatistics(runStatistics, numRuns, &streams[0].arrivals);
+    if (streams[0].delta) {
+        for (int i = 1; i < numStreams; i++) {
+            streams[0].table.checkedBlocks += streams[i].table.checkedBlocks;
+            streams[0].table.changedBlocks += streams[i].table.changedBlocks;
+            streams[0].table.coveredBytes += streams[i].table.coveredBytes;
+            streams[0].table.changedBytes += streams[i].table.changedBytes;
+        }
+        printf("- ");
+        delta_print(&streams[0].table);
+    }
 
     printf("----------------------------------\n");
-    close(clientSocket);
+    for (int i = 0; i < numStreams; i++) {
+        close(streams[i].socketfd);
+        if (streams[i].pipefd[0] != -1) {
+            close(streams[i].pipefd[0]);
+            close(streams[i].pipefd[1]);
+        }
+        free(streams[i].ring.data);
+        if (streams[i].delta) {
+            delta_free(&streams[i].table);
+            free(streams[i].deltaBuffer);
+        }
+        if (streams[i].codec != COMPRESS_NONE) {
+            compress_decoderFree(&streams[i].decoder);
+            free(streams[i].frameBuffer);
+        }
+        if (streams[i].useUring) {
+            uring_close(&streams[i].uring);
+        }
+    }
+    free(runStatistics);
+    free(streamStatistics);
     close(socketfd);
-    free(buffer);
+    close(outputfd);
     printf("Receiver end.\n");
     return 0;
 }
@@ -179,6 +545,7 @@ int sendData(int clientSocket, void* buffer, int len) {
 // Function to receive data from the client
 int getDataFromClient(int clientSocket, void *buffer, int len) {
     int recvb = recv(clientSocket, buffer, len, 0);
+    counters_add(COUNTER_RECEIVE_CALLS, 1);
 
     if (recvb == -1) {
         perror("recv");
@@ -190,8 +557,547 @@ int getDataFromClient(int clientSocket, void *buffer, int len) {
     return recvb;
 }
 
+// Function to receive exactly len bytes, returns 0 if the sender closed the connection first
+int receiveFull(int clientSocket, void *buffer, int len) {
+    int received = 0;
+
+    while (received < len) {
+        int got = getDataFromClient(clientSocket, (char *) buffer + received, len - received);
+        if (!got) {
+            return 0;
+        }
+        received += got;
+    }
+
+    return 1;
+}
+
+// Function to read a connection's TransferHeader, returns -1 if the sender closed it first
+int receiveHeader(int clientSocket, struct TransferHeader* header) {
+    if (!receiveFull(clientSocket, header, sizeof(*header))) {
+        return -1;
+    }
+
+    header->fileSize = be64toh(header->fileSize);
+    header->offset = be64toh(header->offset);
+    header->length = be64toh(header->length);
+    header->transferId = ntohl(header->transferId);
+    header->streamIndex = ntohs(header->streamIndex);
+    header->streamCount = ntohs(header->streamCount);
+    return 0;
+}
+
+// Function to answer a sender that asks for compression or delta runs, the codec only if it asked for that one
+int answerOptions(int clientSocket, const struct TransferHeader* header, int codec, int delta, struct TransferAnswer* answer) {
+    answer->codec = header->codec != COMPRESS_NONE && header->codec == codec ? codec : COMPRESS_NONE;
+    answer->delta = header->delta && delta;
+    if (header->codec == COMPRESS_NONE && !header->delta) {
+        return 0;
+    }
+
+    if (send(clientSocket, answer, sizeof(*answer), 0) != sizeof(*answer)) {
+        perror("send");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to receive one run of a connection's part of the file, the thread body of striped transfers
+void* receiveRange(void* arg) {
+    struct ReceiveStream* stream = arg;
+    double cpuStart = cpuTime();
+
+    int64_t received = -1;
+    if (stream->deltaRun) {
+        received = receiveDelta(stream->socketfd, stream->outputfd, &stream->table, stream->deltaBuffer, &stream->arrivals);
+    } else if (stream->codec != COMPRESS_NONE) {
+        received = receiveCompressed(stream->socketfd, stream->outputfd, &stream->decoder, stream->frameBuffer,
+                                     stream->offset, stream->length, &stream->arrivals);
+    }
+    if (received < 0 && stream->useUring && (received = uring_receive(&stream->uring, stream->offset, stream->length)) < 0) {
+        printf("io_uring can't receive here, using splice()\n");
+        uring_close(&stream->uring);
+        stream->useUring = false;
+    }
+
+    if (received < 0 && stream->useSplice &&
+        (received = receiveSplice(stream->socketfd, stream->outputfd, stream->pipefd, stream->offset, stream->length, &stream->arrivals)) < 0) {
+        printf("splice() isn't supported here, using the ring buffer\n");
+        stream->useSplice = false;
+    }
+
+    if (received < 0) {
+        if (stream->ring.data == NULL && (stream->ring.data = malloc(stream->ring.size)) == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        received = receiveRing(stream->socketfd, stream->outputfd, &stream->ring, stream->offset, stream->length, &stream->arrivals);
+    }
+    stream->received = received;
+    counters_add(COUNTER_GOODPUT_BYTES, received);
+
+    calcTime(stream->length, stream->start, cpuStart, &stream->statistics, 0);
+    return NULL;
+}
+
+// Function to move len bytes from the socket into the file at offset through a pipe with splice()
+// Returns -1 if splice() isn't supported before anything was moved, otherwise the bytes moved
+int64_t receiveSplice(int clientSocket, int filefd, int pipefd[2], uint64_t offset, uint64_t len, Histogram* arrivals) {
+    uint64_t received = 0, lastArrival = 0;
+    loff_t fileOffset = offset;
+
+    while (received < len) {
+        size_t want = len - received < RECEIVE_CHUNK_SIZE ? len - received : RECEIVE_CHUNK_SIZE;
+        ssize_t in = splice(clientSocket, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        counters_add(COUNTER_RECEIVE_CALLS, 1);
+        tuning_quickAck(clientSocket, &tuning);
+
+        if (in == -1 && errno == EINTR) {
+            continue;
+        } else if (in == -1 && !received && (errno == EINVAL || errno == ENOSYS)) {
+            return -1;
+        } else if (in == -1) {
+            perror("splice");
+            exit(1);
+        } else if (!in) {
+            break;
+        }
+        received += in;
+        uint64_t now = hist_now();
+        if (lastArrival) {
+            hist_record(arrivals, now - lastArrival);
+        }
+        lastArrival = now;
+
+        // Drain the pipe into the file before reading more
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, filefd, &fileOffset, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out == -1 && errno == EINTR) {
+                continue;
+            } else if (out == -1) {
+                perror("splice");
+                exit(1);
+            }
+            in -= out;
+        }
+    }
+
+    return received;
+}
+
+// Function to move len bytes from the socket into the file at offset through the ring buffer
+uint64_t receiveRing(int clientSocket, int filefd, struct RingBuffer* ring, uint64_t offset, uint64_t len, Histogram* arrivals) {
+    uint64_t received = 0, lastArrival = 0;
+    bool senderClosed = false;
+    ring->head = ring->tail = 0;
+
+    while (ring->head != ring->tail || (received < len && !senderClosed)) {
+        uint64_t used = ring->head - ring->tail;
+
+        // Fill the free space up to the end of the ring
+        if (received < len && !senderClosed && used < ring->size) {
+            size_t position = ring->head % ring->size;
+            size_t room = ring->size - used < ring->size - position ? ring->size - used : ring->size - position;
+            if (room > len - received) {
+                room = len - received;
+            }
+
+            int got = getDataFromClient(clientSocket, ring->data + position, room);
+            tuning_quickAck(clientSocket, &tuning);
+            if (!got) {
+                senderClosed = true;
+            } else {
+                uint64_t now = hist_now();
+                if (lastArrival) {
+                    hist_record(arrivals, now - lastArrival);
+                }
+                lastArrival = now;
+            }
+            ring->head += got;
+            received += got;
+            used += got;
+        }
+
+        // Write out once half the ring is used, or whatever is left at the end
+        if (used >= ring->size / 2 || received == len || senderClosed) {
+            size_t position = ring->tail % ring->size;
+            size_t length = used < ring->size - position ? used : ring->size - position;
+            writeAll(filefd, ring->data + position, length, offset + ring->tail);
+            ring->tail += length;
+        }
+    }
+
+    return received;
+}
+
+// Function to receive len bytes of the file as frames and write what they restore into the file at offset
+uint64_t receiveCompressed(int clientSocket, int filefd, CompressDecoder* decoder, char* frameBuffer, uint64_t offset, uint64_t len, Histogram* arrivals) {
+    uint64_t received = 0, lastArrival = 0;
+    char* raw = frameBuffer + COMPRESS_BLOCK_SIZE;
+
+    while (received < len) {
+        CompressFrame frame;
+        if (!receiveFull(clientSocket, &frame, sizeof(frame))) {
+            break;
+        }
+        frame.rawLength = ntohl(frame.rawLength);
+        frame.wireLength = ntohl(frame.wireLength);
+        if (compress_checkFrame(&frame, len - received) == -1) {
+            printf("Sender sent a damaged frame header.\n");
+            exit(1);
+        }
+
+        // A stored frame goes straight to where the restored bytes would be
+        char* wire = frame.wireLength == frame.rawLength ? raw : frameBuffer;
+        if (!receiveFull(clientSocket, wire, frame.wireLength)) {
+            break;
+        }
+        tuning_quickAck(clientSocket, &tuning);
+        uint64_t now = hist_now();
+        if (lastArrival) {
+            hist_record(arrivals, now - lastArrival);
+        }
+        lastArrival = now;
+
+        if (compress_decode(decoder, &frame, wire, raw) == -1) {
+            printf("The frame at byte %llu doesn't decompress.\n", (unsigned long long) (offset + received));
+            exit(1);
+        }
+        writeAll(filefd, raw, frame.rawLength, offset + received);
+        received += frame.rawLength;
+    }
+
+    return received;
+}
+
+// Function to send the hashes of the part of the file and write the changed blocks the sender answers with
+uint64_t receiveDelta(int clientSocket, int filefd, DeltaTable* table, char* buffer, Histogram* arrivals) {
+    uint64_t lastArrival = 0;
+
+    // the file as it is now, whatever happened to it since the last run
+    if (delta_hashFile(table, filefd) == -1) {
+        exit(1);
+    }
+    size_t sent = 0;
+    while (sent < delta_tableSize(table)) {
+        ssize_t sentd = send(clientSocket, table->hashes + sent, delta_tableSize(table) - sent, 0);
+        if (sentd <= 0) {
+            perror("send");
+            return 0;
+        }
+        sent += sentd;
+    }
+
+    while (1) {
+        DeltaRecord record;
+        if (!receiveFull(clientSocket, &record, sizeof(record))) {
+            return 0;
+        }
+        record.offset = be64toh(record.offset);
+        record.length = be64toh(record.length);
+        int kind = delta_checkRecord(&record, table->offset, table->length);
+        if (kind == -1) {
+            printf("Sender sent a block outside of its part of the file.\n");
+            exit(1);
+        }
+        if (kind == 1) {
+            table->checkedBlocks += table->blocks;
+            table->coveredBytes += record.length;
+            return record.length;
+        }
+
+        if (!receiveFull(clientSocket, buffer, record.length)) {
+            return 0;
+        }
+        tuning_quickAck(clientSocket, &tuning);
+        uint64_t now = hist_now();
+        if (lastArrival) {
+            hist_record(arrivals, now - lastArrival);
+        }
+        lastArrival = now;
+        writeAll(filefd, buffer, record.length, record.offset);
+        table->changedBlocks++;
+        table->changedBytes += record.length;
+    }
+}
+
+// Function to write the whole buffer to the file at offset
+void writeAll(int filefd, const char* buffer, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t written = pwrite(filefd, buffer, len, offset);
+        if (written == -1 && errno == EINTR) {
+            continue;
+        } else if (written == -1) {
+            perror("write");
+            exit(1);
+        }
+        buffer += written;
+        offset += written;
+        len -= written;
+    }
+}
+
+// Function to open the destination file, returns -1 if the file can't hold fileSize bytes
+int openOutput(const char* outputName, uint64_t fileSize) {
+    struct statvfs fileSystem;
+    // read and write, delta runs hash what the last run left
+    int outputfd = open(outputName, O_RDWR | O_CREAT, 0644);
+
+    if (outputfd == -1 || fstatvfs(outputfd, &fileSystem) == -1) {
+        perror("open");
+        if (outputfd != -1) {
+            close(outputfd);
+        }
+        return -1;
+    }
+
+    // the size comes from the network, it has to fit on the file system
+    if (fileSize > (uint64_t) fileSystem.f_bavail * fileSystem.f_frsize) {
+        printf("Not enough space for %llu bytes in \"%s\", refusing the file.\n", (unsigned long long) fileSize, outputName);
+        close(outputfd);
+        return -1;
+    }
+
+    return outputfd;
+}
+
+// Print what a sender transferred once it's gone, a block at a time so threads don't interleave
+static void closeConnection(struct Connection* conn) {
+    flockfile(stdout);
+    printf("----------------------------------\n");
+    if (conn->header.streamCount > 1) {
+        printf("- * Statistics of sender #%d (%s), connection %d of %d of transfer %u * -\n", conn->id, conn->address,
+               conn->header.streamIndex + 1, conn->header.streamCount, conn->header.transferId);
+    } else {
+        printf("- * Statistics of sender #%d (%s) * -\n", conn->id, conn->address);
+    }
+    for (int i = 0; i < conn->numRuns; i++) {
+        printf("- Run #%d Data: Time=%.2fms; Speed=%.2fMB/s; CPU=%.2fms/GB\n", i + 1,
+               conn->runStatistics[i].time, conn->runStatistics[i].speed, conn->runStatistics[i].cpu);
+    }
+    printStatistics(conn->runStatistics, conn->numRuns, &conn->arrivals);
+    printf("----------------------------------\n");
+    funlockfile(stdout);
+
+    close(conn->socketfd);  // also removes it from the epoll instance
+    if (conn->outputfd != -1) {
+        close(conn->outputfd);
+    }
+    free(conn->runStatistics);
+    free(conn);
+}
+
+// Record a finished run and wait for the sender's next command
+static int finishRun(struct Worker* worker, struct Connection* conn) {
+    if ((conn->runStatistics = report_grow(conn->runStatistics, conn->numRuns, &conn->runCapacity, sizeof(struct RunStatistics))) == NULL) {
+        return -1;
+    }
+    calcTime(conn->header.length, conn->start, conn->cpuStart, conn->runStatistics, conn->numRuns);
+    conn->numRuns++;
+    if (worker->csvName != NULL) {
+        RunReport report = {"tcp", "receiver", worker->algorithm, conn->header.length, conn->numRuns,
+                            conn->runStatistics[conn->numRuns - 1].time, conn->runStatistics[conn->numRuns - 1].speed,
+                            conn->runStatistics[conn->numRuns - 1].cpu, -1};
+        report_run(worker->csvName, &report);
+    }
+    conn->state = STATE_COMMAND;
+    return 0;
+}
+
+// Start timing a run and rewrite the output file, the connections of a striped transfer share it
+static int startRun(struct Worker* worker, struct Connection* conn) {
+    if (ftruncate(conn->outputfd, conn->header.streamCount > 1 ? conn->header.fileSize : 0) == -1) {
+        perror("ftruncate");
+        return -1;
+    }
+    conn->state = STATE_DATA;
+    conn->received = 0;
+    conn->lastArrival = 0;
+    conn->start = hist_now();
+    conn->cpuStart = cpuTime();
+    // an empty range has no data to wait for, a zero length recv() would read as the sender leaving
+    if (conn->header.length == 0) {
+        return finishRun(worker, conn);
+    }
+    return 0;
+}
+
+// Advance a connection's state machine with whatever the socket has, returns -1 once it's done
+static int handleConnection(struct Worker* worker, struct Connection* conn) {
+    uint64_t want = conn->state == STATE_HEADER ? sizeof(conn->header) - conn->received :
+                    conn->state == STATE_DATA ? conn->header.length - conn->received : 1;
+    if (want > RECEIVE_CHUNK_SIZE) {
+        want = RECEIVE_CHUNK_SIZE;
+    }
+
+    ssize_t got = recv(conn->socketfd, worker->buffer, want, 0);
+    counters_add(COUNTER_RECEIVE_CALLS, 1);
+    tuning_quickAck(conn->socketfd, &tuning);
+    if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    } else if (got == -1) {
+        perror("recv");
+        return -1;
+    } else if (!got) {
+        if (conn->state != STATE_COMMAND) {
+            printf("Sender #%d closed the connection in the middle of a transfer.\n", conn->id);
+        }
+        return -1;
+    }
+
+    switch (conn->state) {
+        case STATE_HEADER:
+            memcpy((char *) &conn->header + conn->received, worker->buffer, got);
+            conn->received += got;
+            if (conn->received < sizeof(conn->header)) {
+                return 0;
+            }
+            conn->header.fileSize = be64toh(conn->header.fileSize);
+            conn->header.offset = be64toh(conn->header.offset);
+            conn->header.length = be64toh(conn->header.length);
+            conn->header.transferId = ntohl(conn->header.transferId);
+            conn->header.streamIndex = ntohs(conn->header.streamIndex);
+            conn->header.streamCount = ntohs(conn->header.streamCount);
+
+            // The workers take the whole file every run as it comes, a sender that asks for more is told so
+            struct TransferAnswer answer;
+            if (answerOptions(conn->socketfd, &conn->header, COMPRESS_NONE, 0, &answer) == -1) {
+                return -1;
+            }
+            if (conn->header.offset > conn->header.fileSize || conn->header.length > conn->header.fileSize - conn->header.offset) {
+                printf("Sender #%d sent a range outside of its file.\n", conn->id);
+                return -1;
+            }
+
+            // The connections of a striped transfer write into one file named after the transfer
+            char outputName[256];
+            if (conn->header.streamCount > 1) {
+                snprintf(outputName, sizeof(outputName), "%s.t%u", worker->outputName, conn->header.transferId);
+            } else {
+                snprintf(outputName, sizeof(outputName), "%s.%d", worker->outputName, conn->id);
+            }
+            if ((conn->outputfd = openOutput(outputName, conn->header.fileSize)) == -1) {
+                return -1;
+            }
+            return startRun(worker, conn);
+
+        case STATE_DATA: {
+            uint64_t now = hist_now();
+            if (conn->lastArrival) {
+                hist_record(&conn->arrivals, now - conn->lastArrival);
+            }
+            conn->lastArrival = now;
+            counters_add(COUNTER_GOODPUT_BYTES, got);
+            writeAll(conn->outputfd, worker->buffer, got, conn->header.offset + conn->received);
+            conn->received += got;
+            if (conn->received == conn->header.length) {
+                return finishRun(worker, conn);
+            }
+            return 0;
+        }
+
+        case STATE_COMMAND:
+            if (worker->buffer[0] == 'R') {
+                return startRun(worker, conn);
+            }
+            return -1;
+    }
+
+    return -1;
+}
+
+// Worker thread: wait for readable connections and step their state machines
+static void* workerLoop(void* arg) {
+    struct Worker* worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int ready = epoll_wait(worker->epollfd, events, MAX_EVENTS, -1);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        } else if (ready == -1) {
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < ready; i++) {
+            struct Connection* conn = events[i].data.ptr;
+            if (handleConnection(worker, conn) < 0) {
+                closeConnection(conn);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Function to accept senders and hand them to worker threads that serve them with epoll
+int serveEpoll(int socketfd, int numWorkers, const char* outputName, const char* algorithm, const char* csvName) {
+    struct Worker workers[MAX_WORKERS];
+    int nextId = 0;
+
+    // The server runs until it's killed, don't keep its log in a buffer
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    for (int i = 0; i < numWorkers; i++) {
+        workers[i].epollfd = epoll_create1(0);
+        workers[i].buffer = malloc(RECEIVE_CHUNK_SIZE);
+        workers[i].outputName = outputName;
+        workers[i].algorithm = algorithm;
+        workers[i].csvName = csvName;
+        if (workers[i].epollfd == -1 || workers[i].buffer == NULL) {
+            perror("epoll_create1");
+            exit(1);
+        }
+        if (pthread_create(&workers[i].thread, NULL, workerLoop, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    printf("Serving senders with %d worker thread(s), files go to \"%s.<sender>\"\n", numWorkers, outputName);
+
+    // Connections are spread over the workers round robin, each stays on its worker
+    while (true) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        int clientSocket = accept4(socketfd, (struct sockaddr *) &clientAddr, &clientAddrLen, SOCK_NONBLOCK);
+        if (clientSocket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept");
+            exit(1);
+        }
+
+        struct Connection* conn = calloc(1, sizeof(struct Connection));
+        if (conn == NULL) {
+            perror("calloc");
+            close(clientSocket);
+            continue;
+        }
+        conn->socketfd = clientSocket;
+        conn->outputfd = -1;
+        conn->id = ++nextId;
+        hist_init(&conn->arrivals);
+        conn->state = STATE_HEADER;
+        inet_ntop(AF_INET, &(clientAddr.sin_addr), conn->address, INET_ADDRSTRLEN);
+        printf("Sender #%d connected from %s\n", conn->id, conn->address);
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(workers[conn->id % numWorkers].epollfd, EPOLL_CTL_ADD, clientSocket, &event) == -1) {
+            perror("epoll_ctl");
+            close(clientSocket);
+            free(conn);
+        }
+    }
+
+    return 0;
+}
+
 // Function to set up the socket for communication
-int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo) {
+int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo, const TcpTuning* tuning) {
     int socketfd = -1, canReused = 1;
 
     // Initialize server address structure
@@ -212,14 +1118,19 @@ int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo) {
         exit(1);
     }
 
+    // Buffer sizes have to be in place before listen(), they decide the window scale
+    if (tuning_apply(socketfd, tuning) == -1) {
+        exit(1);
+    }
+
     // Bind the socket
     if (bind(socketfd, (struct sockaddr *)serverAddress, sizeof(*serverAddress)) == -1) {
         perror("bind");
         exit(1);
     }
 
-    // Listen for connections
-    if (listen(socketfd, 1) == -1) {
+    // Listen for connections, many senders may connect at once in the event-driven mode
+    if (listen(socketfd, SOMAXCONN) == -1) {
         perror("listen");
         exit(1);
     }
@@ -234,28 +1145,20 @@ int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo) {
 
 // Function to set the congestion control algorithm for the socket
 void SetCCAlgorithm(int socketfd, char* algo) {
-    if (strcmp(algo, "reno") == 0) {
-        socklen_t CC_reno_len = strlen("reno");
-
-        if (setsockopt(socketfd, IPPROTO_TCP, 13, "reno", CC_reno_len) != 0) {
-            perror("setsockopt");
-            exit(1);
-        }
-    } else {
-        socklen_t CC_cubic_len = strlen("cubic");
-
-        if (setsockopt(socketfd, IPPROTO_TCP, 13, "cubic", CC_cubic_len) != 0) {
-            perror("setsockopt");
-            exit(1);
-        }
+    if (tuning_setCongestion(socketfd, algo) == -1) {
+        exit(1);
     }
 }
 
-// Function to print statistics for each run
-void printStatistics(struct RunStatistics* statistics, int numRuns) {
+// Function to print the mean, spread and tail of the runs
+void printStatistics(struct RunStatistics* statistics, int numRuns, const Histogram* arrivals) {
     double totalTime = 0.0;
     double totalSpeed = 0.0;
+    double squares = 0.0;
 
+    if (numRuns == 0) {
+        return;
+    }
     for (int i = 0; i < numRuns; i++) {
         totalTime += statistics[i].time;
         totalSpeed += statistics[i].speed;
@@ -264,19 +1167,32 @@ void printStatistics(struct RunStatistics* statistics, int numRuns) {
     double avgTime = totalTime / numRuns;
     double avgSpeed = totalSpeed / numRuns;
 
+    // sample standard deviation, a slow run stands out against the mean
+    for (int i = 0; i < numRuns; i++) {
+        squares += (statistics[i].speed - avgSpeed) * (statistics[i].speed - avgSpeed);
+    }
+    double stddevSpeed = numRuns > 1 ? sqrt(squares / (numRuns - 1)) : 0.0;
+
     printf("- Average time: %.2fms\n", avgTime);
-    printf("- Average bandwidth: %.2fMB/s\n", avgSpeed);
+    printf("- Average bandwidth: %.2fMB/s (stddev %.2fMB/s)\n", avgSpeed, stddevSpeed);
+    hist_print("Read inter-arrival", arrivals);
 }
 
 // Function to calculate time and speed for a run
-void calcTime(int fileSize, struct timeval start, struct RunStatistics* runStatistics, int numRuns) {
-    struct timeval end;
-    gettimeofday(&end, NULL);
-    double elapsedTime = (end.tv_sec - start.tv_sec) * 1000.0;  // Convert to milliseconds
-    elapsedTime += (end.tv_usec - start.tv_usec) / 1000.0;
+void calcTime(uint64_t fileSize, uint64_t start, double cpuStart, struct RunStatistics* runStatistics, int numRuns) {
+    double elapsedTime = (hist_now() - start) / 1e6;  // Convert to milliseconds
 
     double speed = (fileSize / elapsedTime) * 1000.0 / (1024 * 1024);  // Speed in MB/s
 
     runStatistics[numRuns].time = elapsedTime;
     runStatistics[numRuns].speed = speed;
+    runStatistics[numRuns].cpu = fileSize ? (cpuTime() - cpuStart) / (fileSize / 1e9) : 0;  // a striped connection may carry nothing
+}
+
+// Function to get the CPU time (user + system) the calling thread used so far in milliseconds
+double cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
 }
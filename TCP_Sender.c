@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // RUSAGE_THREAD
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -11,118 +12,649 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "Compression.h"
+#include "Delta.h"
+#include "UringIO.h"
+#include "RunReport.h"
+#include "Histogram.h"
+#include "Counters.h"
+#include "TcpTuning.h"
+
+// ways to put the file on the socket
+#define MODE_COPY 0      // send() the file one mapped chunk at a time
+#define MODE_SENDFILE 1  // sendfile() from the file descriptor, no user space copy
+#define MODE_ZEROCOPY 2  // send() the mapped chunks with MSG_ZEROCOPY
+#define MODE_URING 3     // io_uring reads the next chunks into registered buffers while one is sent
+
+#define MAX_STREAMS 16   // parallel connections of a striped transfer
+
+// Sent on every connection before the data, all fields in network byte order
+struct __attribute__((packed)) TransferHeader {
+    uint64_t fileSize;      // size of the whole file
+    uint64_t offset;        // part of the file this connection carries
+    uint64_t length;
+    uint32_t transferId;    // the same on all connections of a striped transfer
+    uint16_t streamIndex;
+    uint16_t streamCount;
+    uint8_t codec;          // COMPRESS_* the sender asks for
+    uint8_t delta;          // 1 if the runs after the first should carry the changed blocks only
+};
+
+// Sent back on the connection when the sender asks for compression or delta runs
+struct __attribute__((packed)) TransferAnswer {
+    uint8_t codec;          // COMPRESS_* the receiver takes, COMPRESS_NONE if it isn't the one asked for
+    uint8_t delta;          // 1 if the receiver sends the hashes of its copy before every run after the first
+};
+
+// One connection of the transfer and the part of the file it carries
+struct Stream {
+    pthread_t thread;
+    int socketfd;
+    int mode;
+    FileStream file;
+    int codec;              // COMPRESS_* the receiver took
+    CompressPipeline pipeline;  // compresses the next chunks while one is sent, if there is a codec
+    int delta;              // 1 if the runs after the first carry the changed blocks only
+    int deltaRun;           // 1 while such a run is sent
+    DeltaTable table;       // the receiver's hashes of its copy of the part of the file
+    char* deltaBuffer;      // a DeltaRecord and its block
+    UringIO uring;          // set up in MODE_URING only
+    const TcpTuning* tuning;
+    double cpu;             // CPU time the last run took on this connection in milliseconds
+    Histogram roundTrips;   // the kernel's smoothed RTT (tcpi_rtt), read after every chunk, in nanoseconds
+};
 
 // Function to set the congestion control algorithm for the socket
 int SetCCAlgorithm(int socketfd, char* algo);
 
 // Function to set up the socket and return the socket file descriptor
-int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo, char* ip);
+int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo, char* ip, const TcpTuning* tuning);
 
 // Function to send data through the socket
 int sendData(int clientSocket, void* buffer, int len);
 
-// Function to read content from a file and return it along with its size
-char* readFromFile(int* size);
+// Function to send len bytes of the file from offset on with sendfile(), one chunk at a time
+uint64_t sendFile(int socketfd, int filefd, uint64_t offset, uint64_t len, Histogram* roundTrips);
+
+// Function to send a buffer with MSG_ZEROCOPY, returns when the kernel released the buffer
+// copied is set when the kernel had to copy the data after all
+int sendZeroCopy(int socketfd, void* buffer, int len, int* copied);
+
+// Function to stream the file through the socket chunk by chunk, with or without MSG_ZEROCOPY
+uint64_t sendStream(int socketfd, FileStream* stream, int zeroCopy, Histogram* roundTrips);
+
+// Function to send the next chunks of a pipeline as frames while its thread compresses the ones after them
+uint64_t sendCompressed(int socketfd, CompressPipeline* pipeline, Histogram* roundTrips);
+
+// Function to send the blocks of the stream whose hashes differ from the ones the receiver sends first
+uint64_t sendDelta(int socketfd, FileStream* stream, DeltaTable* table, char* buffer, Histogram* roundTrips);
+
+// Function to send one run of a stream's part of the file, the thread body of striped transfers
+void* sendRange(void* arg);
+
+// Function to get the CPU time (user + system) the calling thread used so far in milliseconds
+double cpuTime();
+
+// Function to get the segments the kernel retransmitted on the socket so far
+long long retransmits(int socketfd);
+
+// Function to add the kernel's smoothed round trip time of the socket (tcpi_rtt) to the histogram
+void sampleRoundTrip(int socketfd, Histogram* roundTrips);
 
 // Global variables
 char *fileName = "tosend.txt";
 
 int main(int argc, char *argv[]) {
     // Check command line arguments
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s -a <receiver_ip> -f <file_path>\n", argv[0]);
+    if (argc < 7 || argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s -ip <receiver_ip> -p <port> -algo <algorithm> [-mode copy|sendfile|zerocopy|uring] [-streams <connections>] [-compress deflate|off] [-delta on|off] [-runs <count>] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>] " TUNING_USAGE "\n", argv[0]);
         exit(1);
     }
 
     // Parse command line arguments
-    int port = atoi(argv[4]);
-    char *algorithm = argv[6];
-    char *receiver_ip = argv[2];
+    int port = 0;
+    char *algorithm = NULL;
+    char *receiver_ip = NULL;
+    int mode = MODE_SENDFILE;
+    int numStreams = 1;
+    int codec = COMPRESS_NONE;
+    int delta = 0;
+    int runs = 0;
+    char *csvName = NULL;
+    char *statsName = NULL;
+    int statsInterval = COUNTERS_DEFAULT_INTERVAL;
+    TcpTuning tuning;
+    tuning_init(&tuning);
+    for (int i = 1; i < argc; i += 2) {
+        if (strcmp(argv[i], "-ip") == 0) {
+            receiver_ip = argv[i + 1];
+        } else if (strcmp(argv[i], "-p") == 0) {
+            port = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-algo") == 0) {
+            algorithm = argv[i + 1];
+        } else if (strcmp(argv[i], "-mode") == 0 && strcmp(argv[i + 1], "copy") == 0) {
+            mode = MODE_COPY;
+        } else if (strcmp(argv[i], "-mode") == 0 && strcmp(argv[i + 1], "sendfile") == 0) {
+            mode = MODE_SENDFILE;
+        } else if (strcmp(argv[i], "-mode") == 0 && strcmp(argv[i + 1], "zerocopy") == 0) {
+            mode = MODE_ZEROCOPY;
+        } else if (strcmp(argv[i], "-mode") == 0 && strcmp(argv[i + 1], "uring") == 0) {
+            mode = MODE_URING;
+        } else if (strcmp(argv[i], "-streams") == 0) {
+            numStreams = atoi(argv[i + 1]) < 1 ? 1 : atoi(argv[i + 1]) > MAX_STREAMS ? MAX_STREAMS : atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-compress") == 0 && compress_parse(argv[i + 1]) >= 0) {
+            codec = compress_parse(argv[i + 1]);
+        } else if (strcmp(argv[i], "-delta") == 0 && (strcmp(argv[i + 1], "on") == 0 || strcmp(argv[i + 1], "off") == 0)) {
+            delta = strcmp(argv[i + 1], "on") == 0;
+        } else if (strcmp(argv[i], "-runs") == 0) {
+            runs = atoi(argv[i + 1]) < 1 ? 1 : atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-csv") == 0) {
+            csvName = argv[i + 1];
+        } else if (strcmp(argv[i], "-stats") == 0) {
+            statsName = argv[i + 1];
+        } else if (strcmp(argv[i], "-stats-ms") == 0) {
+            statsInterval = atoi(argv[i + 1]);
+        } else if (!tuning_parse(&tuning, argv[i], argv[i + 1])) {
+            fprintf(stderr, "Usage: %s -ip <receiver_ip> -p <port> -algo <algorithm> [-mode copy|sendfile|zerocopy|uring] [-streams <connections>] [-compress deflate|off] [-delta on|off] [-runs <count>] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>] " TUNING_USAGE "\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (receiver_ip == NULL || algorithm == NULL) {
+        fprintf(stderr, "Usage: %s -ip <receiver_ip> -p <port> -algo <algorithm> [-mode copy|sendfile|zerocopy|uring] [-streams <connections>] [-compress deflate|off] [-delta on|off] [-runs <count>] [-csv <results file>] [-stats <counters file>] [-stats-ms <interval>] " TUNING_USAGE "\n", argv[0]);
+        exit(1);
+    }
+
+    // Live counters, on SIGUSR1 and in the stats file
+    if (counters_start(statsName, statsInterval) == -1) {
+        exit(1);
+    }
 
     // File-related variables
-    char *fileContent = NULL;
-    int fileSize = 0;
+    FileStream stream;
+    struct Stream streams[MAX_STREAMS];
 
     // Socket and address variables
-    int socketfd = -1;
     struct sockaddr_in serverAddress;
 
     printf("Sender starting\n");
-    fileContent = readFromFile(&fileSize);
+    if (stream_open(&stream, fileName, STREAM_CHUNK_SIZE) < 0) {
+        exit(1);
+    }
+    printf("File \"%s\" total size is %llu bytes.\n", fileName, (unsigned long long) stream.size);
 
-    // Set up the socket and establish connection
-    socketfd = socketSetup(&serverAddress, port, algorithm, receiver_ip);
+    // Every connection needs a chunk of its own, a smaller file is carried by fewer of them
+    uint64_t chunks = (stream.size + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE;
+    if (numStreams > 1 && (uint64_t) numStreams > chunks) {
+        numStreams = chunks > 1 ? chunks : 1;
+        printf("The file has %llu chunk(s), using %d connection(s).\n", (unsigned long long) chunks, numStreams);
+    }
+    stream_close(&stream);
 
-    // Connect to the receiver
-    if (connect(socketfd, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) == -1) {
-        perror("connect");
-        exit(1);
+    // The receiver puts the connections of one transfer back together by this ID
+    uint32_t transferId = 0;
+    if (getrandom(&transferId, sizeof(transferId), 0) != sizeof(transferId)) {
+        transferId = (uint32_t) getpid();
     }
 
-    printf("Connected successfully to the Receiver\n");
+    for (int i = 0; i < numStreams; i++) {
+        struct Stream *current = &streams[i];
+
+        // Every connection reads its own part of the file, split on chunk boundaries
+        if (stream_open(&current->file, fileName, STREAM_CHUNK_SIZE) < 0) {
+            exit(1);
+        }
+        uint64_t first = chunks * i / numStreams * STREAM_CHUNK_SIZE;
+        uint64_t last = chunks * (i + 1) / numStreams * STREAM_CHUNK_SIZE;
+        stream_range(&current->file, first, last - first);
+
+        // Set up the socket and establish connection
+        current->socketfd = socketSetup(&serverAddress, port, algorithm, receiver_ip, &tuning);
+        current->mode = mode;
+        current->tuning = &tuning;
+        hist_init(&current->roundTrips);
+
+        // MSG_ZEROCOPY has to be enabled on the socket first
+        int zeroCopy = 1;
+        if (mode == MODE_ZEROCOPY && setsockopt(current->socketfd, SOL_SOCKET, SO_ZEROCOPY, &zeroCopy, sizeof(zeroCopy)) != 0) {
+            perror("setsockopt(SO_ZEROCOPY)");
+            printf("MSG_ZEROCOPY isn't supported, copying instead\n");
+            current->mode = MODE_COPY;
+        }
+
+        // Connect to the receiver
+        if (connect(current->socketfd, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) == -1) {
+            perror("connect");
+            exit(1);
+        }
+
+        // Send the size and the part of the file this connection carries
+        struct TransferHeader header;
+        header.fileSize = htobe64(current->file.size);
+        header.offset = htobe64(current->file.start);
+        header.length = htobe64(current->file.end - current->file.start);
+        header.transferId = htonl(transferId);
+        header.streamIndex = htons(i);
+        header.streamCount = htons(numStreams);
+        header.codec = codec;
+        header.delta = delta;
+        sendData(current->socketfd, &header, sizeof(header));
+
+        // Compressed frames and changed blocks come from user space, whatever the mode
+        struct TransferAnswer answer = {COMPRESS_NONE, 0};
+        if ((codec != COMPRESS_NONE || delta) &&
+            recv(current->socketfd, &answer, sizeof(answer), MSG_WAITALL) != sizeof(answer)) {
+            perror("recv");
+            exit(1);
+        }
+        current->codec = answer.codec;
+        if (answer.codec != COMPRESS_NONE) {
+            current->mode = MODE_COPY;
+            if (compress_init(&current->pipeline, &current->file, answer.codec) == -1) {
+                exit(1);
+            }
+        }
+        current->delta = answer.delta;
+        if (answer.delta) {
+            current->deltaBuffer = malloc(sizeof(DeltaRecord) + DELTA_BLOCK_SIZE);
+            if (current->deltaBuffer == NULL ||
+                delta_init(&current->table, current->file.start, current->file.end - current->file.start) == -1) {
+                perror("malloc");
+                exit(1);
+            }
+        }
+
+        // io_uring gets the socket and the file registered once for all runs
+        if (current->mode == MODE_URING && uring_open(&current->uring, current->socketfd, current->file.fd, STREAM_CHUNK_SIZE) == -1) {
+            printf("io_uring isn't available, using sendfile()\n");
+            current->mode = MODE_SENDFILE;
+        }
+    }
 
-    // Send the file size to the receiver
-    printf("Sending the size...\n");
-    sendData(socketfd, &fileSize, sizeof(int));
+    printf("Connected successfully to the Receiver");
+    if (numStreams > 1) {
+        printf(" with %d connections", numStreams);
+    }
+    printf("\n");
+    tuning_print(streams[0].socketfd);
+    if (codec != COMPRESS_NONE) {
+        printf("Compression: %s\n", streams[0].codec != COMPRESS_NONE ? compress_name(streams[0].codec) : "the receiver turned it down");
+    }
+    if (delta) {
+        printf("Delta runs: %s\n", streams[0].delta ? "the runs after the first send the changed blocks only" : "the receiver turned them down");
+    }
 
     // Send the file data for the first time
     printf("Sending the data for the first time...\n");
-    sendData(socketfd, fileContent, fileSize);
+    for (int run = 1; ; run++) {
+        long long retransmitted = 0;
+        for (int i = 0; i < numStreams; i++) {
+            retransmitted -= retransmits(streams[i].socketfd);
+        }
+        uint64_t start = hist_now();
 
-    // Loop to handle user prompts for resending or exiting
-    while (true) {
-    int choice = -1;
-    printf("Send the file again? (1 to resend, 0 to exit.) \n");
+        // Every connection sends its part in its own thread
+        double cpu = 0;
+        for (int i = 0; i < numStreams; i++) {
+            streams[i].deltaRun = streams[i].delta && run > 1;
+        }
+        if (numStreams == 1) {
+            sendRange(&streams[0]);
+        } else {
+            for (int i = 0; i < numStreams; i++) {
+                if (pthread_create(&streams[i].thread, NULL, sendRange, &streams[i]) != 0) {
+                    perror("pthread_create");
+                    exit(1);
+                }
+            }
+            for (int i = 0; i < numStreams; i++) {
+                pthread_join(streams[i].thread, NULL);
+            }
+        }
+        uint64_t end = hist_now();
+        for (int i = 0; i < numStreams; i++) {
+            cpu += streams[i].cpu;
+            retransmitted += retransmits(streams[i].socketfd);
+        }
+        counters_add(COUNTER_RETRANSMITS, retransmitted);
+        double cpuPerGB = streams[0].file.size ? cpu / (streams[0].file.size / 1e9) : 0;  // an empty file costs nothing per GB
+        printf("CPU time: %.2fms per GB\n", cpuPerGB);
+
+        if (csvName != NULL) {
+            double time = (end - start) / 1e6;
+            RunReport report = {"tcp", "sender", algorithm, streams[0].file.size, run, time,
+                                (streams[0].file.size / time) * 1000.0 / (1024 * 1024), cpuPerGB, retransmitted};
+            report_run(csvName, &report);
+        }
 
-    // Scan until a valid choice (0 or 1) is provided
-    while (scanf("%d", &choice) != 1 || (choice != 0 && choice != 1)) {
-        scanf("%*s");  // Discard invalid input
-        printf("Invalid choice. Please enter 0 to exit or 1 to resend.\n");
+        // Loop to handle user prompts for resending or exiting, a given run count answers them
+        int choice = -1;
+        if (runs > 0) {
+            choice = run < runs;
+        } else {
+            printf("Send the file again? (1 to resend, 0 to exit.) \n");
+
+            // Scan until a valid choice (0 or 1) is provided
+            while (scanf("%d", &choice) != 1 || (choice != 0 && choice != 1)) {
+                scanf("%*s");  // Discard invalid input
+                printf("Invalid choice. Please enter 0 to exit or 1 to resend.\n");
+            }
+        }
+
+        // Every connection gets the command
+        char command = choice ? 'R' : 'E';
+        for (int i = 0; i < numStreams; i++) {
+            sendData(streams[i].socketfd, &command, sizeof(char));
+            tuning_flush(streams[i].socketfd, &tuning);
+        }
+        if (!choice) {
+            printf("Exiting...\n");
+            break;
+        }
     }
 
-    if (!choice) {
-        // Send exit command to the receiver
-        char exitCommand = 'E';
-        sendData(socketfd, &exitCommand, sizeof(char));
 
-        printf("Exiting...\n");
-        break;
-    } else {
-        // Send resend command to the receiver
-        char resendCommand = 'R';
-        sendData(socketfd, &resendCommand, sizeof(char));
+    // The round trips of all connections together
+    for (int i = 1; i < numStreams; i++) {
+        hist_merge(&streams[0].roundTrips, &streams[i].roundTrips);
+    }
+    hist_print("smoothed RTT (tcpi_rtt)", &streams[0].roundTrips);
+
+    // The compression of all connections together
+    if (streams[0].codec != COMPRESS_NONE) {
+        for (int i = 1; i < numStreams; i++) {
+            streams[0].pipeline.rawBytes += streams[i].pipeline.rawBytes;
+            streams[0].pipeline.wireBytes += streams[i].pipeline.wireBytes;
+            streams[0].pipeline.blocks += streams[i].pipeline.blocks;
+            streams[0].pipeline.storedBlocks += streams[i].pipeline.storedBlocks;
+        }
+        compress_print(&streams[0].pipeline);
     }
 
-    // Continue with sending file data
-    sendData(socketfd, fileContent, fileSize);
-   }
+    // So are the delta runs
+    if (streams[0].delta) {
+        for (int i = 1; i < numStreams; i++) {
+            streams[0].table.checkedBlocks += streams[i].table.checkedBlocks;
+            streams[0].table.changedBlocks += streams[i].table.changedBlocks;
+            streams[0].table.coveredBytes += streams[i].table.coveredBytes;
+            streams[0].table.changedBytes += streams[i].table.changedBytes;
+        }
+        delta_print(&streams[0].table);
+    }
 
+    for (int i = 0; i < numStreams; i++) {
+        if (streams[i].mode == MODE_URING) {
+            uring_close(&streams[i].uring);
+        }
 
-     // Close the socket
-    close(socketfd);
+        // Close the socket
+        close(streams[i].socketfd);
 
-     // Free allocated memory
-    free(fileContent);
+        // Release the file
+        if (streams[i].codec != COMPRESS_NONE) {
+            compress_free(&streams[i].pipeline);
+        }
+        if (streams[i].delta) {
+            delta_free(&streams[i].table);
+            free(streams[i].deltaBuffer);
+        }
+        stream_close(&streams[i].file);
+    }
 
     printf("Sender exit.\n");
     return 0;
 }
 
+void* sendRange(void* arg) {
+    struct Stream *current = arg;
+    double cpuStart = cpuTime();
+
+    int64_t sent = -1;
+    if (!current->deltaRun && current->mode == MODE_URING && (sent = uring_sendFile(&current->uring, current->file.start, current->file.end - current->file.start)) < 0) {
+        printf("io_uring can't send here, using sendfile()\n");
+        uring_close(&current->uring);
+        current->mode = MODE_SENDFILE;
+    }
+
+    if (current->deltaRun) {
+        sent = sendDelta(current->socketfd, &current->file, &current->table, current->deltaBuffer, &current->roundTrips);
+    } else if (current->codec != COMPRESS_NONE) {
+        sent = sendCompressed(current->socketfd, &current->pipeline, &current->roundTrips);
+    } else if (sent >= 0) {
+        // io_uring sent it, the chunks are queued ahead so there is one sample at the end
+        sampleRoundTrip(current->socketfd, &current->roundTrips);
+    } else if (current->mode == MODE_SENDFILE) {
+        sent = sendFile(current->socketfd, current->file.fd, current->file.start, current->file.end - current->file.start, &current->roundTrips);
+    } else {
+        stream_rewind(&current->file);
+        sent = sendStream(current->socketfd, &current->file, current->mode == MODE_ZEROCOPY, &current->roundTrips);
+    }
+    counters_add(COUNTER_GOODPUT_BYTES, sent);
+    tuning_flush(current->socketfd, current->tuning);
+
+    current->cpu = cpuTime() - cpuStart;
+    if (!current->deltaRun && current->codec != COMPRESS_NONE) {
+        current->cpu += current->pipeline.cpu;
+    }
+    return NULL;
+}
+
 int sendData(int socketfd, void* buffer, int len) {
-    int sentd = send(socketfd, buffer, len, 0);
+    int sent = 0;
+
+    // a signal can cut a send short, keep going until everything is queued
+    while (sent < len) {
+        int sentd = send(socketfd, (char *) buffer + sent, len - sent, 0);
+        counters_add(COUNTER_SEND_CALLS, 1);
+
+        if (sentd == -1 && errno == EINTR) {
+            continue;
+        } else if (sentd == -1) {
+            perror("send");
+            exit(1);
+        } else if (!sentd) {
+            printf("Receiver doesn't accept requests.\n");
+            break;
+        }
+        sent += sentd;
+    }
 
-    if (sentd == -1) {
-        perror("send");
+    return sent;
+}
+
+uint64_t sendStream(int socketfd, FileStream* stream, int zeroCopy, Histogram* roundTrips) {
+    uint64_t sent = 0;
+    const char* chunk;
+    ssize_t length;
+    int copied = 0;
+
+    // while one chunk goes out the kernel is already reading the next one
+    while ((length = stream_next(stream, &chunk)) > 0) {
+        if (zeroCopy) {
+            sent += sendZeroCopy(socketfd, (void *) chunk, length, &copied);
+        } else {
+            sent += sendData(socketfd, (void *) chunk, length);
+        }
+        sampleRoundTrip(socketfd, roundTrips);
+    }
+    if (length < 0) {
+        exit(1);
+    }
+    if (copied) {
+        printf("The kernel copied the data anyway (e.g. loopback).\n");
+    }
+
+    return sent;
+}
+
+uint64_t sendCompressed(int socketfd, CompressPipeline* pipeline, Histogram* roundTrips) {
+    uint64_t rawBytes = pipeline->rawBytes;
+    const char* frames;
+    ssize_t length;
+
+    if (compress_start(pipeline) == -1) {
+        exit(1);
+    }
+    while ((length = compress_next(pipeline, &frames)) > 0) {
+        sendData(socketfd, (void *) frames, length);
+        sampleRoundTrip(socketfd, roundTrips);
+    }
+    compress_finish(pipeline);
+    if (length < 0) {
+        exit(1);
+    }
+
+    // the file bytes, the counters only move while the thread runs
+    return pipeline->rawBytes - rawBytes;
+}
+
+uint64_t sendDelta(int socketfd, FileStream* stream, DeltaTable* table, char* buffer, Histogram* roundTrips) {
+    uint64_t position = 0;
+    const char* chunk;
+    ssize_t length;
+    DeltaRecord record;
+
+    // the receiver hashed its copy as it is now
+    if (recv(socketfd, table->hashes, delta_tableSize(table), MSG_WAITALL) != (ssize_t) delta_tableSize(table)) {
+        perror("recv");
         exit(1);
-    } else if (!sentd)
-        printf("Receiver doesn't accept requests.\n");
-    else if (sentd < len)
-        printf("Data was only partly send (%d/%d bytes).\n", sentd, len);
-    
-    return sentd;
+    }
+
+    // the chunks start on block boundaries, a block that hashes the same stays where it is
+    stream_rewind(stream);
+    while ((length = stream_next(stream, &chunk)) > 0) {
+        for (ssize_t offset = 0; offset < length; offset += DELTA_BLOCK_SIZE) {
+            size_t block = length - offset < DELTA_BLOCK_SIZE ? length - offset : DELTA_BLOCK_SIZE;
+            if (!delta_update(table, (position + offset) / DELTA_BLOCK_SIZE, chunk + offset, block)) {
+                continue;
+            }
+            record.offset = htobe64(table->offset + position + offset);
+            record.length = htobe64(block);
+            memcpy(buffer, &record, sizeof(record));
+            memcpy(buffer + sizeof(record), chunk + offset, block);
+            sendData(socketfd, buffer, sizeof(record) + block);
+        }
+        position += length;
+        sampleRoundTrip(socketfd, roundTrips);
+    }
+    if (length < 0) {
+        exit(1);
+    }
+
+    // the end of the run tells how much of the file it covered
+    record.offset = htobe64(DELTA_END);
+    record.length = htobe64(position);
+    sendData(socketfd, &record, sizeof(record));
+    return position;
 }
 
-int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo, char* ip) {
+uint64_t sendFile(int socketfd, int filefd, uint64_t offset, uint64_t len, Histogram* roundTrips) {
+    off_t position = offset;
+    off_t end = offset + len;
+
+    // the kernel moves the pages from the page cache to the socket, a chunk at a time so the RTT is sampled as it goes
+    while (position < end) {
+        ssize_t sentd = sendfile(socketfd, filefd, &position, end - position < STREAM_CHUNK_SIZE ? end - position : STREAM_CHUNK_SIZE);
+        counters_add(COUNTER_SEND_CALLS, 1);
+        if (sentd == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendfile");
+            exit(1);
+        } else if (!sentd) {
+            printf("Receiver doesn't accept requests.\n");
+            break;
+        }
+        sampleRoundTrip(socketfd, roundTrips);
+    }
+
+    return position - offset;
+}
+
+// Read zero-copy completion notifications from the error queue, wait for one if block is set.
+// Returns how many sends they completed, copied is set if the kernel had to copy after all.
+static unsigned int reapZeroCopy(int socketfd, int block, int* copied) {
+    unsigned int completed = 0;
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+
+    if (block) {
+        struct pollfd pfd = {socketfd, 0, 0};
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            exit(1);
+        }
+    }
+
+    while (true) {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        if (recvmsg(socketfd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return completed;
+            }
+            perror("recvmsg(MSG_ERRQUEUE)");
+            exit(1);
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            struct sock_extended_err *error = (struct sock_extended_err *) CMSG_DATA(cmsg);
+            if (error->ee_errno != 0 || error->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // ee_info..ee_data is the range of sends that completed
+            completed += error->ee_data - error->ee_info + 1;
+            if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                *copied = 1;
+            }
+        }
+    }
+}
+
+int sendZeroCopy(int socketfd, void* buffer, int len, int* copied) {
+    unsigned int issued = 0, completed = 0;
+    int sent = 0;
+
+    while (sent < len) {
+        int sentd = send(socketfd, (char *) buffer + sent, len - sent, MSG_ZEROCOPY);
+        counters_add(COUNTER_SEND_CALLS, 1);
+        if (sentd == -1) {
+            // too many buffers pinned, let the kernel release some
+            if (errno == ENOBUFS) {
+                completed += reapZeroCopy(socketfd, 1, copied);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            exit(1);
+        }
+        sent += sentd;
+        issued++;
+        completed += reapZeroCopy(socketfd, 0, copied);
+    }
+
+    // the buffer belongs to the kernel until every send completed
+    while (completed < issued) {
+        completed += reapZeroCopy(socketfd, 1, copied);
+    }
+
+    return sent;
+}
+
+int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo, char* ip, const TcpTuning* tuning) {
     int socketfd = -1;
 
     memset(serverAddress, 0, sizeof(*serverAddress));
@@ -141,50 +673,45 @@ int socketSetup(struct sockaddr_in *serverAddress, int port, char* algo, char* i
 
     SetCCAlgorithm(socketfd, algo);
 
+    // buffer sizes have to be set before connecting, they decide the window scale
+    if (tuning_apply(socketfd, tuning) == -1) {
+        exit(1);
+    }
+
     return socketfd;
 }
 
 int SetCCAlgorithm(int socketfd, char* algo) {
-    if (strcmp(algo, "reno") == 0) {
-        socklen_t CC_reno_len = strlen("reno");
-
-        if (setsockopt(socketfd, IPPROTO_TCP, 13, "reno", CC_reno_len) != 0) {
-            perror("setsockopt");
-            exit(1);
-        }
-    } else {
-        socklen_t CC_cubic_len = strlen("cubic");
-
-        if (setsockopt(socketfd, IPPROTO_TCP, 13, "cubic", CC_cubic_len) != 0) {
-            perror("setsockopt");
-            exit(1);
-        }
+    if (tuning_setCongestion(socketfd, algo) == -1) {
+        exit(1);
     }
 
     return 0;
 }
 
-char* readFromFile(int* size) {
-    FILE *fpointer = NULL;
-    char* fileContent;
+long long retransmits(int socketfd) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
 
-    fpointer = fopen(fileName, "r");
-
-    if (fpointer == NULL) {
-        perror("fopen");
-        exit(1);
+    if (getsockopt(socketfd, IPPROTO_TCP, TCP_INFO, &info, &length) == -1) {
+        return 0;
     }
+    return info.tcpi_total_retrans;
+}
 
-    // Find the file size and allocate enough memory for it.
-    fseek(fpointer, 0L, SEEK_END);
-    *size = (int) ftell(fpointer);
-    fileContent = (char*) malloc(*size * sizeof(char));
-    fseek(fpointer, 0L, SEEK_SET);
-
-    fread(fileContent, sizeof(char), *size, fpointer);
-    fclose(fpointer);
+void sampleRoundTrip(int socketfd, Histogram* roundTrips) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
 
-    printf("File \"%s\" total size is %d bytes.\n", fileName, *size);
+    // tcpi_rtt is the smoothed estimate in microseconds, 0 before the first ACK
+    if (getsockopt(socketfd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0 && info.tcpi_rtt > 0) {
+        hist_record(roundTrips, info.tcpi_rtt * 1000ULL);
+    }
+}
 
-    return fileContent;
+double cpuTime() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000.0 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000.0;
 }
@@ -0,0 +1,133 @@
+#include "TcpTuning.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define AVAILABLE_CONGESTION "/proc/sys/net/ipv4/tcp_available_congestion_control"
+
+void tuning_init(TcpTuning* tuning){
+    memset(tuning, 0, sizeof(*tuning));
+    tuning->noDelay = -1;
+    tuning->cork = -1;
+    tuning->quickAck = -1;
+}
+
+int tuning_parse(TcpTuning* tuning, const char* option, const char* value){
+    if (strcmp(option, "-sndbuf") == 0) {
+        tuning->sendBuffer = atoi(value);
+    } else if (strcmp(option, "-rcvbuf") == 0) {
+        tuning->receiveBuffer = atoi(value);
+    } else if (strcmp(option, "-nodelay") == 0) {
+        tuning->noDelay = atoi(value) != 0;
+    } else if (strcmp(option, "-cork") == 0) {
+        tuning->cork = atoi(value) != 0;
+    } else if (strcmp(option, "-notsent-lowat") == 0) {
+        tuning->notSentLowat = atoi(value);
+    } else if (strcmp(option, "-pacing") == 0) {
+        tuning->pacingRate = atof(value);
+    } else if (strcmp(option, "-quickack") == 0) {
+        tuning->quickAck = atoi(value) != 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// set one int option, the name is for the error message
+static int tuning_setInt(int socketfd, int level, int name, int value, const char* description){
+    if (setsockopt(socketfd, level, name, &value, sizeof(value)) == -1) {
+        perror(description);
+        return -1;
+    }
+    return 0;
+}
+
+int tuning_apply(int socketfd, const TcpTuning* tuning){
+    int result = 0;
+
+    if (tuning->sendBuffer > 0) {
+        result |= tuning_setInt(socketfd, SOL_SOCKET, SO_SNDBUF, tuning->sendBuffer, "setsockopt(SO_SNDBUF)");
+    }
+    if (tuning->receiveBuffer > 0) {
+        result |= tuning_setInt(socketfd, SOL_SOCKET, SO_RCVBUF, tuning->receiveBuffer, "setsockopt(SO_RCVBUF)");
+    }
+    if (tuning->noDelay >= 0) {
+        result |= tuning_setInt(socketfd, IPPROTO_TCP, TCP_NODELAY, tuning->noDelay, "setsockopt(TCP_NODELAY)");
+    }
+    if (tuning->cork >= 0) {
+        result |= tuning_setInt(socketfd, IPPROTO_TCP, TCP_CORK, tuning->cork, "setsockopt(TCP_CORK)");
+    }
+    if (tuning->notSentLowat > 0) {
+        result |= tuning_setInt(socketfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, tuning->notSentLowat, "setsockopt(TCP_NOTSENT_LOWAT)");
+    }
+    if (tuning->quickAck >= 0) {
+        result |= tuning_setInt(socketfd, IPPROTO_TCP, TCP_QUICKACK, tuning->quickAck, "setsockopt(TCP_QUICKACK)");
+    }
+
+    // the kernel takes 64 bits in bytes per second, the fq qdisc or TCP's own pacing enforce it
+    if (tuning->pacingRate > 0) {
+        uint64_t rate = tuning->pacingRate * 1e6 / 8;
+        if (setsockopt(socketfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == -1) {
+            perror("setsockopt(SO_MAX_PACING_RATE)");
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void tuning_flush(int socketfd, const TcpTuning* tuning){
+    // taking the cork out pushes the partial segment, then it goes back in for the next run
+    if (tuning->cork == 1) {
+        tuning_setInt(socketfd, IPPROTO_TCP, TCP_CORK, 0, "setsockopt(TCP_CORK)");
+        tuning_setInt(socketfd, IPPROTO_TCP, TCP_CORK, 1, "setsockopt(TCP_CORK)");
+    }
+}
+
+void tuning_quickAck(int socketfd, const TcpTuning* tuning){
+    if (tuning->quickAck == 1) {
+        tuning_setInt(socketfd, IPPROTO_TCP, TCP_QUICKACK, 1, "setsockopt(TCP_QUICKACK)");
+    }
+}
+
+int tuning_setCongestion(int socketfd, const char* algorithm){
+    if (setsockopt(socketfd, IPPROTO_TCP, TCP_CONGESTION, algorithm, strlen(algorithm)) == 0) {
+        return 0;
+    }
+    perror("setsockopt(TCP_CONGESTION)");
+
+    // tell which ones would have worked
+    char available[256] = "";
+    FILE* file = fopen(AVAILABLE_CONGESTION, "r");
+    if (file != NULL) {
+        if (fgets(available, sizeof(available), file) != NULL) {
+            available[strcspn(available, "\n")] = '\0';
+        }
+        fclose(file);
+    }
+    printf("Congestion control \"%s\" isn't available, the kernel has: %s\n", algorithm, available);
+    return -1;
+}
+
+void tuning_print(int socketfd){
+    char algorithm[32] = "";
+    int sendBuffer = 0, receiveBuffer = 0, noDelay = 0, notSentLowat = 0;
+    socklen_t length;
+
+    length = sizeof(algorithm) - 1;
+    getsockopt(socketfd, IPPROTO_TCP, TCP_CONGESTION, algorithm, &length);
+    length = sizeof(int);
+    getsockopt(socketfd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, &length);
+    length = sizeof(int);
+    getsockopt(socketfd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, &length);
+    length = sizeof(int);
+    getsockopt(socketfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, &length);
+    length = sizeof(int);
+    getsockopt(socketfd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notSentLowat, &length);
+
+    printf("Socket: congestion control %s, sndbuf %d, rcvbuf %d, nodelay %d, notsent-lowat %d\n",
+           algorithm, sendBuffer, receiveBuffer, noDelay, notSentLowat);
+}
@@ -0,0 +1,55 @@
+#define TUNING_USAGE "[-sndbuf <bytes>] [-rcvbuf <bytes>] [-nodelay 0|1] [-cork 0|1] [-notsent-lowat <bytes>] [-pacing <Mbit/s>] [-quickack 0|1]"
+
+/**
+ * Socket options of the TCP sender and receiver, what isn't given stays at the kernel's default.
+ * The receiver sets them on the listening socket, so the buffers are in place before the
+ * window scale is negotiated and the accepted connections inherit them.
+ */
+typedef struct {
+    int sendBuffer;         // SO_SNDBUF in bytes, 0 leaves the kernel's autotuning on
+    int receiveBuffer;      // SO_RCVBUF in bytes, 0 leaves the kernel's autotuning on
+    int noDelay;            // TCP_NODELAY, -1 leaves it alone
+    int cork;               // TCP_CORK, full segments only until the end of each run, -1 leaves it alone
+    int notSentLowat;       // TCP_NOTSENT_LOWAT in bytes, 0 leaves it alone
+    double pacingRate;      // SO_MAX_PACING_RATE in Mbit/s, 0 for no limit
+    int quickAck;           // TCP_QUICKACK, the kernel clears it, so it is set again after every read, -1 leaves it alone
+} TcpTuning;
+
+/**
+ * Leaves every option at the kernel's default.
+ */
+void tuning_init(TcpTuning* tuning);
+
+/**
+ * Takes a command line option of TUNING_USAGE.
+ * @return 1: it was one of them, 0: it wasn't
+ */
+int tuning_parse(TcpTuning* tuning, const char* option, const char* value);
+
+/**
+ * Sets the options that were given on the socket.
+ * @return -1: failure, 0: success
+ */
+int tuning_apply(int socketfd, const TcpTuning* tuning);
+
+/**
+ * A corked socket sends what waits in it, e.g. the end of a run or a command.
+ */
+void tuning_flush(int socketfd, const TcpTuning* tuning);
+
+/**
+ * Asks for the next ACKs right away if quick ACKs are on, after every read.
+ */
+void tuning_quickAck(int socketfd, const TcpTuning* tuning);
+
+/**
+ * Sets the congestion control algorithm, any of the kernel's (see
+ * /proc/sys/net/ipv4/tcp_available_congestion_control) may be used.
+ * @return -1: the kernel doesn't have it (the available ones are printed), 0: success
+ */
+int tuning_setCongestion(int socketfd, const char* algorithm);
+
+/**
+ * Prints the options the socket ended up with, the kernel doubles the buffer sizes it's given.
+ */
+void tuning_print(int socketfd);
@@ -0,0 +1,388 @@
+#include "UringIO.h"
+#include "Counters.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define URING_SOCKET 0 // fixed file indexes
+#define URING_FILE 1
+
+/**
+ * What a buffer is waiting for, every buffer has at most one request in flight,
+ * so the request's user_data is just the buffer index.
+ */
+enum SlotState {
+    SLOT_FREE,
+    SLOT_READING,       // sender: chunk read from the file
+    SLOT_READY,         // sender: waiting for its turn on the socket
+    SLOT_SENDING,
+    SLOT_RECEIVING,     // receiver: chunk received from the socket
+    SLOT_WRITING        // receiver: chunk written to the file
+};
+
+typedef struct {
+    enum SlotState state;
+    uint64_t offset;    // file offset of the chunk
+    size_t length;
+    size_t done;        // bytes of a short file read or write that are through
+} UringSlot;
+
+/**
+ * Queues a request on buffer index from position on, it goes to the kernel with the next uring_submit().
+ */
+static void uring_prep(UringIO* ring, int opcode, int file, int index, size_t position, size_t length, uint64_t offset, int flags){
+    unsigned int tail = *ring->sqTail;
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sqMask];
+    char* buffer = ring->buffers + index * ring->chunkSize + position;
+
+    memset(sqe, 0, sizeof(*sqe));
+    // without fixed buffers the plain opcodes take the same arguments
+    if (!ring->fixedBuffers && opcode == IORING_OP_READ_FIXED) {
+        opcode = IORING_OP_READ;
+    } else if (!ring->fixedBuffers && opcode == IORING_OP_WRITE_FIXED) {
+        opcode = IORING_OP_WRITE;
+    }
+    sqe->opcode = opcode;
+    sqe->flags = IOSQE_FIXED_FILE | flags;
+    sqe->fd = file;
+    sqe->addr = (uintptr_t) buffer;
+    sqe->len = length;
+    sqe->user_data = index;
+    if (opcode == IORING_OP_SEND || opcode == IORING_OP_RECV) {
+        // a short transfer ends the chain of linked requests, have the kernel retry until the chunk is through
+        sqe->msg_flags = MSG_WAITALL;
+    } else {
+        sqe->off = offset;
+    }
+    if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED) {
+        sqe->buf_index = index;
+    }
+
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->sqQueued++;
+}
+
+static struct io_uring_cqe* uring_peek(UringIO* ring){
+    unsigned int head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+static void uring_advance(UringIO* ring){
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Hands the queued requests to the kernel and waits for at least one completion,
+ * a single system call for both.
+ * @param calls the counter of the system calls, sending or receiving
+ * @return -1: failure, 0: success
+ */
+static int uring_submit(UringIO* ring, CounterId calls){
+    if (!ring->sqQueued && uring_peek(ring) != NULL) {
+        return 0;
+    }
+    while (1) {
+        int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->sqQueued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        counters_add(calls, 1);
+        if (submitted == -1 && errno == EINTR) {
+            continue;
+        }
+        if (submitted == -1) {
+            perror("io_uring_enter");
+            return -1;
+        }
+        ring->sqQueued -= submitted;
+        return 0;
+    }
+}
+
+int uring_open(UringIO* ring, int socketfd, int filefd, size_t chunkSize){
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(UringIO));
+    memset(&params, 0, sizeof(params));
+    // every buffer has one request in flight, a send or receive chain never has to be split
+    ring->fd = syscall(__NR_io_uring_setup, 2 * URING_BUFFERS, &params);
+    if (ring->fd == -1) {
+        perror("io_uring_setup");
+        return -1;
+    }
+    ring->sqEntries = params.sq_entries;
+    ring->chunkSize = chunkSize;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqRingSize = ring->cqRingSize = ring->sqRingSize > ring->cqRingSize ? ring->sqRingSize : ring->cqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        ring->sqRing = NULL;
+        perror("mmap");
+        uring_close(ring);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing = ring->sqRing;
+    } else {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    ring->buffers = mmap(NULL, URING_BUFFERS * chunkSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED || ring->buffers == MAP_FAILED) {
+        ring->cqRing = ring->cqRing == MAP_FAILED ? NULL : ring->cqRing;
+        ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+        ring->buffers = ring->buffers == MAP_FAILED ? NULL : ring->buffers;
+        perror("mmap");
+        uring_close(ring);
+        return -1;
+    }
+
+    ring->sqHead = (unsigned int*) ((char*) ring->sqRing + params.sq_off.head);
+    ring->sqTail = (unsigned int*) ((char*) ring->sqRing + params.sq_off.tail);
+    ring->sqMask = *(unsigned int*) ((char*) ring->sqRing + params.sq_off.ring_mask);
+    ring->cqHead = (unsigned int*) ((char*) ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned int*) ((char*) ring->cqRing + params.cq_off.tail);
+    ring->cqMask = *(unsigned int*) ((char*) ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) ((char*) ring->cqRing + params.cq_off.cqes);
+
+    // entry i of the submission queue always points at sqes[i]
+    unsigned int* array = (unsigned int*) ((char*) ring->sqRing + params.sq_off.array);
+    for (unsigned int i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    int files[2] = {socketfd, filefd};
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, 2) == -1) {
+        perror("io_uring_register(files)");
+        uring_close(ring);
+        return -1;
+    }
+
+    // pinned pages count against RLIMIT_MEMLOCK, the ring still works without them
+    struct iovec buffers[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        buffers[i].iov_base = ring->buffers + i * chunkSize;
+        buffers[i].iov_len = chunkSize;
+    }
+    ring->fixedBuffers = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, buffers, URING_BUFFERS) == 0;
+    if (!ring->fixedBuffers) {
+        perror("io_uring_register(buffers)");
+        printf("Using io_uring without registered buffers\n");
+    }
+    return 0;
+}
+
+int64_t uring_sendFile(UringIO* ring, uint64_t offset, uint64_t len){
+    UringSlot slots[URING_BUFFERS];
+    uint64_t chunks = (len + ring->chunkSize - 1) / ring->chunkSize;
+    uint64_t nextRead = 0, sentChunks = 0, sent = 0;
+    int inFlight = 0, sending = 0, failed = 0;
+
+    memset(slots, 0, sizeof(slots));
+    while (inFlight > 0 || (!failed && sentChunks < chunks)) {
+        // read ahead into the buffers whose chunk went out, chunk k always uses buffer k % URING_BUFFERS
+        while (!failed && nextRead < chunks && nextRead - sentChunks < URING_BUFFERS) {
+            int index = nextRead % URING_BUFFERS;
+            slots[index].state = SLOT_READING;
+            slots[index].offset = offset + nextRead * ring->chunkSize;
+            slots[index].length = len - nextRead * ring->chunkSize < ring->chunkSize ? len - nextRead * ring->chunkSize : ring->chunkSize;
+            slots[index].done = 0;
+            uring_prep(ring, IORING_OP_READ_FIXED, URING_FILE, index, 0, slots[index].length, slots[index].offset, 0);
+            nextRead++;
+            inFlight++;
+        }
+
+        // send the chunks that are read, linked so the kernel puts them on the socket in order
+        if (!failed && !sending) {
+            int ready = 0;
+            while (sentChunks + ready < nextRead && slots[(sentChunks + ready) % URING_BUFFERS].state == SLOT_READY) {
+                ready++;
+            }
+            for (int i = 0; i < ready; i++) {
+                int index = (sentChunks + i) % URING_BUFFERS;
+                slots[index].state = SLOT_SENDING;
+                uring_prep(ring, IORING_OP_SEND, URING_SOCKET, index, 0, slots[index].length, 0, i < ready - 1 ? IOSQE_IO_LINK : 0);
+            }
+            sending = ready;
+            inFlight += ready;
+        }
+
+        if (uring_submit(ring, COUNTER_SEND_CALLS) == -1) {
+            if (!sent) {
+                return -1;
+            }
+            exit(1);
+        }
+
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek(ring)) != NULL) {
+            UringSlot* slot = &slots[cqe->user_data];
+            int index = cqe->user_data;
+            int result = cqe->res;
+            uring_advance(ring);
+            inFlight--;
+
+            if (slot->state == SLOT_READING) {
+                if (result <= 0) {
+                    errno = result ? -result : EIO;
+                    perror("io_uring read");
+                    failed = 1;
+                    continue;
+                }
+                slot->done += result;
+                if (slot->done < slot->length) {
+                    uring_prep(ring, IORING_OP_READ_FIXED, URING_FILE, index, slot->done, slot->length - slot->done, slot->offset + slot->done, 0);
+                    inFlight++;
+                } else {
+                    slot->state = SLOT_READY;
+                }
+            } else {
+                sending--;
+                if (result > 0) {
+                    sent += result;
+                }
+                if (result < 0 && result != -ECANCELED) {
+                    errno = -result;
+                    perror("io_uring send");
+                    failed = 1;
+                } else if (result == -ECANCELED || (size_t) result < slot->length) {
+                    failed = 1;
+                } else {
+                    slot->state = SLOT_FREE;
+                    sentChunks++;
+                }
+            }
+        }
+    }
+
+    if (failed && !sent) {
+        return -1;
+    }
+    if (sentChunks < chunks) {
+        printf("Receiver doesn't accept requests.\n");
+    }
+    return sent;
+}
+
+int64_t uring_receive(UringIO* ring, uint64_t offset, uint64_t len){
+    UringSlot slots[URING_BUFFERS];
+    uint64_t queued = 0, received = 0;
+    int inFlight = 0, receiving = 0, senderClosed = 0, failed = 0;
+
+    memset(slots, 0, sizeof(slots));
+    while (inFlight > 0 || (!failed && !senderClosed && queued < len)) {
+        // queue a receive into every free buffer, linked so they fill in the order of the stream
+        if (!failed && !senderClosed && !receiving) {
+            int indexes[URING_BUFFERS], count = 0;
+            for (int i = 0; i < URING_BUFFERS && queued < len; i++) {
+                if (slots[i].state != SLOT_FREE) {
+                    continue;
+                }
+                slots[i].state = SLOT_RECEIVING;
+                slots[i].offset = offset + queued;
+                slots[i].length = len - queued < ring->chunkSize ? len - queued : ring->chunkSize;
+                queued += slots[i].length;
+                indexes[count++] = i;
+            }
+            for (int i = 0; i < count; i++) {
+                uring_prep(ring, IORING_OP_RECV, URING_SOCKET, indexes[i], 0, slots[indexes[i]].length, 0, i < count - 1 ? IOSQE_IO_LINK : 0);
+            }
+            receiving = count;
+            inFlight += count;
+        }
+
+        if (uring_submit(ring, COUNTER_RECEIVE_CALLS) == -1) {
+            if (!received) {
+                return -1;
+            }
+            exit(1);
+        }
+
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek(ring)) != NULL) {
+            UringSlot* slot = &slots[cqe->user_data];
+            int index = cqe->user_data;
+            int result = cqe->res;
+            uring_advance(ring);
+            inFlight--;
+
+            if (slot->state == SLOT_RECEIVING) {
+                receiving--;
+                // a receive before it came back short, the sender closed the connection
+                if (result == -ECANCELED) {
+                    slot->state = SLOT_FREE;
+                    continue;
+                }
+                if (result < 0) {
+                    errno = -result;
+                    perror("io_uring receive");
+                    slot->state = SLOT_FREE;
+                    failed = 1;
+                    continue;
+                }
+                if ((size_t) result < slot->length) {
+                    senderClosed = 1;
+                }
+                received += result;
+                if (!result) {
+                    slot->state = SLOT_FREE;
+                    continue;
+                }
+                slot->state = SLOT_WRITING;
+                slot->length = result;
+                slot->done = 0;
+                uring_prep(ring, IORING_OP_WRITE_FIXED, URING_FILE, index, 0, slot->length, slot->offset, 0);
+                inFlight++;
+            } else {
+                if (result <= 0) {
+                    errno = result ? -result : EIO;
+                    perror("io_uring write");
+                    exit(1);
+                }
+                slot->done += result;
+                if (slot->done < slot->length) {
+                    uring_prep(ring, IORING_OP_WRITE_FIXED, URING_FILE, index, slot->done, slot->length - slot->done, slot->offset + slot->done, 0);
+                    inFlight++;
+                } else {
+                    slot->state = SLOT_FREE;
+                }
+            }
+        }
+    }
+
+    if (failed && !received) {
+        return -1;
+    }
+    return received;
+}
+
+void uring_close(UringIO* ring){
+    if (ring->buffers != NULL) {
+        munmap(ring->buffers, URING_BUFFERS * ring->chunkSize);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqEntries * sizeof(struct io_uring_sqe));
+    }
+    if (ring->cqRing != NULL && ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL) {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(UringIO));
+    ring->fd = -1;
+}
@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#define URING_BUFFERS 4 // chunks in flight per connection
+
+/**
+ * io_uring instance of one connection, set up with the raw system calls (no liburing).
+ * The socket and the file are registered as fixed files and the chunk buffers as fixed
+ * buffers, so the kernel doesn't look them up and pin the pages again for every request.
+ * Reading and writing chunks overlap, and one io_uring_enter() both submits the next
+ * requests and waits for the finished ones.
+ */
+typedef struct {
+    int fd;
+    unsigned int sqEntries;
+    unsigned int* sqHead;       // submission queue, shared with the kernel
+    unsigned int* sqTail;
+    unsigned int sqMask;
+    struct io_uring_sqe* sqes;
+    unsigned int sqQueued;      // entries filled in but not submitted yet
+    unsigned int* cqHead;       // completion queue, shared with the kernel
+    unsigned int* cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;               // the same mapping as sqRing on kernels with IORING_FEAT_SINGLE_MMAP
+    size_t cqRingSize;
+    char* buffers;              // URING_BUFFERS chunks of chunkSize bytes
+    size_t chunkSize;
+    int fixedBuffers;           // 0 when the kernel wouldn't pin the buffers, plain reads and writes are used then
+} UringIO;
+
+/**
+ * Sets up the ring and registers the socket and the file (fixed file 0 and 1).
+ * @return -1: io_uring isn't available, 0: success
+ */
+int uring_open(UringIO* ring, int socketfd, int filefd, size_t chunkSize);
+
+/**
+ * Sends len bytes of the file from offset on, the next chunks are read while one is sent.
+ * @return -1: io_uring failed before anything was sent, otherwise the bytes sent
+ */
+int64_t uring_sendFile(UringIO* ring, uint64_t offset, uint64_t len);
+
+/**
+ * Receives len bytes from the socket into the file at offset, URING_BUFFERS receives are
+ * queued at a time and each chunk is written to the file while the next ones arrive.
+ * @return -1: io_uring failed before anything was received, otherwise the bytes received,
+ * less than len when the sender closed the connection
+ */
+int64_t uring_receive(UringIO* ring, uint64_t offset, uint64_t len);
+
+/**
+ * Releases the ring and the buffers, the socket and the file stay open.
+ */
+void uring_close(UringIO* ring);
@@ -0,0 +1,164 @@
+#!/bin/bash
+# Runs the TCP and RUDP senders and receivers unattended over loopback for every file size and
+# congestion control algorithm, and collects their per-run statistics into <out>.csv and <out>.json.
+#
+# ./benchmark.sh [-runs <count>] [-sizes <size,...>] [-algos <tcp algorithm,...>]
+#                [-rudp-algos <aimd|bbr|none,...>] [-protocols <tcp,rudp>] [-port <first port>] [-o <out>]
+#                [-impair "<proxy options>"] [-tcp-options "<socket options>"] [-rudp-options "<sender options>"]
+#
+# Sizes take the K/M/G suffixes (powers of 1024). Each row is one run: the time and throughput the
+# receiver measured, the retransmissions the sender counted and the CPU time per GB on both sides.
+# With -impair the senders go through ./proxy with those options, e.g. -impair "-loss 1 -delay 10 -seed 7".
+# -tcp-options go to both TCP programs, e.g. -tcp-options "-sndbuf 4194304 -nodelay 1" (see sweep.sh).
+# -rudp-options go to the RUDP sender, e.g. -rudp-options "-fec 8/2 -w 64" (see fec.sh).
+
+RUNS=5
+SIZES=1M,16M
+ALGOS=reno,cubic
+RUDP_ALGOS=aimd,bbr
+PROTOCOLS=tcp,rudp
+PORT=20000
+OUT=results
+IMPAIR=
+TCP_OPTIONS=
+RUDP_OPTIONS=
+TIMEOUT=600 # seconds a single measurement may take
+
+usage() {
+    sed -n '5,7p' "$0" | sed 's/^# //' >&2
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    [ $# -lt 2 ] && usage
+    case "$1" in
+        -runs) RUNS=$2 ;;
+        -sizes) SIZES=$2 ;;
+        -algos) ALGOS=$2 ;;
+        -rudp-algos) RUDP_ALGOS=$2 ;;
+        -protocols) PROTOCOLS=$2 ;;
+        -port) PORT=$2 ;;
+        -o) OUT=$2 ;;
+        -impair) IMPAIR=$2 ;;
+        -tcp-options) TCP_OPTIONS=$2 ;;
+        -rudp-options) RUDP_OPTIONS=$2 ;;
+        *) usage ;;
+    esac
+    shift 2
+done
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+programs="TCP_sender TCP_receiver RUDP_sender RUDP_receiver"
+[ -n "$IMPAIR" ] && programs="$programs proxy"
+for program in $programs; do
+    if [ ! -x "$BIN/$program" ]; then
+        echo "$BIN/$program is missing, run make first" >&2
+        exit 1
+    fi
+done
+
+# the senders read tosend.txt from the working directory
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+RESULTS="$WORK/results.csv"
+echo "protocol,algorithm,bytes,run,time_ms,throughput_mbs,retransmits,sender_cpu_ms_per_gb,receiver_cpu_ms_per_gb" > "$RESULTS"
+
+# measure <protocol> <algorithm> <receiver command> -- <sender command>
+measure() {
+    local protocol=$1 algorithm=$2
+    shift 2
+    local receiver=() sender=()
+    while [ "$1" != "--" ]; do receiver+=("$1"); shift; done
+    shift
+    sender=("$@")
+
+    rm -f "$WORK/sender.csv" "$WORK/receiver.csv"
+    "${receiver[@]}" -csv "$WORK/receiver.csv" > "$WORK/receiver.log" 2>&1 &
+    local receiverPid=$!
+    local proxyPid=
+    if [ -n "$IMPAIR" ]; then
+        local transport=tcp
+        [ "$protocol" = rudp ] && transport=udp
+        # shellcheck disable=SC2086 # the options are split on purpose
+        "$BIN/proxy" -proto "$transport" -p "$((PORT + 1))" -ip 127.0.0.1 -to "$PORT" $IMPAIR > "$WORK/proxy.log" 2>&1 &
+        proxyPid=$!
+    fi
+    sleep 0.5
+
+    if ! (cd "$WORK" && timeout "$TIMEOUT" "${sender[@]}" -runs "$RUNS" -csv "$WORK/sender.csv" < /dev/null > "$WORK/sender.log" 2>&1); then
+        echo "  sender failed, see its output:" >&2
+        tail -5 "$WORK/sender.log" >&2
+    fi
+
+    # the receiver ends by itself after the exit message, don't wait on it forever
+    for _ in $(seq 50); do
+        kill -0 "$receiverPid" 2> /dev/null || break
+        sleep 0.1
+    done
+    kill "$receiverPid" $proxyPid 2> /dev/null
+    wait "$receiverPid" $proxyPid 2> /dev/null
+
+    if [ ! -s "$WORK/receiver.csv" ] || [ ! -s "$WORK/sender.csv" ]; then
+        echo "  no results for $protocol/$algorithm" >&2
+        return
+    fi
+
+    # one row per run, the receiver's view of the transfer with the sender's counters next to it
+    awk -F, -v OFS=, -v sender="$WORK/sender.csv" '
+        FNR == 1 { next }
+        FILENAME == sender { retransmits[$5] = $9; cpu[$5] = $8; next }
+        { print $1, $3, $4, $5, $6, $7, retransmits[$5], cpu[$5], $8 }
+    ' "$WORK/sender.csv" "$WORK/receiver.csv" >> "$RESULTS"
+}
+
+for size in ${SIZES//,/ }; do
+    bytes=$(numfmt --from=iec "$size") || exit 1
+    head -c "$bytes" /dev/urandom > "$WORK/tosend.txt"
+
+    for protocol in ${PROTOCOLS//,/ }; do
+        if [ "$protocol" = tcp ]; then
+            algorithms=$ALGOS
+        else
+            algorithms=$RUDP_ALGOS
+        fi
+        for algorithm in ${algorithms//,/ }; do
+            # the receiver listens on PORT, the proxy (if any) on the next one
+            PORT=$((PORT + 2))
+            target=$PORT
+            [ -n "$IMPAIR" ] && target=$((PORT + 1))
+            echo "$protocol $algorithm, $size, $RUNS runs" >&2
+            if [ "$protocol" = tcp ]; then
+                # shellcheck disable=SC2086 # the options are split on purpose
+                measure tcp "$algorithm" "$BIN/TCP_receiver" -p "$PORT" -algo "$algorithm" -o "$WORK/received.txt" $TCP_OPTIONS -- \
+                    "$BIN/TCP_sender" -ip 127.0.0.1 -p "$target" -algo "$algorithm" $TCP_OPTIONS
+            else
+                # shellcheck disable=SC2086 # the options are split on purpose
+                measure rudp "$algorithm" "$BIN/RUDP_receiver" -p "$PORT" -- \
+                    "$BIN/RUDP_sender" -ip 127.0.0.1 -p "$target" -algo "$algorithm" $RUDP_OPTIONS
+            fi
+            rm -f "$WORK/received.txt"
+        done
+    done
+done
+
+cp "$RESULTS" "$OUT.csv"
+
+# the same rows as a JSON array, an empty field becomes null
+awk -F, '
+    NR == 1 { for (i = 1; i <= NF; i++) name[i] = $i; printf "["; next }
+    {
+        if (NR > 2) printf ","
+        printf "\n  {"
+        for (i = 1; i <= NF; i++) {
+            if ($i == "") value = "null"
+            else if (i <= 2) value = "\"" $i "\""
+            else value = $i
+            if (i > 1) printf ", "
+            printf "\"%s\": %s", name[i], value
+        }
+        printf "}"
+    }
+    END { print "\n]" }
+' "$RESULTS" > "$OUT.json"
+
+echo "$(($(wc -l < "$RESULTS") - 1)) runs written to $OUT.csv and $OUT.json" >&2
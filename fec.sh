@@ -0,0 +1,108 @@
+#!/bin/bash
+# Measures RUDP goodput against the loss rate with forward error correction off and on, every
+# transfer goes through ./proxy. Every loss rate and FEC setting is a row of <out>.csv, and the
+# goodput is printed as a table of loss rates by FEC settings.
+#
+# ./fec.sh [-runs <count>] [-size <size>] [-algo <aimd|bbr|none>] [-loss <%,...>] [-fec <off|data/parity,...>]
+#          [-delay <ms>] [-seed <seed>] [-rudp-options "<sender options>"] [-port <first port>] [-o <out>]
+#
+# -fec off,8/1,8/2 compares no FEC with blocks of 8 data packets and 1 or 2 parity packets.
+# The same seed gives every setting the same losses.
+
+RUNS=3
+SIZE=16M
+ALGO=aimd
+LOSS=0,1,2,5,10
+FEC=off,8/1,8/2,4/1
+DELAY=5
+SEED=1
+RUDP_OPTIONS=
+PORT=40000
+OUT=fec
+
+usage() {
+    sed -n '6,7p' "$0" | sed 's/^# //' >&2
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    [ $# -lt 2 ] && usage
+    case "$1" in
+        -runs) RUNS=$2 ;;
+        -size) SIZE=$2 ;;
+        -algo) ALGO=$2 ;;
+        -loss) LOSS=$2 ;;
+        -fec) FEC=$2 ;;
+        -delay) DELAY=$2 ;;
+        -seed) SEED=$2 ;;
+        -rudp-options) RUDP_OPTIONS=$2 ;;
+        -port) PORT=$2 ;;
+        -o) OUT=$2 ;;
+        *) usage ;;
+    esac
+    shift 2
+done
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+RESULTS="$OUT.csv"
+echo "loss_percent,fec,runs,mean_goodput_mbs,stddev_goodput_mbs,mean_retransmits" > "$RESULTS"
+
+total=$(( $(echo "${LOSS//,/ }" | wc -w) * $(echo "${FEC//,/ }" | wc -w) ))
+count=0
+for loss in ${LOSS//,/ }; do
+    for fec in ${FEC//,/ }; do
+        count=$((count + 1))
+        echo "[$count/$total] loss $loss%, FEC $fec" >&2
+
+        # benchmark.sh listens two ports above the one it's given, the proxy one above that
+        PORT=$((PORT + 4))
+        "$BIN/benchmark.sh" -protocols rudp -rudp-algos "$ALGO" -sizes "$SIZE" -runs "$RUNS" -port "$PORT" \
+            -impair "-loss $loss -delay $DELAY -seed $SEED" -rudp-options "-fec $fec $RUDP_OPTIONS" \
+            -o "$WORK/run" 2> "$WORK/run.log"
+        if [ ! -s "$WORK/run.csv" ] || [ "$(wc -l < "$WORK/run.csv")" -lt 2 ]; then
+            echo "  no results, see:" >&2
+            tail -5 "$WORK/run.log" >&2
+            continue
+        fi
+
+        awk -F, -v OFS=, -v loss="$loss" -v fec="$fec" '
+            NR > 1 { n++; sum += $6; squares += $6 * $6; retransmits += $7 }
+            END {
+                mean = sum / n
+                variance = 0
+                if (n > 1) variance = (squares - n * mean * mean) / (n - 1)
+                if (variance < 0) variance = 0
+                printf "%s,%s,%d,%.3f,%.3f,%.1f\n", loss, fec, n, mean, sqrt(variance), retransmits / n
+            }
+        ' "$WORK/run.csv" >> "$RESULTS"
+        rm -f "$WORK/run.csv" "$WORK/run.json"
+    done
+done
+
+echo "$(($(wc -l < "$RESULTS") - 1)) measurements written to $RESULTS" >&2
+
+# goodput in MB/s, one row per loss rate and one column per FEC setting
+awk -F, -v settings="$FEC" '
+    BEGIN { columns = split(settings, setting, ",") }
+    NR > 1 {
+        if (!($1 in seen)) { seen[$1] = 1; losses[++rows] = $1 }
+        goodput[$1, $2] = $4
+    }
+    END {
+        printf "%-8s", "loss %"
+        for (c = 1; c <= columns; c++) printf " %10s", "FEC " setting[c]
+        printf "\n"
+        for (r = 1; r <= rows; r++) {
+            printf "%-8s", losses[r]
+            for (c = 1; c <= columns; c++) {
+                value = "-"
+                if ((losses[r], setting[c]) in goodput) value = goodput[losses[r], setting[c]]
+                printf " %10s", value
+            }
+            printf "\n"
+        }
+    }
+' "$RESULTS"
@@ -0,0 +1,122 @@
+#!/bin/bash
+# Tries every combination of congestion control and TCP socket options with ./benchmark.sh and
+# reports the one with the highest mean throughput on the current path. Every combination is a row of <out>.csv.
+#
+# ./sweep.sh [-runs <count>] [-size <size>] [-algos <algorithm,...>] [-sndbuf <bytes,...>] [-rcvbuf <bytes,...>]
+#            [-nodelay <0|1,...>] [-cork <0|1,...>] [-notsent-lowat <bytes,...>] [-pacing <Mbit/s,...>]
+#            [-quickack <0|1,...>] [-impair "<proxy options>"] [-port <first port>] [-o <out>]
+#
+# A value of - (the default of every option) leaves the option at the kernel's default, so
+# -sndbuf -,262144 tries autotuning and a fixed 256 KB buffer. The algorithms default to all the kernel has.
+
+RUNS=3
+SIZE=16M
+ALGOS=$(tr ' ' ',' < /proc/sys/net/ipv4/tcp_available_congestion_control)
+SNDBUF=-
+RCVBUF=-
+NODELAY=-
+CORK=-
+NOTSENT_LOWAT=-
+PACING=-
+QUICKACK=-
+IMPAIR=
+PORT=30000
+OUT=sweep
+
+usage() {
+    sed -n '5,7p' "$0" | sed 's/^# //' >&2
+    exit 1
+}
+
+while [ $# -gt 0 ]; do
+    [ $# -lt 2 ] && usage
+    case "$1" in
+        -runs) RUNS=$2 ;;
+        -size) SIZE=$2 ;;
+        -algos) ALGOS=$2 ;;
+        -sndbuf) SNDBUF=$2 ;;
+        -rcvbuf) RCVBUF=$2 ;;
+        -nodelay) NODELAY=$2 ;;
+        -cork) CORK=$2 ;;
+        -notsent-lowat) NOTSENT_LOWAT=$2 ;;
+        -pacing) PACING=$2 ;;
+        -quickack) QUICKACK=$2 ;;
+        -impair) IMPAIR=$2 ;;
+        -port) PORT=$2 ;;
+        -o) OUT=$2 ;;
+        *) usage ;;
+    esac
+    shift 2
+done
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# every combination of the option lists, one string of socket options each
+combinations=("")
+expand() {
+    local flag=$1 values=$2 next=() combination value
+    for combination in "${combinations[@]}"; do
+        for value in ${values//,/ }; do
+            if [ "$value" = - ]; then
+                next+=("$combination")
+            else
+                next+=("$combination $flag $value")
+            fi
+        done
+    done
+    combinations=("${next[@]}")
+}
+expand -sndbuf "$SNDBUF"
+expand -rcvbuf "$RCVBUF"
+expand -nodelay "$NODELAY"
+expand -cork "$CORK"
+expand -notsent-lowat "$NOTSENT_LOWAT"
+expand -pacing "$PACING"
+expand -quickack "$QUICKACK"
+
+RESULTS="$OUT.csv"
+echo "algorithm,options,runs,mean_throughput_mbs,stddev_throughput_mbs,mean_retransmits" > "$RESULTS"
+
+total=$(( $(echo "${ALGOS//,/ }" | wc -w) * ${#combinations[@]} ))
+count=0
+for algorithm in ${ALGOS//,/ }; do
+    for options in "${combinations[@]}"; do
+        count=$((count + 1))
+        options=${options# }
+        echo "[$count/$total] $algorithm ${options:-(kernel defaults)}" >&2
+
+        # benchmark.sh listens two ports above the one it's given, the proxy one above that
+        PORT=$((PORT + 4))
+        "$BIN/benchmark.sh" -protocols tcp -algos "$algorithm" -sizes "$SIZE" -runs "$RUNS" -port "$PORT" \
+            -tcp-options "$options" ${IMPAIR:+-impair "$IMPAIR"} -o "$WORK/run" 2> "$WORK/run.log"
+        if [ ! -s "$WORK/run.csv" ] || [ "$(wc -l < "$WORK/run.csv")" -lt 2 ]; then
+            echo "  no results, see:" >&2
+            tail -5 "$WORK/run.log" >&2
+            continue
+        fi
+
+        awk -F, -v OFS=, -v algorithm="$algorithm" -v options="$options" '
+            NR > 1 { n++; sum += $6; squares += $6 * $6; retransmits += $7 }
+            END {
+                mean = sum / n
+                variance = 0
+                if (n > 1) variance = (squares - n * mean * mean) / (n - 1)
+                if (variance < 0) variance = 0
+                printf "%s,%s,%d,%.3f,%.3f,%.1f\n", algorithm, options, n, mean, sqrt(variance), retransmits / n
+            }
+        ' "$WORK/run.csv" >> "$RESULTS"
+        rm -f "$WORK/run.csv" "$WORK/run.json"
+    done
+done
+
+# the fastest configuration on this path
+best=$(tail -n +2 "$RESULTS" | sort -t, -k4,4 -g -r | head -1)
+if [ -z "$best" ]; then
+    echo "No configuration finished." >&2
+    exit 1
+fi
+echo "$(($(wc -l < "$RESULTS") - 1)) configurations written to $RESULTS" >&2
+IFS=, read -r algorithm options runs mean stddev retransmits <<< "$best"
+echo "Best: -algo $algorithm ${options:-(kernel defaults)}: ${mean}MB/s (stddev ${stddev}MB/s, ${retransmits} retransmits per run over $runs runs)"